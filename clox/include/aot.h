@@ -0,0 +1,92 @@
+#ifndef CLOX_AOT_H
+#define CLOX_AOT_H
+#include <stdio.h>
+#include "common.h"
+#include "object.h"
+#include "value.h"
+#include "table.h"
+#include "vm.h"
+#include "jit.h"
+
+//clox --emit-c turns a script into a C program , one C function per lox function. they follow the
+//same contract as the jit's machine code (see NativeCode) and are linked against bin/libclox.a ,
+//which is every source file but main.c. the bytecode goes along as a .loxc image in a byte array ,
+//it is what the objects are made from and what jitStep() decodes for the instructions that aren't inline
+
+//writes the program to out , false if the script holds something an image can't store
+bool emitC(FILE* out,ObjFunction* script,const char* path);
+//main() of a generated program , functions are in the order emitC() numbered them
+int runCompiled(const uint8_t* image,size_t size,const NativeCode* functions,int count);
+
+//what the generated code is written in. while a function runs
+//  slots      frame->slots
+//  sp         the stack top , written to vm.stackTop before anything else gets to look at the stack
+//  code       the chunk's bytecode , for the helpers
+//  constants  the chunk's constants
+#define AOT_ENTER() \
+    Value* slots = frame->slots;\
+    Value* sp = vm.stackTop;\
+    uint8_t* code = frame->closure->function->chunk.code;\
+    Value* constants = frame->closure->function->chunk.constants.values;\
+    (void)slots,(void)code,(void)constants
+
+#define AOT_FALSEY(value) (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+//the instruction at offset through one of the jit helpers , the stack may have moved afterwards
+#define AOT_CALL_VM(helper,offset) \
+    do{\
+        vm.stackTop = sp;\
+        frame = helper(frame,code + (offset));\
+        if(frame == NULL) return JIT_ERROR;\
+        slots = frame->slots;\
+        sp = vm.stackTop;\
+    }while(false)
+
+#define AOT_BINARY(valueType,op,offset) \
+    do{\
+        if(IS_NUMBER(sp[-2]) && IS_NUMBER(sp[-1])){\
+            sp[-2] = valueType(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1]));\
+            sp--;\
+        }\
+        else AOT_CALL_VM(jitStep,offset);\
+    }while(false)
+
+//the optimizer proved both operands are numbers
+#define AOT_BINARY_NUM(valueType,op) \
+    do{\
+        sp[-2] = valueType(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1]));\
+        sp--;\
+    }while(false)
+
+//nothing to close and no frame objects is the common case , that one pops the frame inline
+#define AOT_RETURN(offset) \
+    do{\
+        if((vm.openUpvalues == NULL || vm.openUpvalues->location < slots) && frame->frameObjects == NULL){\
+            slots[0] = sp[-1];\
+            vm.stackTop = slots + 1;\
+            vm.frameCount--;\
+            return JIT_RETURNED;\
+        }\
+        vm.stackTop = sp;\
+        jitReturn(frame,code + (offset));\
+        return JIT_RETURNED;\
+    }while(false)
+
+#define AOT_TAIL_CALL(offset) \
+    do{\
+        vm.stackTop = sp;\
+        frame = jitTailCall(frame,code + (offset));\
+        if(frame == NULL) return JIT_ERROR;\
+        if(frame == JIT_FRAME_REPLACED) return JIT_TAIL_CALLED;\
+        slots = frame->slots;\
+        sp = vm.stackTop;\
+    }while(false)
+
+//jitStep() only ever reports the error for these
+#define AOT_FAIL(offset) \
+    do{\
+        vm.stackTop = sp;\
+        jitStep(frame,code + (offset));\
+        return JIT_ERROR;\
+    }while(false)
+#endif
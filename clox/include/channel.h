@@ -0,0 +1,59 @@
+#ifndef CLOX_CHANNEL_H
+#define CLOX_CHANNEL_H
+#include <stddef.h>
+#include "common.h"
+#include "value.h"
+#include "object.h"
+
+//isolates (see isolate.h) talk through channels , queues that live outside every heap. what goes
+//through one is a message , a copy of the value taken when it was sent
+//  numbers , booleans and nil   by value
+//  strings                      zero copy , the chars move into a SharedString the first time a string is sent
+//  lists and instances          rebuilt in the receiver , parts that were shared (or cyclic) stay that way.
+//                               an instance needs a class of the same name in the receiver's globals
+//  channels                     by reference
+//functions , classes and natives can't be sent
+
+#define CHANNEL_CAPACITY 256 //messages a channel holds before send() waits for a receiver
+
+//immutable , refcounted and freed by whichever isolate lets go of it last. an ObjString with
+//obj.isShared keeps its chars in one instead of the heap
+typedef struct SharedString{
+    int32_t refs;
+    int length;
+    uint32_t hash;
+    char chars[];
+}SharedString;
+
+#define SHARED_STRING(string) ((SharedString*)((string)->chars - offsetof(SharedString,chars)))
+
+void retainString(SharedString* shared);
+void releaseString(SharedString* shared);
+
+typedef struct MessageNode MessageNode;
+
+typedef struct{
+    Value value;//the whole message when that is a number , a boolean or nil
+    MessageNode* nodes;//NULL in that case , otherwise node 0 is the value
+    int nodeCount;
+    int* links;//the elements of lists and the fields of instances , as node indices
+    int linkCount;
+}Message;
+
+//NULL , or why the value can't be sent. nothing is left to free when it fails
+const char* packMessage(Message* message,Value value);
+//builds the value in this isolate's heap , the message stays as it is so it can be unpacked again
+const char* unpackMessage(Message* message,Value* value);
+void freeMessage(Message* message);
+
+typedef struct Channel Channel;
+
+//comes back with one reference , the caller's
+Channel* openChannel();
+void retainChannel(Channel* channel);
+void releaseChannel(Channel* channel);
+//the channel owns the message afterwards , waits while it is full
+void channelSend(Channel* channel,Message* message);
+//waits until there is a message , the caller frees it
+void channelReceive(Channel* channel,Message* message);
+#endif
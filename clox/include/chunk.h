@@ -47,9 +47,29 @@ typedef enum {
   OP_INVOKE_SUPER,
   OP_MAKE_LIST,
   OP_GET_ELEMENT,
-  OP_SET_ELEMENT
+  OP_SET_ELEMENT,
+  OP_CALL_LOCAL,
+  OP_RELEASE,
+  OP_ADD_NUM,//arithmetic and comparisons the optimizer proved to only ever see numbers
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_LESS_NUM,
+  OP_GREATER_NUM,
+  OP_TAIL_CALL,
+  OP_FOR_PREP,//counted for loops , see forStatement
+  OP_FOR_LOOP,
+  OP_TAIL_INVOKE//OP_INVOKE right before a return
 } OpCode;
 
+//how a counted loop compares its counter to the limit
+typedef enum{
+  LOOP_LESS,
+  LOOP_LESS_EQUAL,
+  LOOP_GREATER,
+  LOOP_GREATER_EQUAL
+} LoopComparison;
+
 typedef struct{
   int offset;
   int line;
@@ -71,6 +91,11 @@ void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte,int line);
 void freeChunk(Chunk* chunk);
 
+int instructionLength(Chunk* chunk,int offset);
+int stackEffect(Chunk* chunk,int offset);
+int jumpTarget(Chunk* chunk,int offset);
+
 int addConstant(Chunk* chunk, Value value);
 bool writeConstant(Chunk* chunk,Value value,int line);
+bool writeConstantIndex(Chunk* chunk,int index,int line);
 #endif
\ No newline at end of file
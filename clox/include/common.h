@@ -3,6 +3,11 @@
 #include  <stdbool.h> //for bool
 #include <stddef.h>  //for size_t
 #include <stdint.h> //for explicit integer types
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
 #define NAN_BOXING
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE   
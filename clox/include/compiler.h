@@ -2,6 +2,27 @@
 #define CLOX_COMPILER_H
 #include "chunk.h"  
 #include "object.h"
+typedef struct{
+    bool optimize;//run the optimizer over every function before handing it to the vm
+    bool lazy;//skip function bodies until they are first called
+    bool jit;//compile hot functions to machine code
+    bool feedback;//have the interpreter record operand types , receivers and call targets
+}CompilerOptions;
+
+extern CompilerOptions compilerOptions;//process wide , set before the first isolate starts and only read after that
+
+//a compile that leaves the vm alone , so several can run on different threads at once.
+//what it allocates stays in the unit until adoptCompiled() hands it over on the vm's thread
+typedef struct{
+    ObjFunction* function;//NULL after a compile error
+    ObjectPool pool;
+    struct RetainedSource* retained;
+}CompiledUnit;
+
 ObjFunction* compile(const char* source);
+void compileDetached(const char* source,CompiledUnit* unit);
+ObjFunction* adoptCompiled(CompiledUnit* unit);
+bool compileLazy(ObjFunction* function);
+void freeRetainedSources();
 void markCompilerRoots();
 #endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef CLOX_FEEDBACK_H
+#define CLOX_FEEDBACK_H
+#include <stdio.h>
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+//with --dump-feedback the interpreter writes down what it saw at the instructions a later tier would
+//specialize on. a function gets its vector the first time one of them runs , one site per instruction ,
+//so the memory is bounded by the size of its code. machine code from --jit doesn't record anything
+
+#define FEEDBACK_WAYS 4 //classes or functions a site remembers before it counts as megamorphic
+
+//operand types , or'ed together over every run
+#define FEEDBACK_NUMBER 1
+#define FEEDBACK_STRING 2
+#define FEEDBACK_BOOL 4
+#define FEEDBACK_NIL 8
+#define FEEDBACK_INSTANCE 16
+#define FEEDBACK_OTHER 32
+
+typedef enum{
+    SITE_OPERANDS,//arithmetic , comparisons and equality
+    SITE_RECEIVER,//property access and invoke
+    SITE_CALL,
+    SITE_LOOP//a backward jump , count is the iterations
+}SiteKind;
+
+typedef struct{
+    uint32_t offset;
+    uint8_t kind;
+    uint8_t types;
+    uint8_t ways;//entries used in seen , FEEDBACK_WAYS + 1 once a site saw more than it can hold
+    uint32_t count;
+    Obj* seen[FEEDBACK_WAYS];//receiver classes or call targets (the function for a closure)
+}FeedbackSite;
+
+typedef struct Feedback{
+    struct Feedback* next;//every function that has one , for the gc and the dump
+    ObjFunction* function;
+    uint32_t invocations;
+    int siteCount;
+    FeedbackSite* sites;//in offset order
+    uint16_t* siteAt;//one per code byte , index + 1 into sites , 0 where nothing is recorded
+}Feedback;
+
+//at is the instruction , called by run() before it executes
+void feedbackOperands(ObjFunction* function,uint8_t* at,Value a,Value b);
+void feedbackReceiver(ObjFunction* function,uint8_t* at,Value receiver);
+void feedbackCall(ObjFunction* function,uint8_t* at,Value callee);
+void feedbackLoop(ObjFunction* function,uint8_t* at);
+//counted where an interpreted call site starts the call , so callInline() answers and tail calls count
+//but calls made from machine code don't , NULL is ignored
+void feedbackInvocation(ObjFunction* function);
+
+//what the sites saw stays alive as long as the function does
+void markFeedback();
+void freeFeedback(ObjFunction* function);
+void dumpFeedback(FILE* out);
+#endif
@@ -0,0 +1,33 @@
+#ifndef CLOX_ISOLATE_H
+#define CLOX_ISOLATE_H
+#include "common.h"
+#include "vm.h"
+#include "channel.h"
+
+//vm is thread local , so every thread that calls initVM() has a vm of its own with its own heap ,
+//strings and globals. an isolate is a thread that runs one script in one. isolates share no objects ,
+//nothing in the runtime takes a lock , and a host can run one per core. compilerOptions is the only
+//thing they have in common and it must not change while any of them runs. they talk through channels ,
+//see channel.h
+
+typedef struct Isolate Isolate;
+
+//starts a thread that compiles and runs the source (copied , the caller keeps its own) , NULL if the
+//system won't give us a thread. the isolate owns argument (which can be NULL) whether it starts or not
+Isolate* spawnIsolate(const char* source,Message* argument);
+//waits for the script to finish and frees the isolate
+InterpretResult joinIsolate(Isolate* isolate);
+
+//spawn() from a script , the isolate is joined by this thread's freeVM()
+bool spawnFile(const char* path,Message* argument);
+void joinSpawned();
+//what the isolate running on this thread was spawned with , NULL for none
+Message* isolateArgument();
+
+//a file compiled on a thread of its own with compileDetached() , while this one goes on.
+//startCompile() is NULL if the file can't be read or no thread can be had
+typedef struct CompileJob CompileJob;
+CompileJob* startCompile(const char* path);
+//waits for the compile and adopts it into this thread's vm , NULL after a compile error (already reported)
+ObjFunction* finishCompile(CompileJob* job);
+#endif
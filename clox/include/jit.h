@@ -0,0 +1,39 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+//machine code needs nan boxed values and x86-64 with the System V calling convention ,
+//everywhere else jitCompile() turns every function down and they stay interpreted
+#if defined(NAN_BOXING) && defined(__x86_64__) && !defined(_WIN32)
+#define JIT_ENABLED
+#endif
+
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000 //calls before a function is compiled to machine code
+#endif
+#define JIT_DEPTH_MAX 256 //machine code frames nested on the C stack , calls deeper than that are interpreted
+
+typedef enum{
+    JIT_ERROR,//a runtime error was reported and the stack reset
+    JIT_RETURNED,//the result replaced the callee and its arguments
+    JIT_TAIL_CALLED//the frame was handed to a tail called function that hasn't started yet
+}JitStatus;
+
+typedef JitStatus (*NativeCode)(CallFrame* frame,VM* vm);
+
+//what jitTailCall() returns when the callee took the frame over
+#define JIT_FRAME_REPLACED ((CallFrame*)1)
+
+//compiles the function's chunk , false leaves it to the interpreter
+bool jitCompile(ObjFunction* function);
+void jitFree(ObjFunction* function);
+
+//defined in vm.c , the machine code calls these for everything it doesn't do inline.
+//at is the instruction , what comes back is the frame (vm.frames may have moved) or NULL after a runtime error
+CallFrame* jitStep(CallFrame* frame,uint8_t* at);
+CallFrame* jitCall(CallFrame* frame,uint8_t* at);
+CallFrame* jitReturn(CallFrame* frame,uint8_t* at);
+CallFrame* jitTailCall(CallFrame* frame,uint8_t* at);
+#endif
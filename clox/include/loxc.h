@@ -0,0 +1,20 @@
+#ifndef CLOX_LOXC_H
+#define CLOX_LOXC_H
+#include "object.h"
+
+//compiled scripts cached next to their source as .loxc files
+//bump this whenever the bytecode or the file layout changes
+#define LOXC_VERSION 3
+
+//the script function stored at path , NULL if there is none or it was compiled from other source
+//a NULL source takes the image as it is , for shipping scripts without their source
+ObjFunction* loadBytecode(const char* path,const char* source);
+//failures are ignored , the script just gets compiled again next time
+void saveBytecode(const char* path,const char* source,ObjFunction* function);
+//the same image in memory , malloced , NULL if something in the function can't be stored
+uint8_t* saveImage(ObjFunction* function,size_t* size);
+//an image that outlives the vm , like the one --emit-c compiles into a program. flags aren't checked
+ObjFunction* loadImage(const uint8_t* bytes,size_t size);
+//only after freeVM() , loaded functions and strings point into the images
+void unmapBytecode();
+#endif
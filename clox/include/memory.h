@@ -3,6 +3,8 @@
 #include "common.h"
 #include "object.h"
 #include "value.h"
+#define LARGE_OBJECT_THRESHOLD (1024*64) //arrays this big are mmapped and accounted separately
+#define LARGE_HEAP_MIN (1024*1024*16)
 #define GROW_CAPACITY(capacity) ((capacity)<8?8:(capacity)*2)
 #define GROW_ARRAY(type,pointer,oldCount,newCount) (type*)reallocate(pointer,sizeof(type)*(oldCount),sizeof(type)*(newCount))
 #define FREE_ARRAY(type,pointer,oldCount) reallocate(pointer,sizeof(type)*(oldCount),0)
@@ -15,4 +17,7 @@ void markValue(Value slot);
 
 void collectGarbage();
 void freeObjects();
+void freeObjectList(Obj* objects);
+void releaseObject(Obj** list, Obj* object);
+void promoteObject(Obj** list, Obj* object);
 #endif
\ No newline at end of file
@@ -21,6 +21,12 @@
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
+#define IS_UPVALUE(value)      isObjType(value, OBJ_UPVALUE)
+#define IS_CHANNEL(value)      isObjType(value,OBJ_CHANNEL)
+#define IS_FIBER(value)        isObjType(value,OBJ_FIBER)
+#define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
+#define AS_CHANNEL(value)      ((ObjChannel*)AS_OBJ(value))
+#define AS_UPVALUE(value)      ((ObjUpvalue*)AS_OBJ(value))
 #define AS_NATIVE(value) \
     (((ObjNative*)AS_OBJ(value))->function)
 
@@ -33,21 +39,60 @@ typedef enum{
     OBJ_BOUND_METHOD,
     OBJ_CLASS,
     OBJ_INSTANCE,
-    OBJ_LIST
+    OBJ_LIST,
+    OBJ_CHANNEL,
+    OBJ_FIBER
 }ObjType;
 
 struct Obj{
     ObjType type;
     Obj* next;
     bool isMarked;
+    bool isFrameLocal;//owned by a call frame instead of the gc , see OP_CALL_LOCAL
+    bool isImmortal;//points into a mapped bytecode image , the gc never sweeps it
+    bool isShared;//a string whose chars are a SharedString , see channel.h
 }; 
 
+//bodies simple enough that a call can produce the result without a frame
+typedef enum{
+    INLINE_NONE,
+    INLINE_CONSTANT,//returns inlineValue
+    INLINE_SLOT,//returns one of its arguments , or the receiver for slot 0
+    INLINE_FIELD//returns the field of the receiver named by inlineValue
+}InlineKind;
+
+typedef struct{
+    const char* start;
+    int length;
+}LazyName;
+
+//a body the compiler skipped over with --lazy , compiled the first time the function is called
+typedef struct{
+    const char* start;//the parameter list , in source the compiler keeps until the vm is freed
+    int line;
+    uint8_t type;//FunctionType
+    uint8_t classDepth;//0 outside a class , 1 in a class , 2 in a class with a superclass
+    int upvalueCount;
+    LazyName* upvalueNames;//what each captured variable was called where the function was defined
+}LazyBody;
+
 typedef struct{
     Obj obj;
     int arity;
     int upvalueCount;
+    int maxStack;//deepest the operand stack gets relative to the frame's slots , computed by the compiler
     Chunk chunk;
     ObjString* name;
+    struct ObjClosure* closure;//functions without upvalues share one closure
+    uint8_t inlineKind;
+    uint16_t inlineSlot;
+    Value inlineValue;//always one of the function's own constants
+    LazyBody* lazy;//NULL once there is code
+    uint32_t calls;//counted with --jit until the function is hot
+    void* native;//machine code from the jit , NULL while it is interpreted
+    size_t nativeSize;
+    struct Trace* traces;//loops the tracing jit recorded in this function
+    struct Feedback* feedback;//what the interpreter saw run , with --dump-feedback
 }ObjFunction;
 
 
@@ -66,11 +111,11 @@ typedef struct ObjUpvalue{
   struct ObjUpvalue* next;
 }ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure{
   Obj obj;
   ObjFunction* function;
-  ObjUpvalue** upvalues;
   int upvalueCount;
+  Value upvalues[];//an ObjUpvalue for variables that get assigned , the value itself for the rest
 } ObjClosure;
 
 typedef struct {
@@ -96,6 +141,45 @@ typedef struct{
     ValueArray objects;
 }ObjList;
 
+struct Channel;
+struct SharedString;
+
+//one isolate's handle on a channel , every handle holds a reference
+typedef struct{
+    Obj obj;
+    struct Channel* channel;
+}ObjChannel;
+
+//what a fiber runs on. while it runs these are the vm's own fields , the same arrays , so a switch
+//moves a few pointers and copies no values
+typedef struct{
+    struct CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
+    Value* stackTop;
+    int stackCapacity;
+    ObjUpvalue* openUpvalues;
+}FiberStacks;
+
+typedef enum{
+    FIBER_NEW,//not resumed yet
+    FIBER_SUSPENDED,//in yield() or transfer()
+    FIBER_RUNNING,//running , or waiting in resume() for a fiber it started
+    FIBER_DONE//returned , or failed
+}FiberState;
+
+//a function running on stacks of its own , see fiber() in vm.c
+typedef struct ObjFiber{
+    Obj obj;
+    uint8_t state;
+    int pending;//values on top of a suspended stack , the call to yield() or transfer() resume() returns from
+    ObjClosure* function;
+    struct ObjFiber* caller;//waiting in resume() for this one , NULL for the script
+    struct ObjFiber* nextFiber;//every fiber , for the gc
+    FiberStacks saved;//while it isn't running
+}ObjFiber;
+
 typedef Value (*NativeFn)(int argCount, Value* args);
 
 typedef struct {
@@ -105,16 +189,36 @@ typedef struct {
 
 const char* objTypeName(ObjType type);
 
+//while one is active objects are allocated into it instead of the vm , nothing is collected and
+//strings are interned in its own table. that is what lets a compile run off the vm's thread
+typedef struct{
+    Obj* objects;
+    Table strings;
+    size_t bytesAllocated;
+    size_t largeBytesAllocated;
+}ObjectPool;
+
+extern THREAD_LOCAL ObjectPool* objectPool;
+void initObjectPool(ObjectPool* pool);
+void adoptObjectPool(ObjectPool* pool);
+ObjString* internString(ObjString* string);
+
 ObjClass* newClass(ObjString* name);
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjInstance* newInstance(ObjClass* klass);
+ObjInstance* newFrameInstance(ObjClass* klass, Obj** frameObjects);
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjNative* newNative(NativeFn function);
 ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);  
+ObjString* copyString(const char* chars, int length);
+ObjString* mappedString(const char* chars, int length);  
 ObjUpvalue* newUpvalue(Value* slot); 
 ObjList* newList();
+ObjChannel* newChannel(struct Channel* channel);
+ObjFiber* newFiber(ObjClosure* function);
+//a string for chars another isolate sent , interned like any other
+ObjString* sharedString(struct SharedString* shared);
 void printObject(Value value);
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
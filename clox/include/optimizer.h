@@ -0,0 +1,7 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+#include "chunk.h"
+
+//rewrites a finished chunk in place , initialDepth is the stack height the function starts with
+void optimizeChunk(Chunk* chunk,int initialDepth);
+#endif
@@ -33,6 +33,14 @@ typedef struct{
     int line;
 }Token;
 
-void initScanner(const char* source);   
-Token scanToken();
+//all the scanner state , each compile has its own so several can run at once
+typedef struct{
+    const char* start;
+    const char* current;
+    int line;
+}Scanner;
+
+void initScanner(Scanner* scanner,const char* source);
+void initScannerAt(Scanner* scanner,const char* source,int line);//somewhere in the middle of a source   
+Token scanToken(Scanner* scanner);
 #endif
\ No newline at end of file
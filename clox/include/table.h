@@ -18,6 +18,7 @@ typedef struct{
 void initTable(Table* table,int capacity);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
+Value* tableValueAddress(Table* table,ObjString* key);
 bool tableSet(Table* table,ObjString* key,Value value);
 bool tableDelete(Table* table,ObjString* key);
 void tableAddAll(Table* from, Table* to);
@@ -0,0 +1,37 @@
+#ifndef CLOX_TRACE_H
+#define CLOX_TRACE_H
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#ifndef HOT_LOOP_THRESHOLD
+#define HOT_LOOP_THRESHOLD 56 //backward jumps to one loop header before an iteration gets recorded
+#endif
+#define TRACE_ATTEMPTS 4 //recordings in a row that may fail before a loop is left to the interpreter for good
+#define TRACE_BACKOFF 10 //a loop that keeps changing its path waits up to 2^10 times longer before it is recorded again
+#define TRACE_MAX 256 //ir instructions in one trace
+
+//one loop of one function , recorded through a single iteration and compiled to a straight line of
+//machine code that jumps back to its own top until a guard fails
+typedef struct Trace{
+    struct Trace* next;//the function's other loops
+    uint8_t* header;//the instruction the loop jumps back to
+    uint8_t* end;//just past the jump back , where the loop is left
+    void* code;//NULL until a recording made it through
+    size_t size;
+    Entry* globals;//vm.globals.entries when it was recorded , the code holds addresses into it
+    int attempts;
+    int sideExits;//guards that failed inside the loop since it was recorded
+    int retraces;
+}Trace;
+
+//returns where the interpreter carries on , having left the stack and frame->slots the way it would have
+typedef uint8_t* (*TraceCode)(Value* slots,VM* vm);
+
+//called by run() with --jit on every backward jump , after it already jumped. NULL (every
+//HOT_LOOP_THRESHOLD jumps) once recording the loop failed TRACE_ATTEMPTS times , run() then
+//moves the frame into the function's baseline machine code instead
+uint8_t* hotLoop(CallFrame* frame,uint8_t* header);
+void freeTraces(ObjFunction* function);
+#endif
@@ -1,27 +1,36 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
-#define FRAMES_MAX 1024
+#define FRAMES_MAX (1024*64)
 #define STACK_MAX (FRAMES_MAX * UINT8_MAX)
+#define FRAMES_INITIAL 64
+#define STACK_SEGMENT 256 //the stack starts with one segment and grows a segment at a time , doubling once it is large
+#define STACK_SLACK 16 //room for the pushes the runtime itself does on top of a frame (gc roots , temporaries)
+#define HOT_LOOPS 64 //loop headers counted at once with --jit , a power of two
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
 #include "object.h"
 
-typedef struct {
+typedef struct CallFrame{
   ObjClosure* closure;
   uint8_t* ip;
   Value* slots;
+  Obj* frameObjects;
 } CallFrame;
 
 typedef struct{
     Chunk* chunk;
     uint8_t* ip;
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
-    Value stack[STACK_MAX];
+    int frameCapacity;
+    Value* stack;
     Value* stackTop;
+    int stackCapacity;
     size_t bytesAllocated;
     size_t nextGC;
+    size_t largeBytesAllocated;
+    size_t nextLargeGC;
     Obj* objects;
     Table strings;
     ObjString* initString;
@@ -30,6 +39,12 @@ typedef struct{
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+    int nativeDepth;//machine code frames currently on the C stack
+    uint16_t hotLoops[HOT_LOOPS];//backward jumps left until a loop header gets traced , by a hash of its address
+    struct Trace* loopTraces[HOT_LOOPS];//the trace last looked up for each of those
+    ObjFiber* fiber;//the one the stacks above belong to , NULL for the script's own
+    FiberStacks script;//the script's while a fiber runs
+    ObjFiber* fibers;//all of them , linked through nextFiber
 }VM;
 
 typedef enum{
@@ -38,10 +53,11 @@ typedef enum{
     INTERPRET_RUNTIME_ERROR
 }InterpretResult;
 
-extern VM vm;
+extern THREAD_LOCAL VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
 
 void push(Value value);
 Value pop();
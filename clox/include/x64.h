@@ -0,0 +1,70 @@
+#ifndef CLOX_X64_H
+#define CLOX_X64_H
+#include "common.h"
+#include "value.h"
+
+//the little bit of x86-64 the jit and the trace compiler emit , only built where JIT_ENABLED is
+
+enum{RAX,RCX,RDX,RBX,RSP,RBP,RSI,RDI,R8,R9,R10,R11,R12,R13,R14,R15};
+enum{CC_B = 0x2,CC_AE = 0x3,CC_E = 0x4,CC_NE = 0x5,CC_BE = 0x6,CC_A = 0x7,CC_NP = 0xb};
+
+//op r/m64,r64
+#define ALU_ADD 0x01
+#define ALU_OR 0x09
+#define ALU_AND 0x21
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+#define ALU_TEST 0x85
+
+//sse2 scalar double ops , f2 0f xx
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+
+typedef struct{
+    int at;//where the rel32 goes
+    int target;//whatever the caller resolves it against
+}Patch;
+
+typedef struct{
+    uint8_t* code;
+    int count;
+    int capacity;
+    Patch* patches;
+    int patchCount;
+    int patchCapacity;
+}Assembler;
+
+void x64Byte(Assembler* as,uint8_t byte);
+void x64Int32(Assembler* as,uint32_t value);
+void x64Int64(Assembler* as,uint64_t value);
+void x64Patch(Assembler* as,int at,int32_t value);
+void x64Rex(Assembler* as,int reg,int rm);
+void x64Alu(Assembler* as,uint8_t op,int rm,int reg);
+void x64Memory(Assembler* as,int reg,int base,int32_t disp);
+void x64Load(Assembler* as,int reg,int base,int32_t disp);
+void x64Store(Assembler* as,int base,int32_t disp,int reg);
+void x64LoadImmediate(Assembler* as,int reg,uint64_t value);
+void x64AddImmediate(Assembler* as,int reg,int32_t value);
+void x64Push(Assembler* as,int reg);
+void x64Pop(Assembler* as,int reg);
+void x64Call(Assembler* as,void* function);
+void x64ToXmm(Assembler* as,int xmm,int reg);
+void x64FromXmm(Assembler* as,int reg,int xmm);
+void x64ScalarDouble(Assembler* as,uint8_t op,int dst,int src);
+void x64CompareDoubles(Assembler* as,int a,int b);
+void x64SetCondition(Assembler* as,int cc,int reg);
+void x64BoxBool(Assembler* as);
+void x64Falsey(Assembler* as);
+void x64JumpTo(Assembler* as,int cc,int target);
+int x64JumpForward(Assembler* as,int cc);
+void x64Land(Assembler* as,int at);
+int x64UnlessNumber(Assembler* as,int reg);
+
+//copies the code into executable pages , NULL if the system won't give us any
+void* x64Finish(Assembler* as,size_t* size);
+void x64Release(void* code,size_t size);
+void freeAssembler(Assembler* as);
+#endif
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "aot.h"
+#include "chunk.h"
+#include "loxc.h"
+
+typedef struct{
+    ObjFunction** functions;
+    int count;
+    int capacity;
+}FunctionList;
+
+//the script first , then every function nested in its constants , depth first. the emitter and the
+//program walk the same tree (the one in the image) so their numbering agrees
+static void collectFunctions(FunctionList* list,ObjFunction* function){
+    if(list->count == list->capacity){
+        list->capacity = list->capacity < 16 ? 16 : list->capacity*2;
+        list->functions = (ObjFunction**)realloc(list->functions,sizeof(ObjFunction*)*list->capacity);
+        if(list->functions == NULL) exit(1);
+    }
+    list->functions[list->count++] = function;
+    ValueArray* constants = &function->chunk.constants;
+    for(int i = 0; i < constants->count; i++){
+        if(IS_OBJ(constants->values[i]) && isObjType(constants->values[i],OBJ_FUNCTION)){
+            collectFunctions(list,AS_FUNCTION(constants->values[i]));
+        }
+    }
+}
+
+//a number constant as a C literal , exact since %a prints every bit
+static void emitNumber(FILE* out,Value* constants,int index){
+    double number = AS_NUMBER(constants[index]);
+    if(isfinite(number)) fprintf(out,"%a",number);
+    else fprintf(out,"AS_NUMBER(constants[%d])",index);
+}
+
+static void emitConstant(FILE* out,Value* constants,int index){
+    Value value = constants[index];
+    if(IS_NUMBER(value)){
+        fprintf(out,"NUMBER_VAL(");
+        emitNumber(out,constants,index);
+        fprintf(out,")");
+    }
+    else if(IS_NIL(value)) fprintf(out,"NIL_VAL");
+    else if(IS_BOOL(value)) fprintf(out,AS_BOOL(value) ? "BOOL_VAL(true)" : "BOOL_VAL(false)");
+    else fprintf(out,"constants[%d]",index);
+}
+
+static void emitForLoop(FILE* out,Chunk* chunk,int offset){
+    uint8_t* at = &chunk->code[offset];
+    int slot = at[1] << 8 | at[2];
+    int limit = at[4] << 8 | at[5];
+    static const char* tests[] = {"value < %s","!(value > %s)","value > %s","!(value < %s)"};
+    fprintf(out,"    {\n");
+    fprintf(out,"        Value counter = slots[%d];\n",slot);
+    fprintf(out,"        Value limit = ");
+    if(at[3]) emitConstant(out,chunk->constants.values,limit);
+    else fprintf(out,"slots[%d]",limit);
+    fprintf(out,";\n");
+    fprintf(out,"        if(!IS_NUMBER(counter) || !IS_NUMBER(limit)) AOT_FAIL(%d);\n",offset);
+    fprintf(out,"        double value = AS_NUMBER(counter)");
+    if(at[0] == OP_FOR_LOOP){
+        fprintf(out," + ");
+        emitNumber(out,chunk->constants.values,at[7] << 8 | at[8]);
+        fprintf(out,";\n");
+        fprintf(out,"        slots[%d] = NUMBER_VAL(value);\n",slot);
+        fprintf(out,"        if(");
+        fprintf(out,tests[at[6]],"AS_NUMBER(limit)");
+    }
+    else{
+        fprintf(out,";\n");
+        fprintf(out,"        if(!(");
+        fprintf(out,tests[at[6]],"AS_NUMBER(limit)");
+        fprintf(out,")");
+    }
+    fprintf(out,") goto L%d;\n",jumpTarget(chunk,offset));
+    fprintf(out,"    }\n");
+}
+
+static void emitInstruction(FILE* out,Chunk* chunk,int offset){
+    uint8_t* at = &chunk->code[offset];
+    Value* constants = chunk->constants.values;
+    switch(at[0]){
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            fprintf(out,"    *sp++ = ");
+            emitConstant(out,constants,at[0] == OP_CONSTANT ? at[1] : at[1] << 8 | at[2]);
+            fprintf(out,";\n");
+            break;
+        case OP_NIL: fprintf(out,"    *sp++ = NIL_VAL;\n"); break;
+        case OP_TRUE: fprintf(out,"    *sp++ = BOOL_VAL(true);\n"); break;
+        case OP_FALSE: fprintf(out,"    *sp++ = BOOL_VAL(false);\n"); break;
+        case OP_POP: fprintf(out,"    sp--;\n"); break;
+        case OP_GET_LOCAL: fprintf(out,"    *sp++ = slots[%d];\n",at[1] << 8 | at[2]); break;
+        case OP_SET_LOCAL: fprintf(out,"    slots[%d] = sp[-1];\n",at[1] << 8 | at[2]); break;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            fprintf(out,"    if(tableGet(&vm.globals,AS_STRING(constants[%d]),sp)) sp++;\n",
+                at[0] == OP_GET_GLOBAL ? at[1] : at[1] << 8 | at[2]);
+            fprintf(out,"    else AOT_CALL_VM(jitStep,%d);\n",offset);
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            fprintf(out,"    goto L%d;\n",jumpTarget(chunk,offset));
+            break;
+        case OP_JUMP_IF_FALSE:
+            fprintf(out,"    if(AOT_FALSEY(sp[-1])) goto L%d;\n",jumpTarget(chunk,offset));
+            break;
+        case OP_EQUAL:
+            fprintf(out,"    sp[-2] = BOOL_VAL(valuesEqual(sp[-2],sp[-1]));\n");
+            fprintf(out,"    sp--;\n");
+            break;
+        case OP_NOT: fprintf(out,"    sp[-1] = BOOL_VAL(AOT_FALSEY(sp[-1]));\n"); break;
+        case OP_NEGATE:
+            fprintf(out,"    if(IS_NUMBER(sp[-1])) sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));\n");
+            fprintf(out,"    else AOT_FAIL(%d);\n",offset);
+            break;
+        case OP_ADD: fprintf(out,"    AOT_BINARY(NUMBER_VAL,+,%d);\n",offset); break;
+        case OP_SUBTRACT: fprintf(out,"    AOT_BINARY(NUMBER_VAL,-,%d);\n",offset); break;
+        case OP_MULTIPLY: fprintf(out,"    AOT_BINARY(NUMBER_VAL,*,%d);\n",offset); break;
+        case OP_DIVIDE: fprintf(out,"    AOT_BINARY(NUMBER_VAL,/,%d);\n",offset); break;
+        case OP_LESS: fprintf(out,"    AOT_BINARY(BOOL_VAL,<,%d);\n",offset); break;
+        case OP_GREATER: fprintf(out,"    AOT_BINARY(BOOL_VAL,>,%d);\n",offset); break;
+        case OP_ADD_NUM: fprintf(out,"    AOT_BINARY_NUM(NUMBER_VAL,+);\n"); break;
+        case OP_SUBTRACT_NUM: fprintf(out,"    AOT_BINARY_NUM(NUMBER_VAL,-);\n"); break;
+        case OP_MULTIPLY_NUM: fprintf(out,"    AOT_BINARY_NUM(NUMBER_VAL,*);\n"); break;
+        case OP_DIVIDE_NUM: fprintf(out,"    AOT_BINARY_NUM(NUMBER_VAL,/);\n"); break;
+        case OP_LESS_NUM: fprintf(out,"    AOT_BINARY_NUM(BOOL_VAL,<);\n"); break;
+        case OP_GREATER_NUM: fprintf(out,"    AOT_BINARY_NUM(BOOL_VAL,>);\n"); break;
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:
+            emitForLoop(out,chunk,offset);
+            break;
+        case OP_RETURN: fprintf(out,"    AOT_RETURN(%d);\n",offset); break;
+        case OP_CALL: fprintf(out,"    AOT_CALL_VM(jitCall,%d);\n",offset); break;
+        case OP_TAIL_CALL:
+        case OP_TAIL_INVOKE:
+            fprintf(out,"    AOT_TAIL_CALL(%d);\n",offset);
+            break;
+        default: fprintf(out,"    AOT_CALL_VM(jitStep,%d);\n",offset); break;
+    }
+}
+
+static void emitFunction(FILE* out,ObjFunction* function,int index){
+    Chunk* chunk = &function->chunk;
+    bool* labels = (bool*)calloc(chunk->count + 1,sizeof(bool));//only jump targets get one
+    if(labels == NULL) exit(1);
+    for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk,offset)){
+        int target = jumpTarget(chunk,offset);
+        if(target >= 0 && target <= chunk->count) labels[target] = true;
+    }
+    fprintf(out,"//%s\n",function->name != NULL ? function->name->chars : "<script>");
+    fprintf(out,"static JitStatus function%d(CallFrame* frame,VM* machine){\n",index);
+    fprintf(out,"    AOT_ENTER();\n");
+    for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk,offset)){
+        if(labels[offset]) fprintf(out,"L%d:\n",offset);
+        emitInstruction(out,chunk,offset);
+    }
+    if(labels[chunk->count]) fprintf(out,"L%d:\n",chunk->count);
+    fprintf(out,"    return JIT_ERROR;//never reached , every chunk ends in a return\n");
+    fprintf(out,"}\n\n");
+    free(labels);
+}
+
+bool emitC(FILE* out,ObjFunction* script,const char* path){
+    size_t size;
+    uint8_t* image = saveImage(script,&size);
+    if(image == NULL) return false;
+    FunctionList list = {NULL,0,0};
+    collectFunctions(&list,script);
+    fprintf(out,"//written by clox --emit-c from %s , build it with\n",path);
+    fprintf(out,"//  cc -O2 -Iclox/include program.c bin/libclox.a -lm\n");
+    fprintf(out,"#include \"aot.h\"\n\n");
+    fprintf(out,"static const uint8_t image[%zu] = {",size);
+    for(size_t i = 0; i < size; i++){
+        fprintf(out,i % 16 == 0 ? "\n    0x%02x," : "0x%02x,",image[i]);
+    }
+    fprintf(out,"\n};\n\n");
+    for(int i = 0; i < list.count; i++) emitFunction(out,list.functions[i],i);
+    fprintf(out,"static const NativeCode functions[%d] = {",list.count);
+    for(int i = 0; i < list.count; i++) fprintf(out,i % 8 == 0 ? "\n    function%d," : "function%d,",i);
+    fprintf(out,"\n};\n\n");
+    fprintf(out,"int main(int argc,const char* argv[]){\n");
+    fprintf(out,"    return runCompiled(image,sizeof(image),functions,%d);\n",list.count);
+    fprintf(out,"}\n");
+    free(list.functions);
+    free(image);
+    return true;
+}
+
+int runCompiled(const uint8_t* image,size_t size,const NativeCode* functions,int count){
+    initVM();
+    ObjFunction* script = loadImage(image,size);
+    FunctionList list = {NULL,0,0};
+    if(script != NULL) collectFunctions(&list,script);
+    if(list.count != count){
+        fprintf(stderr,"The program's bytecode doesn't match its code.\n");
+        exit(70);
+    }
+    for(int i = 0; i < count; i++){
+        list.functions[i]->native = (void*)functions[i];//nativeSize stays 0 , it isn't the jit's to free
+    }
+    free(list.functions);
+    InterpretResult result = interpretFunction(script);
+    freeVM();
+    return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "channel.h"
+#include "memory.h"
+#include "vm.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef _MSC_VER
+#define INCREMENT(refs) InterlockedIncrement((volatile LONG*)(refs))
+#define DECREMENT(refs) InterlockedDecrement((volatile LONG*)(refs))
+#else
+#define INCREMENT(refs) __atomic_add_fetch(refs,1,__ATOMIC_RELAXED)
+#define DECREMENT(refs) __atomic_sub_fetch(refs,1,__ATOMIC_ACQ_REL)
+#endif
+
+void retainString(SharedString* shared){
+    INCREMENT(&shared->refs);
+}
+
+void releaseString(SharedString* shared){
+    if(DECREMENT(&shared->refs) == 0) free(shared);
+}
+
+//the chars leave the heap the first time a string is sent , from then on it is shared by reference.
+//strings are immutable so nothing can tell
+static SharedString* shareString(ObjString* string){
+    if(!string->obj.isShared){
+        SharedString* shared = (SharedString*)malloc(sizeof(SharedString) + string->length + 1);
+        if(shared == NULL) exit(1);
+        shared->refs = 1;//the ObjString's
+        shared->length = string->length;
+        shared->hash = string->hash;
+        memcpy(shared->chars,string->chars,string->length + 1);
+        if(!string->obj.isImmortal) FREE_ARRAY(char,string->chars,string->length + 1);
+        string->chars = shared->chars;
+        string->obj.isShared = true;
+    }
+    SharedString* shared = SHARED_STRING(string);
+    retainString(shared);
+    return shared;
+}
+
+typedef enum{
+    NODE_VALUE,
+    NODE_STRING,
+    NODE_LIST,
+    NODE_INSTANCE,
+    NODE_CHANNEL
+}NodeKind;
+
+struct MessageNode{
+    uint8_t kind;
+    int count;//elements , or fields
+    int links;//where they start in the message's links , a field takes two , its name and its value
+    union{
+        Value value;
+        SharedString* string;//the string , or the class name of an instance
+        Channel* channel;
+    }as;
+};
+
+//the objects already turned into nodes , so a list that is in two places arrives as one list
+typedef struct{
+    Message* message;
+    Obj** objects;//by node , NULL for plain values
+    int nodeCapacity;
+    int linkCapacity;
+    Obj** seenKeys;
+    int* seenNodes;
+    int seenCount;
+    int seenCapacity;
+}Packer;
+
+static int addNode(Packer* packer,uint8_t kind,Obj* object){
+    Message* message = packer->message;
+    if(message->nodeCount == packer->nodeCapacity){
+        packer->nodeCapacity = GROW_CAPACITY(packer->nodeCapacity);
+        message->nodes = (MessageNode*)realloc(message->nodes,sizeof(MessageNode)*packer->nodeCapacity);
+        packer->objects = (Obj**)realloc(packer->objects,sizeof(Obj*)*packer->nodeCapacity);
+        if(message->nodes == NULL || packer->objects == NULL) exit(1);
+    }
+    MessageNode* node = &message->nodes[message->nodeCount];
+    node->kind = kind;
+    node->count = 0;
+    node->links = 0;
+    node->as.value = NIL_VAL;
+    packer->objects[message->nodeCount] = object;
+    return message->nodeCount++;
+}
+
+static void addLink(Packer* packer,int node){
+    Message* message = packer->message;
+    if(message->linkCount == packer->linkCapacity){
+        packer->linkCapacity = GROW_CAPACITY(packer->linkCapacity);
+        message->links = (int*)realloc(message->links,sizeof(int)*packer->linkCapacity);
+        if(message->links == NULL) exit(1);
+    }
+    message->links[message->linkCount++] = node;
+}
+
+//the slot for the object , -1 in it when the object is new
+static int* seenSlot(Packer* packer,Obj* object){
+    uint32_t index = (uint32_t)(((uintptr_t)object >> 4) * 2654435761u) & (packer->seenCapacity - 1);
+    while(packer->seenKeys[index] != NULL && packer->seenKeys[index] != object){
+        index = (index + 1) & (packer->seenCapacity - 1);
+    }
+    if(packer->seenKeys[index] == NULL){
+        packer->seenKeys[index] = object;
+        packer->seenNodes[index] = -1;
+        packer->seenCount++;
+    }
+    return &packer->seenNodes[index];
+}
+
+static void growSeen(Packer* packer){
+    int capacity = packer->seenCapacity;
+    Obj** keys = packer->seenKeys;
+    int* nodes = packer->seenNodes;
+    packer->seenCapacity = capacity < 16 ? 16 : capacity*2;
+    packer->seenCount = 0;
+    packer->seenKeys = (Obj**)calloc(packer->seenCapacity,sizeof(Obj*));
+    packer->seenNodes = (int*)malloc(sizeof(int)*packer->seenCapacity);
+    if(packer->seenKeys == NULL || packer->seenNodes == NULL) exit(1);
+    for(int i = 0; i < capacity; i++){
+        if(keys[i] != NULL) *seenSlot(packer,keys[i]) = nodes[i];
+    }
+    free(keys);
+    free(nodes);
+}
+
+//-1 when the value can't be sent
+static int nodeFor(Packer* packer,Value value){
+    if(!IS_OBJ(value)){
+        int node = addNode(packer,NODE_VALUE,NULL);
+        packer->message->nodes[node].as.value = value;
+        return node;
+    }
+    Obj* object = AS_OBJ(value);
+    if(packer->seenCount + 1 > packer->seenCapacity * 3 / 4) growSeen(packer);
+    int* seen = seenSlot(packer,object);
+    if(*seen >= 0) return *seen;
+    int node;
+    switch(object->type){
+        case OBJ_STRING:
+            node = addNode(packer,NODE_STRING,object);
+            packer->message->nodes[node].as.string = shareString((ObjString*)object);
+            break;
+        case OBJ_LIST:
+            node = addNode(packer,NODE_LIST,object);
+            break;
+        case OBJ_INSTANCE:
+            node = addNode(packer,NODE_INSTANCE,object);
+            packer->message->nodes[node].as.string = shareString(((ObjInstance*)object)->klass->name);
+            break;
+        case OBJ_CHANNEL:
+            node = addNode(packer,NODE_CHANNEL,object);
+            packer->message->nodes[node].as.channel = ((ObjChannel*)object)->channel;
+            retainChannel(((ObjChannel*)object)->channel);
+            break;
+        default:
+            return -1;
+    }
+    *seen = node;
+    return node;
+}
+
+static const char* unsendable(Value value){
+    switch(OBJ_TYPE(value)){
+        case OBJ_CLASS: return "Can't send a class to another isolate.";
+        case OBJ_NATIVE: return "Can't send a native function to another isolate.";
+        case OBJ_FIBER: return "Can't send a fiber to another isolate.";
+        default: return "Can't send a function to another isolate.";
+    }
+}
+
+//the nodes are filled in the order they were made , each list or instance adds its parts to the end
+const char* packMessage(Message* message,Value value){
+    message->value = value;
+    message->nodes = NULL;
+    message->nodeCount = 0;
+    message->links = NULL;
+    message->linkCount = 0;
+    if(!IS_OBJ(value)) return NULL;
+    Packer packer = {message,NULL,0,0,NULL,NULL,0,0};
+    const char* error = NULL;
+    if(nodeFor(&packer,value) < 0) error = unsendable(value);
+    for(int i = 0; i < message->nodeCount && error == NULL; i++){
+        Obj* object = packer.objects[i];
+        if(message->nodes[i].kind == NODE_LIST){
+            ValueArray* elements = &((ObjList*)object)->objects;
+            message->nodes[i].links = message->linkCount;
+            message->nodes[i].count = elements->count;
+            for(int j = 0; j < elements->count && error == NULL; j++){
+                int node = nodeFor(&packer,elements->values[j]);
+                if(node < 0) error = unsendable(elements->values[j]);
+                else addLink(&packer,node);
+            }
+        }
+        else if(message->nodes[i].kind == NODE_INSTANCE){
+            Table* fields = &((ObjInstance*)object)->fields;
+            message->nodes[i].links = message->linkCount;
+            for(int j = 0; j < fields->capacity && error == NULL; j++){
+                Entry* entry = &fields->entries[j];
+                if(entry->key == NULL) continue;
+                int name = nodeFor(&packer,OBJ_VAL(entry->key));
+                int field = nodeFor(&packer,entry->value);
+                if(field < 0) error = unsendable(entry->value);
+                else{
+                    addLink(&packer,name);
+                    addLink(&packer,field);
+                    message->nodes[i].count++;
+                }
+            }
+        }
+    }
+    free(packer.objects);
+    free(packer.seenKeys);
+    free(packer.seenNodes);
+    if(error != NULL) freeMessage(message);
+    return error;
+}
+
+void freeMessage(Message* message){
+    for(int i = 0; i < message->nodeCount; i++){
+        MessageNode* node = &message->nodes[i];
+        if(node->kind == NODE_STRING || node->kind == NODE_INSTANCE) releaseString(node->as.string);
+        else if(node->kind == NODE_CHANNEL) releaseChannel(node->as.channel);
+    }
+    free(message->nodes);
+    free(message->links);
+    message->nodes = NULL;
+    message->nodeCount = 0;
+    message->links = NULL;
+    message->linkCount = 0;
+}
+
+static THREAD_LOCAL char unpackError[128];
+
+//every object is made first and kept in a list on the stack , then the lists and fields are filled in ,
+//which is what lets a cycle come through
+const char* unpackMessage(Message* message,Value* value){
+    if(message->nodes == NULL){
+        *value = message->value;
+        return NULL;
+    }
+    ObjList* made = newList();
+    push(OBJ_VAL(made));
+    for(int i = 0; i < message->nodeCount; i++){
+        MessageNode* node = &message->nodes[i];
+        Value object;
+        switch(node->kind){
+            case NODE_STRING:
+                object = OBJ_VAL(sharedString(node->as.string));
+                break;
+            case NODE_LIST:
+                object = OBJ_VAL(newList());
+                break;
+            case NODE_INSTANCE:{
+                ObjString* name = sharedString(node->as.string);
+                push(OBJ_VAL(name));
+                Value klass;
+                if(!tableGet(&vm.globals,name,&klass) || !IS_CLASS(klass)){
+                    snprintf(unpackError,sizeof(unpackError),"Class '%s' isn't defined in the receiving isolate.",name->chars);
+                    pop();
+                    pop();
+                    return unpackError;
+                }
+                object = OBJ_VAL(newInstance(AS_CLASS(klass)));
+                pop();
+                break;
+            }
+            case NODE_CHANNEL:
+                object = OBJ_VAL(newChannel(node->as.channel));
+                break;
+            default:
+                object = node->as.value;
+                break;
+        }
+        push(object);
+        writeValueArray(&made->objects,object);
+        pop();
+    }
+    for(int i = 0; i < message->nodeCount; i++){
+        MessageNode* node = &message->nodes[i];
+        int* links = &message->links[node->links];
+        if(node->kind == NODE_LIST){
+            ObjList* list = AS_LIST(made->objects.values[i]);
+            for(int j = 0; j < node->count; j++){
+                writeValueArray(&list->objects,made->objects.values[links[j]]);
+            }
+        }
+        else if(node->kind == NODE_INSTANCE){
+            ObjInstance* instance = AS_INSTANCE(made->objects.values[i]);
+            for(int j = 0; j < node->count; j++){
+                tableSet(&instance->fields,AS_STRING(made->objects.values[links[2*j]]),made->objects.values[links[2*j + 1]]);
+            }
+        }
+    }
+    *value = made->objects.values[0];
+    pop();
+    return NULL;
+}
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION Lock;
+typedef CONDITION_VARIABLE Condition;
+#define initLock(lock) InitializeCriticalSection(lock)
+#define freeLock(lock) DeleteCriticalSection(lock)
+#define lock(lock) EnterCriticalSection(lock)
+#define unlock(lock) LeaveCriticalSection(lock)
+#define initCondition(condition) InitializeConditionVariable(condition)
+#define freeCondition(condition)
+#define wait(condition,lock) SleepConditionVariableCS(condition,lock,INFINITE)
+#define wake(condition) WakeConditionVariable(condition)
+#else
+typedef pthread_mutex_t Lock;
+typedef pthread_cond_t Condition;
+#define initLock(lock) pthread_mutex_init(lock,NULL)
+#define freeLock(lock) pthread_mutex_destroy(lock)
+#define lock(lock) pthread_mutex_lock(lock)
+#define unlock(lock) pthread_mutex_unlock(lock)
+#define initCondition(condition) pthread_cond_init(condition,NULL)
+#define freeCondition(condition) pthread_cond_destroy(condition)
+#define wait(condition,lock) pthread_cond_wait(condition,lock)
+#define wake(condition) pthread_cond_signal(condition)
+#endif
+
+//a ring of messages , the one lock is only held to move a message in or out
+struct Channel{
+    int32_t refs;
+    Lock lock;
+    Condition notEmpty;
+    Condition notFull;
+    int head;
+    int count;
+    Message messages[CHANNEL_CAPACITY];
+};
+
+Channel* openChannel(){
+    Channel* channel = (Channel*)malloc(sizeof(Channel));
+    if(channel == NULL) exit(1);
+    channel->refs = 1;
+    initLock(&channel->lock);
+    initCondition(&channel->notEmpty);
+    initCondition(&channel->notFull);
+    channel->head = 0;
+    channel->count = 0;
+    return channel;
+}
+
+void retainChannel(Channel* channel){
+    INCREMENT(&channel->refs);
+}
+
+//whatever was never received goes with it
+void releaseChannel(Channel* channel){
+    if(DECREMENT(&channel->refs) != 0) return;
+    for(int i = 0; i < channel->count; i++){
+        freeMessage(&channel->messages[(channel->head + i) % CHANNEL_CAPACITY]);
+    }
+    freeLock(&channel->lock);
+    freeCondition(&channel->notEmpty);
+    freeCondition(&channel->notFull);
+    free(channel);
+}
+
+void channelSend(Channel* channel,Message* message){
+    lock(&channel->lock);
+    while(channel->count == CHANNEL_CAPACITY) wait(&channel->notFull,&channel->lock);
+    channel->messages[(channel->head + channel->count) % CHANNEL_CAPACITY] = *message;
+    channel->count++;
+    wake(&channel->notEmpty);
+    unlock(&channel->lock);
+}
+
+void channelReceive(Channel* channel,Message* message){
+    lock(&channel->lock);
+    while(channel->count == 0) wait(&channel->notEmpty,&channel->lock);
+    *message = channel->messages[channel->head];
+    channel->head = (channel->head + 1) % CHANNEL_CAPACITY;
+    channel->count--;
+    wake(&channel->notFull);
+    unlock(&channel->lock);
+}
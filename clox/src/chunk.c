@@ -2,6 +2,7 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void initChunk(Chunk* chunk) {
@@ -35,6 +36,10 @@ void writeChunk(Chunk* chunk,uint8_t byte,int line){
     lineStart->line = line;
 }
 int addConstant(Chunk* chunk,Value value){
+    if(objectPool != NULL){//the vm stack may belong to another thread , and nothing collects anyway
+        writeValueArray(&chunk->constants,value);
+        return chunk->constants.count-1;
+    }
     push(value);
     writeValueArray(&chunk->constants,value);
     pop();
@@ -43,7 +48,10 @@ int addConstant(Chunk* chunk,Value value){
 
 
 bool writeConstant(Chunk* chunk,Value value,int line){
-    int index = addConstant(chunk,value);
+    return writeConstantIndex(chunk,addConstant(chunk,value),line);
+}
+
+bool writeConstantIndex(Chunk* chunk,int index,int line){
     if(index<256){
         writeChunk(chunk,OP_CONSTANT,line);
         writeChunk(chunk,index,line);
@@ -62,7 +70,7 @@ bool writeConstant(Chunk* chunk,Value value,int line){
 void freeChunk(Chunk* chunk){
     FREE_ARRAY(uint8_t,chunk->code,chunk->capacity);
     freeValueArray(&chunk->constants);
-    FREE_ARRAY(LineStart,chunk->lines,chunk->capacity);
+    FREE_ARRAY(LineStart,chunk->lines,chunk->lineCapacity);
     initChunk(chunk);
 }
 
@@ -83,3 +91,75 @@ int getLine(Chunk* chunk,int offset){
         }
     }
 }
+
+
+//operand bytes after the opcode , OP_CLOSURE also carries 3 bytes per upvalue
+static const uint8_t operandBytes[] = {
+  [OP_RETURN] = 0, [OP_CONSTANT] = 1, [OP_NIL] = 0, [OP_TRUE] = 0,
+  [OP_FALSE] = 0, [OP_EQUAL] = 0, [OP_GREATER] = 0, [OP_LESS] = 0,
+  [OP_CONSTANT_LONG] = 2, [OP_ADD] = 0, [OP_SUBTRACT] = 0, [OP_MULTIPLY] = 0,
+  [OP_DIVIDE] = 0, [OP_NOT] = 0, [OP_NEGATE] = 0, [OP_POWER] = 0,
+  [OP_POP] = 0, [OP_PRINT] = 0, [OP_DEFINE_GLOBAL] = 1, [OP_DEFINE_GLOBAL_LONG] = 2,
+  [OP_GET_GLOBAL] = 1, [OP_GET_GLOBAL_LONG] = 2, [OP_SET_GLOBAL] = 1, [OP_SET_GLOBAL_LONG] = 2,
+  [OP_GET_LOCAL] = 2, [OP_SET_LOCAL] = 2, [OP_JUMP] = 2, [OP_JUMP_IF_FALSE] = 2,
+  [OP_LOOP] = 2, [OP_CALL] = 1, [OP_CLOSURE] = 2, [OP_GET_UPVALUE] = 2,
+  [OP_SET_UPVALUE] = 2, [OP_CLOSE_UPVALUE] = 0, [OP_CLASS] = 2, [OP_GET_PROPERTY] = 2,
+  [OP_SET_PROPERTY] = 2, [OP_METHOD] = 2, [OP_INVOKE] = 3, [OP_INHERIT] = 0,
+  [OP_GET_SUPER] = 2, [OP_INVOKE_SUPER] = 3, [OP_MAKE_LIST] = 2, [OP_GET_ELEMENT] = 0,
+  [OP_SET_ELEMENT] = 0, [OP_CALL_LOCAL] = 1, [OP_RELEASE] = 0, [OP_ADD_NUM] = 0,
+  [OP_SUBTRACT_NUM] = 0, [OP_MULTIPLY_NUM] = 0, [OP_DIVIDE_NUM] = 0, [OP_LESS_NUM] = 0,
+  [OP_GREATER_NUM] = 0, [OP_TAIL_CALL] = 1, [OP_FOR_PREP] = 8, [OP_FOR_LOOP] = 10,
+  [OP_TAIL_INVOKE] = 3
+};
+
+int instructionLength(Chunk* chunk,int offset){
+    uint8_t instruction = chunk->code[offset];
+    int length = 1 + operandBytes[instruction];
+    if(instruction == OP_CLOSURE){
+        uint16_t constant = (uint16_t)((chunk->code[offset+1]<<8)|chunk->code[offset+2]);
+        length += 3*AS_FUNCTION(chunk->constants.values[constant])->upvalueCount;
+    }
+    return length;
+}
+
+//net change in stack height after the instruction runs (calls count as their result replacing callee and arguments)
+int stackEffect(Chunk* chunk,int offset){
+    uint8_t* code = &chunk->code[offset];
+    switch(code[0]){
+        case OP_CONSTANT: case OP_CONSTANT_LONG: case OP_NIL: case OP_TRUE: case OP_FALSE:
+        case OP_GET_GLOBAL: case OP_GET_GLOBAL_LONG: case OP_GET_LOCAL: case OP_GET_UPVALUE:
+        case OP_CLOSURE: case OP_CLASS:
+            return 1;
+        case OP_EQUAL: case OP_GREATER: case OP_LESS: case OP_ADD: case OP_SUBTRACT:
+        case OP_MULTIPLY: case OP_DIVIDE: case OP_POWER: case OP_POP: case OP_PRINT:
+        case OP_DEFINE_GLOBAL: case OP_DEFINE_GLOBAL_LONG: case OP_CLOSE_UPVALUE:
+        case OP_SET_PROPERTY: case OP_METHOD: case OP_INHERIT: case OP_GET_SUPER:
+        case OP_GET_ELEMENT: case OP_RETURN: case OP_RELEASE: case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM: case OP_MULTIPLY_NUM: case OP_DIVIDE_NUM: case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+            return -1;
+        case OP_SET_ELEMENT:
+            return -2;
+        case OP_CALL: case OP_CALL_LOCAL: case OP_TAIL_CALL:
+            return -code[1];
+        case OP_INVOKE: case OP_TAIL_INVOKE:
+            return -code[3];
+        case OP_INVOKE_SUPER:
+            return -code[3]-1;
+        case OP_MAKE_LIST:
+            return 1-((code[1]<<8)|code[2]);
+        default:
+            return 0;
+    }
+}
+
+//where the instruction can branch to besides the next one , -1 if it never branches
+//the jump distance is always the last two operand bytes
+int jumpTarget(Chunk* chunk,int offset){
+    uint8_t instruction = chunk->code[offset];
+    if(instruction != OP_JUMP && instruction != OP_JUMP_IF_FALSE && instruction != OP_LOOP &&
+        instruction != OP_FOR_PREP && instruction != OP_FOR_LOOP) return -1;
+    int next = offset + instructionLength(chunk,offset);
+    uint16_t jump = (uint16_t)((chunk->code[next-2]<<8)|chunk->code[next-1]);
+    return instruction == OP_LOOP || instruction == OP_FOR_LOOP ? next - jump : next + jump;
+}
@@ -1,12 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> 
+#include <math.h>
 #include "common.h"
 #include "compiler.h"
 #include "scanner.h"
 #include "chunk.h"
 #include "object.h"
 #include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
 #define UINT16_COUNT UINT16_MAX+1
 #define UINT8_COUNT UINT8_MAX+1
 #ifdef DEBUG_PRINT_CODE
@@ -46,13 +49,27 @@ typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    int allocSite;//offset of the OP_CALL that produced the initializer , -1 if there is none
+    bool escapes;//the value was used as anything other than the receiver of a field access
+    bool isAssigned;//written after its declaration , either directly or through an upvalue
 }Local;
 
+typedef struct {
+  int local;
+  int offset;//the isLocal byte of an OP_CLOSURE operand , patched once we know if the local is ever assigned
+} CaptureSite;
+
 typedef struct {
   uint16_t index;
   bool isLocal;
 } Upvalue;
 
+typedef struct {
+  int count;
+  int capacity;
+  int* slots;//constant index + 1 , 0 marks an empty slot
+} ConstantIndex;
+
 typedef enum{
     TYPE_FUNCTION,
     TYPE_SCRIPT,
@@ -69,11 +86,26 @@ typedef struct Compiler{
     FunctionType type;
     Local *locals;
     int localCount;
+    int localCapacity;
     Upvalue *upvalues;
+    int upvalueCapacity;
+    CaptureSite* captures;
+    int captureCount;
+    int captureCapacity;
+    ConstantIndex constants;//finds an existing constant without scanning the pool
     int scopeDepth;
     int currentLoopStart;
     int currentLoopScope;
     int currentExitJump;
+    int lastCall;
+    int lastInvoke;
+    int receiverLocal;//local loaded right before a '.' , the use is judged once the dot is parsed
+    int receiverEnd;
+    int operandStart;//where the left operand of the infix rule being parsed starts
+    int constantStart;//the last constant pushed spans [constantStart,constantEnd) , -1 when there is none
+    int constantEnd;
+    Value constantValue;
+    LazyBody* lazy;//the body being compiled late , names outside it are looked up in here
 
 }Compiler;
 
@@ -84,19 +116,79 @@ typedef struct ClassCompiler{
 
 
 
-Parser parser;
-static Compiler* current = NULL;
-static ClassCompiler* currentClass = NULL;
+//compiler bookkeeping lives here until compile() returns , then it all goes in one free per block
+typedef struct ArenaBlock{
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    size_t last;//offset of the most recent allocation , it can grow in place
+    char data[];
+}ArenaBlock;
+
+#define ARENA_BLOCK_SIZE (1024*64)
+
+//all the state of one compile , compile() and compileLazy() keep it on their own stack.
+//the pointer to it is per thread so compiles running on different threads never meet
+typedef struct{
+    Parser parser;
+    Scanner scanner;
+    Compiler* current;
+    ClassCompiler* currentClass;
+    bool skippingBody;
+    ArenaBlock* arena;
+}CompileContext;
+
+CompilerOptions compilerOptions = {false,false,false,false};
+static THREAD_LOCAL CompileContext* context = NULL;
+
+static void* arenaAllocate(size_t size){
+    size = (size + 7) & ~(size_t)7;
+    if(context->arena == NULL || context->arena->size - context->arena->used < size){
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock* block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + blockSize);
+        if(block == NULL) exit(1);
+        block->next = context->arena;
+        block->size = blockSize;
+        block->used = 0;
+        block->last = 0;
+        context->arena = block;
+    }
+    context->arena->last = context->arena->used;
+    context->arena->used += size;
+    return context->arena->data + context->arena->last;
+}
+
+//the old array is just abandoned , it goes away with the rest of the arena
+static void* arenaGrow(void* pointer,size_t oldSize,size_t newSize){
+    if(pointer != NULL && pointer == context->arena->data + context->arena->last && context->arena->size - context->arena->last >= newSize){
+        context->arena->used = context->arena->last + ((newSize + 7) & ~(size_t)7);
+        return pointer;
+    }
+    void* result = arenaAllocate(newSize);
+    if(oldSize > 0) memcpy(result,pointer,oldSize);
+    return result;
+}
+
+static void freeArena(){
+    while(context->arena != NULL){
+        ArenaBlock* next = context->arena->next;
+        free(context->arena);
+        context->arena = next;
+    }
+}
+
+#define ARENA_GROW(type,pointer,oldCount,newCount) \
+    (type*)arenaGrow(pointer,sizeof(type)*(oldCount),sizeof(type)*(newCount))
 
 
 static Chunk* currentChunk(){
-    return &current->function->chunk;
+    return &context->current->function->chunk;
 }
 
 
 static void errorAt(Token* token,const char* message){
-    if(parser.panicMode) return;
-    parser.panicMode = true;
+    if(context->parser.panicMode) return;
+    context->parser.panicMode = true;
     fprintf(stderr,"[line %d] Error",token->line);
     if(token->type==TOKEN_EOF){
         fprintf(stderr," at end");
@@ -105,27 +197,27 @@ static void errorAt(Token* token,const char* message){
         fprintf(stderr," at '%.*s'",token->length,token->start);
     }
     fprintf(stderr,": %s\n",message);
-    parser.hadError = true;
+    context->parser.hadError = true;
 }
 
 static void errorAtCurrent(const char* message){
-    errorAt(&parser.current,message);
+    errorAt(&context->parser.current,message);
 }
 
 static void error(const char* message){
-    errorAt(&parser.previous,message);
+    errorAt(&context->parser.previous,message);
 }
 
 static void advance(){
-    parser.previous = parser.current;
+    context->parser.previous = context->parser.current;
     for(;;){//skip all the error tokens whislt reporting them
-        parser.current = scanToken();
-        if(parser.current.type != TOKEN_ERROR) break;
-        errorAtCurrent(parser.current.start);
+        context->parser.current = scanToken(&context->scanner);
+        if(context->parser.current.type != TOKEN_ERROR) break;
+        errorAtCurrent(context->parser.current.start);
     }
 }
 static void consume(TokenType type,const char* message){
-    if(parser.current.type == type){
+    if(context->parser.current.type == type){
         advance();
         return;
     }
@@ -134,7 +226,7 @@ static void consume(TokenType type,const char* message){
 
 
 static bool check(TokenType type){
-    return parser.current.type == type;
+    return context->parser.current.type == type;
 }
 
 static bool match(TokenType type){
@@ -144,7 +236,7 @@ static bool match(TokenType type){
 }
 
 static void emitByte(uint8_t byte){
-    writeChunk(currentChunk(),byte,parser.previous.line);
+    writeChunk(currentChunk(),byte,context->parser.previous.line);
 }
 static void emitBytes(uint8_t byte1,uint8_t byte2){
     emitByte(byte1);
@@ -169,7 +261,7 @@ static int emitJump(uint8_t instruction) {
 }
 
 static void emitReturn(){
-    if(current->type==TYPE_INITIALIZER){
+    if(context->current->type==TYPE_INITIALIZER){
         emitByte(OP_GET_LOCAL);
         emitBytes(0,0); 
     }
@@ -179,10 +271,108 @@ static void emitReturn(){
     emitByte(OP_RETURN);
 }
 
+//numbers are matched on their bits so 0 and -0 stay apart , strings are interned
+static bool sameConstant(Value a,Value b){
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if(a.type != b.type) return false;
+    if(IS_NUMBER(a)) return memcmp(&a.as.number,&b.as.number,sizeof(double)) == 0;
+    if(IS_OBJ(a)) return AS_OBJ(a) == AS_OBJ(b);
+    return valuesEqual(a,b);
+#endif
+}
+
+static uint32_t hashConstant(Value value){
+    if(IS_STRING(value)) return AS_STRING(value)->hash;
+    uint64_t bits = 0;
+#ifdef NAN_BOXING
+    bits = value;
+#else
+    if(IS_NUMBER(value)) memcpy(&bits,&value.as.number,sizeof(double));
+    else if(IS_OBJ(value)) bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+#endif
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static int* findConstantSlot(ConstantIndex* index,Value* constants,Value value){
+    uint32_t slot = hashConstant(value) & (index->capacity-1);
+    for(;;){
+        int* entry = &index->slots[slot];
+        if(*entry == 0 || sameConstant(constants[*entry-1],value)) return entry;
+        slot = (slot + 1) & (index->capacity-1);
+    }
+}
+
+//returns the pool index of value , adding it only if this chunk doesn't have it yet
+static int makeConstant(Value value){
+    ConstantIndex* index = &context->current->constants;
+    ValueArray* pool = &currentChunk()->constants;
+    if(index->count + 1 > index->capacity * TABLE_MAX_LOAD){
+        int capacity = GROW_CAPACITY(index->capacity);
+        int* slots = ARENA_GROW(int,NULL,0,capacity);
+        memset(slots,0,sizeof(int)*capacity);
+        int* old = index->slots;
+        int oldCapacity = index->capacity;
+        index->slots = slots;
+        index->capacity = capacity;
+        for(int i = 0; i < oldCapacity; i++){
+            if(old[i] != 0) *findConstantSlot(index,pool->values,pool->values[old[i]-1]) = old[i];
+        }
+    }
+    int* entry = findConstantSlot(index,pool->values,value);
+    if(*entry != 0) return *entry - 1;
+    int constant = addConstant(currentChunk(),value);
+    *entry = constant + 1;
+    index->count++;
+    return constant;
+}
+
 static void emitConstant(Value value){
-    if(!writeConstant(currentChunk(),value,parser.previous.line)){
+    int start = currentChunk()->count;
+    if(IS_BOOL(value)){
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    }
+    else if(IS_NIL(value)){
+        emitByte(OP_NIL);
+    }
+    else if(!writeConstantIndex(currentChunk(),makeConstant(value),context->parser.previous.line)){
         error("Too many constants in one chunk.");
     }
+    context->current->constantStart = start;
+    context->current->constantEnd = currentChunk()->count;
+    context->current->constantValue = value;
+}
+
+//true if the code from start up to here is a single constant push
+static bool constantOperand(int start,Value* value){
+    if(context->current->constantStart != start || context->current->constantEnd != currentChunk()->count) return false;
+    *value = context->current->constantValue;
+    return true;
+}
+
+//throws away everything emitted from offset on , along with anything we remembered about it
+static void truncateCode(int offset){
+    Chunk* chunk = currentChunk();
+    chunk->count = offset;
+    while(chunk->lineCount > 0 && chunk->lines[chunk->lineCount-1].offset >= offset){
+        chunk->lineCount--;
+    }
+    if(context->current->constantEnd > offset) context->current->constantStart = context->current->constantEnd = -1;
+    if(context->current->lastCall >= offset) context->current->lastCall = -1;
+    if(context->current->lastInvoke >= offset) context->current->lastInvoke = -1;
+    if(context->current->receiverEnd > offset) context->current->receiverLocal = context->current->receiverEnd = -1;
+    for(int i = 0; i < context->current->localCount; i++){
+        if(context->current->locals[i].allocSite >= offset) context->current->locals[i].allocSite = -1;
+    }
+    int kept = 0;
+    for(int i = 0; i < context->current->captureCount; i++){
+        if(context->current->captures[i].offset < offset) context->current->captures[kept++] = context->current->captures[i];
+    }
+    context->current->captureCount = kept;
 }
 
 static void patchJump(int offset) {
@@ -197,7 +387,7 @@ static void patchJump(int offset) {
 }
 
 static void initCompiler(Compiler* compiler,FunctionType type){
-    compiler->enclosing = current;
+    compiler->enclosing = context->current;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
@@ -205,23 +395,43 @@ static void initCompiler(Compiler* compiler,FunctionType type){
     compiler->currentLoopStart = -1;
     compiler->currentLoopScope = -1;
     compiler->currentExitJump = -1;
+    compiler->lastCall = -1;
+    compiler->lastInvoke = -1;
+    compiler->receiverLocal = -1;
+    compiler->receiverEnd = -1;
+    compiler->operandStart = -1;
+    compiler->constantStart = -1;
+    compiler->constantEnd = -1;
+    compiler->constantValue = NIL_VAL;
+    compiler->lazy = NULL;
     compiler->function = newFunction();
-    compiler->locals = (Local*)malloc(sizeof(Local)*UINT16_COUNT);
-    compiler->upvalues = (Upvalue*)malloc(sizeof(Upvalue)*UINT16_COUNT);
+    compiler->localCapacity = 8;
+    compiler->locals = ARENA_GROW(Local,NULL,0,compiler->localCapacity);
+    compiler->upvalueCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->captures = NULL;
+    compiler->captureCount = 0;
+    compiler->captureCapacity = 0;
+    compiler->constants.count = 0;
+    compiler->constants.capacity = 0;
+    compiler->constants.slots = NULL;
     // implicitly giving the first slot to the vm for internal use
-    current = compiler;
+    context->current = compiler;
     if(type!=TYPE_SCRIPT&&type!=TYPE_EXPRESSION){
-        current->function->name = copyString(parser.previous.start,parser.previous.length);
+        context->current->function->name = copyString(context->parser.previous.start,context->parser.previous.length);
     }
     if(type==TYPE_EXPRESSION){
-        current->function->name = copyString("",1);
+        context->current->function->name = copyString("",1);
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &context->current->locals[context->current->localCount++];
     local->depth = 0;
     local->name.start = "";
     local->name.length = 0;
     local->isCaptured = false;
+    local->allocSite = -1;
+    local->escapes = false;
+    local->isAssigned = false;
     if (type != TYPE_FUNCTION&&type!=TYPE_SCRIPT&&type!=TYPE_EXPRESSION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -231,35 +441,152 @@ static void initCompiler(Compiler* compiler,FunctionType type){
   }
 }
 
+//locals that never escaped get their allocation turned into a frame local one
+static bool keepsAllocation(Local* local){
+    if(local->allocSite == -1 || local->escapes || local->isCaptured) return false;
+    currentChunk()->code[local->allocSite] = OP_CALL_LOCAL;
+    return true;
+}
+
+static void addCaptureSite(int local,int offset){
+    if(context->current->captureCapacity < context->current->captureCount + 1){
+        int oldCapacity = context->current->captureCapacity;
+        context->current->captureCapacity = GROW_CAPACITY(oldCapacity);
+        context->current->captures = ARENA_GROW(CaptureSite,context->current->captures,oldCapacity,context->current->captureCapacity);
+    }
+    context->current->captures[context->current->captureCount].local = local;
+    context->current->captures[context->current->captureCount].offset = offset;
+    context->current->captureCount++;
+}
+
+//a captured local that is never assigned can be copied into the closure instead of living in an upvalue
+//returns true if the local still needs its upvalue closed
+static bool resolveCaptures(int local){
+    bool isFlat = !context->current->locals[local].isAssigned;
+    int kept = 0;
+    for(int i = 0; i < context->current->captureCount; i++){
+        CaptureSite site = context->current->captures[i];
+        if(site.local != local){
+            context->current->captures[kept++] = site;
+            continue;
+        }
+        if(isFlat) currentChunk()->code[site.offset] = 2;
+    }
+    context->current->captureCount = kept;
+    return !isFlat;
+}
+
+//walks every reachable instruction once with the stack height it starts at and records the highest point
+//jumps are the only way two paths meet , so a worklist of jump targets is enough
+static int computeMaxStack(Chunk* chunk,int initialDepth){
+    int* depths = (int*)malloc(sizeof(int)*(chunk->count+1));
+    int worklistCapacity = 8;
+    int* worklist = (int*)malloc(sizeof(int)*worklistCapacity);
+    if(depths == NULL || worklist == NULL) exit(1);
+    for(int i = 0; i <= chunk->count; i++) depths[i] = -1;
+    int pending = 0;
+    int maxDepth = initialDepth;
+    depths[0] = initialDepth;
+    worklist[pending++] = 0;
+    while(pending > 0){
+        int offset = worklist[--pending];
+        int depth = depths[offset];
+        while(offset < chunk->count){
+            uint8_t instruction = chunk->code[offset];
+            int next = offset + instructionLength(chunk,offset);
+            depth += stackEffect(chunk,offset);
+            if(instruction == OP_MAKE_LIST && depth + 1 > maxDepth) maxDepth = depth + 1;//the list is pushed before its elements are popped
+            if(depth > maxDepth) maxDepth = depth;
+            if(instruction == OP_RETURN) break;
+            int target = jumpTarget(chunk,offset);
+            if(target != -1 && target <= chunk->count && depths[target] < depth && depth < UINT16_COUNT){
+                depths[target] = depth;
+                if(pending == worklistCapacity){
+                    worklistCapacity *= 2;
+                    worklist = (int*)realloc(worklist,sizeof(int)*worklistCapacity);
+                    if(worklist == NULL) exit(1);
+                }
+                worklist[pending++] = target;
+            }
+            if(instruction == OP_JUMP || instruction == OP_LOOP) break;
+            if(depths[next] >= depth) break;//already walked from here with at least this height
+            depths[next] = depth;
+            offset = next;
+        }
+    }
+    free(depths);
+    free(worklist);
+    return maxDepth;
+}
+
+//only the start of the body matters , whatever follows the first return never runs
+static void findInlineForm(ObjFunction* function){
+    Chunk* chunk = &function->chunk;
+    uint8_t* code = chunk->code;
+    if(chunk->count >= 4 && code[0] == OP_GET_LOCAL && code[3] == OP_RETURN){
+        function->inlineKind = INLINE_SLOT;
+        function->inlineSlot = (uint16_t)((code[1] << 8) | code[2]);
+    }
+    else if(chunk->count >= 7 && code[0] == OP_GET_LOCAL && code[1] == 0 && code[2] == 0 &&
+        code[3] == OP_GET_PROPERTY && code[6] == OP_RETURN){
+        function->inlineKind = INLINE_FIELD;
+        function->inlineValue = chunk->constants.values[(code[4] << 8) | code[5]];
+    }
+    else if(chunk->count >= 3 && code[0] == OP_CONSTANT && code[2] == OP_RETURN){
+        function->inlineKind = INLINE_CONSTANT;
+        function->inlineValue = chunk->constants.values[code[1]];
+    }
+    else if(chunk->count >= 4 && code[0] == OP_CONSTANT_LONG && code[3] == OP_RETURN){
+        function->inlineKind = INLINE_CONSTANT;
+        function->inlineValue = chunk->constants.values[(code[1] << 8) | code[2]];
+    }
+    else if(chunk->count >= 2 && (code[0] == OP_NIL || code[0] == OP_TRUE || code[0] == OP_FALSE) && code[1] == OP_RETURN){
+        function->inlineKind = INLINE_CONSTANT;
+        function->inlineValue = code[0] == OP_NIL ? NIL_VAL : BOOL_VAL(code[0] == OP_TRUE);
+    }
+}
+
 static ObjFunction* endCompiler(){
+    for(int i = 0; i < context->current->localCount; i++){
+        keepsAllocation(&context->current->locals[i]);//whatever is left gets freed when the frame returns
+        if(context->current->locals[i].isCaptured) resolveCaptures(i);
+    }
     emitReturn();
-    ObjFunction* function = current->function;
+    ObjFunction* function = context->current->function;
+    if(!context->parser.hadError){
+        int initialDepth = function->arity < 0 ? 1 : function->arity + 1;
+        if(compilerOptions.optimize) optimizeChunk(currentChunk(),initialDepth);
+        function->maxStack = computeMaxStack(currentChunk(),initialDepth);
+        if(context->current->type != TYPE_SCRIPT) findInlineForm(function);
+    }
 #ifdef DEBUG_PRINT_CODE
-    if(!parser.hadError){
+    if(!context->parser.hadError){
         const char* name = function->name != NULL ? function->name->chars : "<script>";
         dissassembleChunk(currentChunk(), name);
     }
 #endif
-    free(current->locals);
-   // free(current->upvalues);
-    current = current->enclosing;
+    context->current = context->current->enclosing;
     return function;
 }
 
 static void beginScope(){
-    current->scopeDepth++;
+    context->current->scopeDepth++;
 }
 
 static void endScope(){
-    current->scopeDepth--;
-    while(current->localCount>0&current->locals[current->localCount-1].depth>current->scopeDepth){
-        if(current->locals[current->localCount-1].isCaptured){
-            emitByte(OP_CLOSE_UPVALUE);
+    context->current->scopeDepth--;
+    while(context->current->localCount>0&context->current->locals[context->current->localCount-1].depth>context->current->scopeDepth){
+        Local* local = &context->current->locals[context->current->localCount-1];
+        if(local->isCaptured){
+            emitByte(resolveCaptures(context->current->localCount-1) ? OP_CLOSE_UPVALUE : OP_POP);
+        }
+        else if(keepsAllocation(local)){
+            emitByte(OP_RELEASE);
         }
         else{
             emitByte(OP_POP);
         }
-        current->localCount--;
+        context->current->localCount--;
     }//pops all the local variables that are out of scope
 }
 
@@ -275,13 +602,84 @@ static uint8_t argumentList();
 static int resolveUpvalue(Compiler* compiler, Token* name);
 static void function(FunctionType type);
 
+static bool isFalsey(Value value){
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+//same formatting the vm uses when a number meets a string in '+'
+static int constantChars(Value value,char* buffer,int size){
+    if(IS_STRING(value)){
+        ObjString* string = AS_STRING(value);
+        if(string->length >= size) return -1;
+        memcpy(buffer,string->chars,string->length);
+        return string->length;
+    }
+    int length = snprintf(buffer,size,"%.*g",10,AS_NUMBER(value));
+    return length < size ? length : -1;
+}
+
+static bool foldConcatenation(Value a,Value b,Value* result){
+    char left[256];
+    char right[256];
+    int leftLength = constantChars(a,left,sizeof(left));
+    int rightLength = constantChars(b,right,sizeof(right));
+    if(leftLength < 0 || rightLength < 0) return false;//long literals stay as they are
+    int length = leftLength + rightLength;
+    char* chars = ALLOCATE(char,length+1);
+    memcpy(chars,left,leftLength);
+    memcpy(chars+leftLength,right,rightLength);
+    chars[length] = '\0';
+    *result = OBJ_VAL(takeString(chars,length));
+    return true;
+}
+
+//anything the vm would raise an error for is left alone so it still happens at runtime
+static bool foldBinary(TokenType operatorType,Value a,Value b,Value* result){
+    if(operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL){
+        bool equal = valuesEqual(a,b);
+        *result = BOOL_VAL(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+        return true;
+    }
+    if(operatorType == TOKEN_PLUS && (IS_STRING(a) || IS_STRING(b)) && (IS_STRING(a) || IS_NUMBER(a)) && (IS_STRING(b) || IS_NUMBER(b))){
+        return foldConcatenation(a,b,result);
+    }
+    if(!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType)
+    {
+        case TOKEN_PLUS: *result = NUMBER_VAL(x + y); break;
+        case TOKEN_MINUS: *result = NUMBER_VAL(x - y); break;
+        case TOKEN_STAR: *result = NUMBER_VAL(x * y); break;
+        case TOKEN_SLASH: *result = NUMBER_VAL(x / y); break;
+        case TOKEN_POWER: *result = NUMBER_VAL(pow(x,y)); break;
+        case TOKEN_GREATER: *result = BOOL_VAL(x > y); break;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); break;
+        case TOKEN_LESS: *result = BOOL_VAL(x < y); break;
+        case TOKEN_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); break;
+        default: return false;
+    }
+    return true;
+}
+
 static void binary(bool canAssign){
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = context->parser.previous.type;
     ParseRule* rule = getRule(operatorType);
+    int leftStart = context->current->operandStart;
+    Value left;
+    bool leftConstant = constantOperand(leftStart,&left);
+    int rightStart = currentChunk()->count;
     operatorType==TOKEN_POWER?
     parsePrecedence((Precedence)(rule->precedence))
     :
     parsePrecedence((Precedence)(rule->precedence+1));
+    Value right;
+    Value result;
+    if(leftConstant && constantOperand(rightStart,&right) && foldBinary(operatorType,left,right,&result)){
+        truncateCode(leftStart);
+        emitConstant(result);
+        return;
+    }
     switch (operatorType)
     {
         case TOKEN_PLUS: emitByte(OP_ADD); break;
@@ -301,18 +699,26 @@ static void binary(bool canAssign){
 
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
+  context->current->lastCall = currentChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
 static void dot(bool canAssign){
+    int receiver = -1;
+    if(context->current->receiverLocal != -1 && context->current->receiverEnd == currentChunk()->count){
+        receiver = context->current->receiverLocal;
+    }
+    context->current->receiverLocal = -1;
     consume(TOKEN_IDENTIFIER,"Expect property name after '.'.");
-    int name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&context->parser.previous);
     if(canAssign&&match(TOKEN_EQUAL)){
         expression();
         emitByte(OP_SET_PROPERTY);
         emitBytes((uint8_t)(name >> 8), (uint8_t)(name & 0xff));
     } else if (match(TOKEN_LEFT_PAREN)){
+        if(receiver != -1) context->current->locals[receiver].escapes = true;//the method sees it as 'this'
         uint8_t argCount = argumentList();
+        context->current->lastInvoke = currentChunk()->count;
         emitByte(OP_INVOKE);
         emitBytes((uint8_t)(name>>8),(uint8_t)(name&0xff));
         emitByte(argCount);
@@ -336,10 +742,10 @@ static void conditional(bool canAssign){
 }
 
 static void literal(bool canAssign) {
-  switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;
+  switch (context->parser.previous.type) {
+    case TOKEN_FALSE: emitConstant(BOOL_VAL(false)); break;
+    case TOKEN_NIL: emitConstant(NIL_VAL); break;
+    case TOKEN_TRUE: emitConstant(BOOL_VAL(true)); break;
     default: return; 
   }
 }
@@ -348,7 +754,7 @@ static void grouping(bool canAssign){
     consume(TOKEN_RIGHT_PAREN,"Expect ')' after expression.");
 }
 static void number(bool canAssign){
-    double value = strtod(parser.previous.start,NULL);
+    double value = strtod(context->parser.previous.start,NULL);
     emitConstant(NUMBER_VAL(value));
 }
 //we reuse jumps for logical operators
@@ -373,10 +779,12 @@ static void and_(bool canAssign) {
 }
 
 static void string(bool canAssign){
-    emitConstant(OBJ_VAL(copyString(parser.previous.start+1,parser.previous.length-2)));
+    emitConstant(OBJ_VAL(copyString(context->parser.previous.start+1,context->parser.previous.length-2)));
 }
 static void localVariable(Token token,bool canAssign,int arg){
     if(canAssign&&match(TOKEN_EQUAL)){
+        context->current->locals[arg].isAssigned = true;
+        context->current->locals[arg].escapes = true;//OP_RELEASE would see the new value , not the instance
         expression();
         emitByte(OP_SET_LOCAL);
         emitBytes((uint8_t)(arg>>8),(uint8_t)(arg&0xff));
@@ -384,10 +792,29 @@ static void localVariable(Token token,bool canAssign,int arg){
     else{
         emitByte(OP_GET_LOCAL);
         emitBytes((uint8_t)(arg>>8),(uint8_t)(arg&0xff));
+        if(check(TOKEN_DOT)){
+            context->current->receiverLocal = arg;
+            context->current->receiverEnd = currentChunk()->count;
+        }
+        else{
+            context->current->locals[arg].escapes = true;
+        }
+    }
+}
+static void markUpvalueAssigned(Compiler* compiler,int upvalue){
+    if(compiler->lazy != NULL) return;//already done when the body was skipped
+    Upvalue* captured = &compiler->upvalues[upvalue];
+    if(captured->isLocal){
+        compiler->enclosing->locals[captured->index].isAssigned = true;
+    }
+    else{
+        markUpvalueAssigned(compiler->enclosing,captured->index);
     }
 }
+
 static void UpValue(Token token,bool canAssign,uint16_t arg){
     if(canAssign&&match(TOKEN_EQUAL)){
+        markUpvalueAssigned(context->current,arg);
         expression();
         emitByte(OP_SET_UPVALUE);
         emitBytes((uint8_t)(arg>>8),(uint8_t)(arg&0xff));
@@ -398,11 +825,11 @@ static void UpValue(Token token,bool canAssign,uint16_t arg){
     }
 }
 static void namedVariable(Token token,bool canAssign){
-    int  arg = resolveLocal(current,&token);
+    int  arg = resolveLocal(context->current,&token);
     if(arg!=-1){
         localVariable(token,canAssign,arg);
         return;
-    } else if ((arg = resolveUpvalue(current,&token))!=-1) {
+    } else if ((arg = resolveUpvalue(context->current,&token))!=-1) {
         UpValue(token,canAssign,(uint16_t)arg);
         return ;
     }
@@ -429,20 +856,34 @@ static void namedVariable(Token token,bool canAssign){
     }
 }
 static void variable(bool canAssign){
-    namedVariable(parser.previous,canAssign);
+    namedVariable(context->parser.previous,canAssign);
 }
 
 static Token syntheticToken(const char* name){
     Token token;
     token.start = name;
     token.length = (int)strlen(name);
-    token.line = parser.current.line;
+    token.line = context->parser.current.line;
     return token;
 }
 
 static void unary(bool canAssign){
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = context->parser.previous.type;
+    int start = currentChunk()->count;
     parsePrecedence(PREC_UNARY);
+    Value operand;
+    if(constantOperand(start,&operand)){
+        if(operatorType == TOKEN_BANG){
+            truncateCode(start);
+            emitConstant(BOOL_VAL(isFalsey(operand)));
+            return;
+        }
+        if(operatorType == TOKEN_MINUS && IS_NUMBER(operand)){
+            truncateCode(start);
+            emitConstant(NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
     switch (operatorType)
     {
     case TOKEN_BANG: emitByte(OP_NOT); break;
@@ -452,7 +893,7 @@ static void unary(bool canAssign){
 }
 
 static void this_(bool canAssign){
-    if(currentClass == NULL){
+    if(context->currentClass == NULL){
         error("Can't use 'this' outside of a class.");
         return;
     }
@@ -460,15 +901,15 @@ static void this_(bool canAssign){
 }
 
 static void super_(bool canAssign){
-    if(currentClass==NULL){
+    if(context->currentClass==NULL){
         error("Can't use 'super' outside of a class.");
     }
-    else if(!currentClass->hasSuperclass){
+    else if(!context->currentClass->hasSuperclass){
         error("Can't use 'super' in a class with no superclass.");
     }
     consume(TOKEN_DOT,"Expect '.' after 'super'");
     consume(TOKEN_IDENTIFIER,"Expect superclass method name"); 
-    uint16_t name = identifierConstant(&parser.previous);
+    uint16_t name = identifierConstant(&context->parser.previous);
     namedVariable(syntheticToken("this"),false);
     if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
@@ -565,17 +1006,19 @@ ParseRule rules[] = {
 
 static void parsePrecedence(Precedence precedence){
   advance();
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+  ParseFn prefixRule = getRule(context->parser.previous.type)->prefix;
   if (prefixRule == NULL) {
     error("Expect expression.");
     return;
   }
   bool canAssign = precedence <= PREC_ASSIGNMENT;
+  int operandStart = currentChunk()->count;
   prefixRule(canAssign);
 
-    while(precedence <= getRule(parser.current.type)->precedence){
+    while(precedence <= getRule(context->parser.current.type)->precedence){
     advance();
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
+    ParseFn infixRule = getRule(context->parser.previous.type)->infix;
+    context->current->operandStart = operandStart;
     infixRule(canAssign);
     }   
 
@@ -585,18 +1028,7 @@ static void parsePrecedence(Precedence precedence){
 }
 
 static int identifierConstant(Token* name) {
-  for(int i = 0;i<currentChunk()->constants.count;i++){
-      if(IS_OBJ(currentChunk()->constants.values[i])
-        &&
-        OBJ_TYPE(currentChunk()->constants.values[i])==OBJ_STRING)
-     {
-          ObjString* string = AS_STRING(currentChunk()->constants.values[i]);
-          if(string->length == name->length && memcmp(string->chars,name->start,name->length)==0){
-              return i;
-          }
-      }
-  }
-  return addConstant(currentChunk(), OBJ_VAL(copyString(name->start, name->length)));
+  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -609,6 +1041,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     Local* local = &compiler->locals[i];
     if (identifiersEqual(name, &local->name)) {
       if(local->depth==-1){
+        if(context->skippingBody) return -1;//the body may well declare its own , the real compile reports it
         error("Can't read variable in its own initializer");
       }
       return i;
@@ -631,17 +1064,30 @@ static int addUpvalue(Compiler* compiler, uint16_t index,
       error("Too many closure variables in function.");
       return 0;
   }
+  if(upvalueCount == compiler->upvalueCapacity){
+      int oldCapacity = compiler->upvalueCapacity;
+      compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+      compiler->upvalues = ARENA_GROW(Upvalue,compiler->upvalues,oldCapacity,compiler->upvalueCapacity);
+  }
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
   return compiler->function->upvalueCount++;
 }
 
 static int resolveUpvalue(Compiler* compiler, Token* name) {
-  if (compiler->enclosing == NULL) return -1;
+  if (compiler->enclosing == NULL) {
+    if (compiler->lazy == NULL) return -1;
+    for (int i = 0; i < compiler->lazy->upvalueCount; i++) {
+      LazyName* captured = &compiler->lazy->upvalueNames[i];
+      if (captured->length == name->length && memcmp(captured->start, name->start, name->length) == 0) return i;
+    }
+    return -1;
+  }
 
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
+    compiler->enclosing->locals[local].escapes = true;
     return addUpvalue(compiler, (uint16_t)local, true);
   }
   int upvalue = resolveUpvalue(compiler->enclosing, name);
@@ -652,21 +1098,29 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 }
 
 static void addLocal(Token name){
-    if(current->localCount == UINT16_COUNT){
+    if(context->current->localCount == UINT16_COUNT){
         error("Too many local variables in function.");
         return;
     }
-    Local* local = &current->locals[current->localCount++];
+    if(context->current->localCount == context->current->localCapacity){
+        int oldCapacity = context->current->localCapacity;
+        context->current->localCapacity = GROW_CAPACITY(oldCapacity);
+        context->current->locals = ARENA_GROW(Local,context->current->locals,oldCapacity,context->current->localCapacity);
+    }
+    Local* local = &context->current->locals[context->current->localCount++];
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->allocSite = -1;
+    local->escapes = false;
+    local->isAssigned = false;
 }
 static void declareVariable(){
-    if(current->scopeDepth == 0) return;
-    Token* name = &parser.previous;
-    for(int i = current->localCount-1;i>=0;i--){
-        Local* local = &current->locals[i];
-        if(local->depth != -1 && local->depth < current->scopeDepth){
+    if(context->current->scopeDepth == 0) return;
+    Token* name = &context->parser.previous;
+    for(int i = context->current->localCount-1;i>=0;i--){
+        Local* local = &context->current->locals[i];
+        if(local->depth != -1 && local->depth < context->current->scopeDepth){
             break;
         }
         if(identifiersEqual(name,&local->name)){
@@ -678,17 +1132,17 @@ static void declareVariable(){
 static int parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
   declareVariable();//wont run in global scope
-  if(current->scopeDepth>0) return 0;
-  return identifierConstant(&parser.previous);
+  if(context->current->scopeDepth>0) return 0;
+  return identifierConstant(&context->parser.previous);
 }
 
 static void markInitialized(){
-    if (current->scopeDepth == 0) return;
-    current->locals[current->localCount-1].depth = current->scopeDepth;
+    if (context->current->scopeDepth == 0) return;
+    context->current->locals[context->current->localCount-1].depth = context->current->scopeDepth;
 }
 
 static void defineVariable(int global) {
-  if(current->scopeDepth >  0){
+  if(context->current->scopeDepth >  0){
     markInitialized();
     return;
   }
@@ -726,25 +1180,31 @@ static void expression(){
 }
 
 static void block(){
+    bool returned = false;
     while(!check(TOKEN_RIGHT_BRACE)&&!check(TOKEN_EOF)){
+        int start = currentChunk()->count;
+        bool isReturn = check(TOKEN_RETURN);
         declaration();
+        if(returned){
+            truncateCode(start);//nothing after a return can run , it only needs to be parsed
+        }
+        else if(isReturn){
+            returned = true;
+        }
     }
     consume(TOKEN_RIGHT_BRACE,"Expect '}' after block.");
 }
 
-static void function(FunctionType type){
-    Compiler compiler;
-    initCompiler(&compiler,type);
-    beginScope();
+static void parameters(FunctionType type){
     if(type==TYPE_GETTER){
-        current->function->arity = -1;//getters have negative arity
+        context->current->function->arity = -1;//getters have negative arity
         goto GETTER_LABEL;
     }
     consume(TOKEN_LEFT_PAREN,"Expect '(' after function name.");
     if (!check(TOKEN_RIGHT_PAREN)) {
         do {
-        current->function->arity++;
-        if (current->function->arity > 255) {
+        context->current->function->arity++;
+        if (context->current->function->arity > 255) {
             errorAtCurrent("Can't have more than 255 parameters.");
         }
         int constant = parseVariable("Expect parameter name.");
@@ -754,8 +1214,85 @@ static void function(FunctionType type){
     consume(TOKEN_RIGHT_PAREN,"Expect ')' after parameters.");
     GETTER_LABEL: //forgive me, the intrusive thoughts have won
     consume(TOKEN_LEFT_BRACE,"Expect '{' before function body.");
-    block();
-    ObjFunction* function = endCompiler();
+}
+
+//a name in a skipped body that refers to a variable around it gets captured the way the real
+//compile would , a few extra captures for names the body turns out to declare itself are harmless
+static void captureByName(Token* name,LazyName** names,int* capacity){
+    if(resolveLocal(context->current,name) != -1) return;
+    int upvalue = resolveUpvalue(context->current,name);
+    if(upvalue == -1) return;//a global
+    if(check(TOKEN_EQUAL)) markUpvalueAssigned(context->current,upvalue);
+    if(upvalue < *capacity && (*names)[upvalue].start != NULL) return;
+    if(upvalue >= *capacity){
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *names = GROW_ARRAY(LazyName,*names,oldCapacity,*capacity);
+        for(int i = oldCapacity; i < *capacity; i++) (*names)[i].start = NULL;
+    }
+    (*names)[upvalue].start = name->start;
+    (*names)[upvalue].length = name->length;
+}
+
+//--lazy only matches the braces of the body and records what it captures , compileLazy()
+//generates the code once the function is called
+static ObjFunction* skipBody(const char* start,int line,FunctionType type){
+    ObjFunction* function = context->current->function;
+    LazyName* names = NULL;
+    int capacity = 0;
+    int depth = 1;
+    TokenType previous = TOKEN_LEFT_BRACE;
+    context->skippingBody = true;
+    while(depth > 0){
+        if(check(TOKEN_EOF)){
+            errorAtCurrent("Expect '}' after block.");
+            break;
+        }
+        advance();
+        Token token = context->parser.previous;
+        if(token.type == TOKEN_LEFT_BRACE) depth++;
+        else if(token.type == TOKEN_RIGHT_BRACE) depth--;
+        else if(token.type == TOKEN_IDENTIFIER && previous != TOKEN_DOT) captureByName(&token,&names,&capacity);
+        else if(token.type == TOKEN_THIS || token.type == TOKEN_SUPER){
+            Token self = syntheticToken("this");
+            captureByName(&self,&names,&capacity);
+            if(token.type == TOKEN_SUPER){
+                Token super = syntheticToken("super");
+                captureByName(&super,&names,&capacity);
+            }
+        }
+        previous = token.type;
+    }
+    context->skippingBody = false;
+    int upvalueCount = function->upvalueCount;
+    names = GROW_ARRAY(LazyName,names,capacity,upvalueCount);
+    LazyBody* lazy = ALLOCATE(LazyBody,1);
+    lazy->start = start;
+    lazy->line = line;
+    lazy->type = (uint8_t)type;
+    lazy->classDepth = context->currentClass == NULL ? 0 : context->currentClass->hasSuperclass ? 2 : 1;
+    lazy->upvalueCount = upvalueCount;
+    lazy->upvalueNames = names;
+    function->lazy = lazy;
+    context->current = context->current->enclosing;
+    return function;
+}
+
+static void function(FunctionType type){
+    Compiler compiler;
+    initCompiler(&compiler,type);
+    beginScope();
+    const char* start = context->parser.current.start;
+    int line = context->parser.current.line;
+    parameters(type);
+    ObjFunction* function;
+    if(compilerOptions.lazy){
+        function = skipBody(start,line,type);
+    }
+    else{
+        block();
+        function = endCompiler();
+    }
     int func = addConstant(currentChunk(),OBJ_VAL(function)); // you don't know just HOW important the order of these two lines is
     emitByte(OP_CLOSURE);//with DEBUG_STRESS_GC enabled, emitByte() will call the gc, free the function and the function will be deallocated before it is added to the constants array
     //i spent 2 hours trying to find the line causing this bug
@@ -764,6 +1301,9 @@ static void function(FunctionType type){
     }
     emitBytes((uint8_t)(func >> 8), (uint8_t)(func & 0xff));
     for (int i = 0; i < function->upvalueCount; i++){
+        if(compiler.upvalues[i].isLocal){
+            addCaptureSite(compiler.upvalues[i].index,currentChunk()->count);
+        }
         emitByte((uint8_t)(compiler.upvalues[i].isLocal ? 1 : 0));
         emitBytes((uint8_t)(compiler.upvalues[i].index>>8),(uint8_t)(compiler.upvalues[i].index&0xff));
     }
@@ -771,13 +1311,13 @@ static void function(FunctionType type){
 
 static void method(){
     consume(TOKEN_IDENTIFIER,"Expect method name.");
-    uint16_t constant = identifierConstant(&parser.previous);
+    uint16_t constant = identifierConstant(&context->parser.previous);
     FunctionType type = TYPE_METHOD;
     if(!check(TOKEN_LEFT_PAREN)){
         type = TYPE_GETTER;
     }
-    if (parser.previous.length == 4 &&
-    memcmp(parser.previous.start, "init", 4) == 0) {
+    if (context->parser.previous.length == 4 &&
+    memcmp(context->parser.previous.start, "init", 4) == 0) {
     type = TYPE_INITIALIZER;
     }
     function(type);
@@ -786,20 +1326,20 @@ static void method(){
 }
 static void classDeclaration(){
     consume(TOKEN_IDENTIFIER,"Expect class name.");
-    Token name = parser.previous;
-    uint16_t nameConstant = identifierConstant(&parser.previous);
+    Token name = context->parser.previous;
+    uint16_t nameConstant = identifierConstant(&context->parser.previous);
     declareVariable();
     emitByte(OP_CLASS);
     emitBytes((uint8_t)(nameConstant >> 8), (uint8_t)(nameConstant & 0xff));
     defineVariable(nameConstant);
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
-    classCompiler.enclosing = currentClass;
-    currentClass = &classCompiler;
+    classCompiler.enclosing = context->currentClass;
+    context->currentClass = &classCompiler;
     if(match(TOKEN_LESS)){
         consume(TOKEN_IDENTIFIER,"Expect superclass name.");
         variable(false);
-        if(identifiersEqual(&name,&parser.previous)){
+        if(identifiersEqual(&name,&context->parser.previous)){
             error("A class can't inherit from itself.");
         }
         beginScope();
@@ -807,7 +1347,7 @@ static void classDeclaration(){
         defineVariable(0);
         namedVariable(name,false);
         emitByte(OP_INHERIT);
-        currentClass->hasSuperclass = true;
+        context->currentClass->hasSuperclass = true;
     }
     namedVariable(name,false);//load variable onto the stack
     consume(TOKEN_LEFT_BRACE,"Expect '{' before class body.");
@@ -819,7 +1359,7 @@ static void classDeclaration(){
     if(classCompiler.hasSuperclass){
         endScope();
     }
-    currentClass = currentClass->enclosing;
+    context->currentClass = context->currentClass->enclosing;
 }
 
 static void functionDeclaration(){
@@ -840,6 +1380,9 @@ static void varDeclaration() {
 
   if (match(TOKEN_EQUAL)) {
     expression();
+    if(context->current->scopeDepth > 0 && context->current->lastCall == currentChunk()->count - 2){
+        context->current->locals[context->current->localCount-1].allocSite = context->current->lastCall;
+    }
   } else {
     emitByte(OP_NIL);
   }
@@ -855,8 +1398,24 @@ static void expressionStatement(){
 }
 static void if_statement(){
     consume(TOKEN_LEFT_PAREN,"Expect '(' after 'if'.");
+    int conditionStart = currentChunk()->count;
     expression();
     consume(TOKEN_RIGHT_PAREN,"Expect ')' after condition");
+    Value condition;
+    if(constantOperand(conditionStart,&condition)){
+        //only the branch that can be taken is kept , the other one is still compiled for errors
+        bool isTruthy = !isFalsey(condition);
+        truncateCode(conditionStart);
+        int branchStart = currentChunk()->count;
+        statement();
+        if(!isTruthy) truncateCode(branchStart);
+        if(match(TOKEN_ELSE)){
+            branchStart = currentChunk()->count;
+            statement();
+            if(isTruthy) truncateCode(branchStart);
+        }
+        return;
+    }
     int thenJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);//pop the condtition value when truthy
     statement();
@@ -870,49 +1429,176 @@ static void if_statement(){
 }
 
 static void whileStatement(){
-    int sorroundingLoopStart = current->currentLoopStart;
-    int sorroundingexitJump = current->currentExitJump;
-    current->currentLoopStart = currentChunk()->count;
+    int sorroundingLoopStart = context->current->currentLoopStart;
+    int sorroundingLoopScope = context->current->currentLoopScope;
+    int sorroundingexitJump = context->current->currentExitJump;
+    context->current->currentLoopStart = currentChunk()->count;
+    context->current->currentLoopScope = context->current->scopeDepth;
     consume(TOKEN_LEFT_PAREN,"Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN,"Expect ')' after condition.");
-    current->currentExitJump = emitJump(OP_JUMP_IF_FALSE);
+    context->current->currentExitJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
     statement();
-    emitLoop(current->currentLoopStart);
-    patchJump(current->currentExitJump);
+    emitLoop(context->current->currentLoopStart);
+    patchJump(context->current->currentExitJump);
     emitByte(OP_POP);
-    current->currentExitJump = sorroundingexitJump;
-    current->currentLoopStart = sorroundingLoopStart;
+    context->current->currentExitJump = sorroundingexitJump;
+    context->current->currentLoopScope = sorroundingLoopScope;
+    context->current->currentLoopStart = sorroundingLoopStart;
+}
+
+typedef struct{
+    int counter;
+    bool limitIsConstant;
+    int limit;//local slot or constant index
+    int step;//constant index
+    LoopComparison comparison;
+}CountedLoop;
+
+static int shortAt(int offset){
+    return (currentChunk()->code[offset] << 8) | currentChunk()->code[offset+1];
+}
+
+static bool localAt(int offset,uint8_t instruction,int slot){
+    if(offset + 3 > currentChunk()->count || currentChunk()->code[offset] != instruction) return false;
+    return slot == -1 || shortAt(offset+1) == slot;
+}
+
+//index of the number constant pushed at offset , -1 if it is anything else
+static int numberAt(int offset,int* length){
+    Chunk* chunk = currentChunk();
+    int index = -1;
+    if(offset + 2 <= chunk->count && chunk->code[offset] == OP_CONSTANT){
+        index = chunk->code[offset+1];
+        *length = 2;
+    }
+    else if(offset + 3 <= chunk->count && chunk->code[offset] == OP_CONSTANT_LONG){
+        index = shortAt(offset+1);
+        *length = 3;
+    }
+    if(index == -1 || !IS_NUMBER(chunk->constants.values[index])) return -1;
+    return index;
+}
+
+//looks at the header the loop just compiled to , `i < limit; i = i + step` with the limit a local
+//or a number constant and the step a number constant
+static bool matchCountedLoop(int start,int counter,CountedLoop* loop){
+    Chunk* chunk = currentChunk();
+    uint8_t* code = chunk->code;
+    int at = start;
+    int length;
+    loop->counter = counter;
+    if(!localAt(at,OP_GET_LOCAL,counter)) return false;
+    at += 3;
+    if(localAt(at,OP_GET_LOCAL,-1) && shortAt(at+1) != counter){
+        loop->limitIsConstant = false;
+        loop->limit = shortAt(at+1);
+        at += 3;
+    }
+    else if((loop->limit = numberAt(at,&length)) != -1){
+        loop->limitIsConstant = true;
+        at += length;
+    }
+    else return false;
+    if(at + 1 > chunk->count || (code[at] != OP_LESS && code[at] != OP_GREATER)) return false;
+    bool less = code[at++] == OP_LESS;
+    bool negated = at < chunk->count && code[at] == OP_NOT;
+    if(negated) at++;
+    loop->comparison = less ? (negated ? LOOP_GREATER_EQUAL : LOOP_LESS) : (negated ? LOOP_LESS_EQUAL : LOOP_GREATER);
+    if(!localAt(at,OP_JUMP_IF_FALSE,-1)) return false;
+    at += 3;
+    if(at + 1 > chunk->count || code[at++] != OP_POP) return false;
+    if(!localAt(at,OP_JUMP,-1)) return false;
+    at += 3;
+    if(!localAt(at,OP_GET_LOCAL,counter)) return false;
+    at += 3;
+    if((loop->step = numberAt(at,&length)) == -1) return false;
+    at += length;
+    if(at + 1 > chunk->count || (code[at] != OP_ADD && code[at] != OP_SUBTRACT)) return false;
+    bool subtract = code[at++] == OP_SUBTRACT;
+    if(!localAt(at,OP_SET_LOCAL,counter)) return false;
+    at += 3;
+    if(at + 1 > chunk->count || code[at++] != OP_POP) return false;
+    if(!localAt(at,OP_LOOP,-1) || at + 3 != chunk->count) return false;
+    if(subtract) loop->step = makeConstant(NUMBER_VAL(-AS_NUMBER(chunk->constants.values[loop->step])));
+    return true;
+}
+
+//returns where the jump distance goes
+static int emitCountedLoop(uint8_t instruction,CountedLoop* loop,int line){
+    Chunk* chunk = currentChunk();
+    writeChunk(chunk,instruction,line);
+    writeChunk(chunk,(loop->counter >> 8) & 0xff,line);
+    writeChunk(chunk,loop->counter & 0xff,line);
+    writeChunk(chunk,loop->limitIsConstant,line);
+    writeChunk(chunk,(loop->limit >> 8) & 0xff,line);
+    writeChunk(chunk,loop->limit & 0xff,line);
+    writeChunk(chunk,loop->comparison,line);
+    if(instruction == OP_FOR_LOOP){
+        writeChunk(chunk,(loop->step >> 8) & 0xff,line);
+        writeChunk(chunk,loop->step & 0xff,line);
+    }
+    writeChunk(chunk,0xff,line);
+    writeChunk(chunk,0xff,line);
+    return chunk->count - 2;
+}
+
+//the counter and limit are checked once by OP_FOR_PREP , after that each iteration is a single
+//OP_FOR_LOOP at the bottom of the body , continue and break reach it through the jumps in front
+static void countedLoopBody(CountedLoop* loop,int line){
+    int prepJump = emitCountedLoop(OP_FOR_PREP,loop,line);
+    int bodyJump = emitJump(OP_JUMP);
+    int continueJump = emitJump(OP_JUMP);
+    context->current->currentLoopStart = continueJump - 1;
+    context->current->currentExitJump = currentChunk()->count + 1;//break comes back to this pop with its false
+    emitByte(OP_POP);
+    int breakJump = emitJump(OP_JUMP);
+    patchJump(bodyJump);
+    int bodyStart = currentChunk()->count;
+    statement();
+    patchJump(continueJump);
+    int loopJump = emitCountedLoop(OP_FOR_LOOP,loop,line);
+    int offset = currentChunk()->count - bodyStart;
+    if(offset > UINT16_MAX) error("Loop body too large.");
+    currentChunk()->code[loopJump] = (offset >> 8) & 0xff;
+    currentChunk()->code[loopJump+1] = offset & 0xff;
+    patchJump(prepJump);
+    patchJump(breakJump);
 }
 
 static void forStatement(){
   
     beginScope();
     consume(TOKEN_LEFT_PAREN,"Expect '(' after 'for'.");
+    int counter = -1;
     if(match(TOKEN_SEMICOLON)){
         //no initializer
     }
     else if(match(TOKEN_VAR)){
         varDeclaration();
+        counter = context->current->localCount - 1;
     }
     else{
         expressionStatement();
     }
-    int sorroundingLoopStart = current->currentLoopStart;
-    int sorroundingLoopScope = current->currentLoopScope;
-    int sorroundingExitJump = current->currentExitJump;
-    current->currentLoopStart = currentChunk()->count;
-    current->currentLoopScope = current->scopeDepth;
+    int sorroundingLoopStart = context->current->currentLoopStart;
+    int sorroundingLoopScope = context->current->currentLoopScope;
+    int sorroundingExitJump = context->current->currentExitJump;
+    context->current->currentLoopStart = currentChunk()->count;
+    context->current->currentLoopScope = context->current->scopeDepth;
+    int conditionStart = currentChunk()->count;
+    int line = context->parser.previous.line;
     if(!match(TOKEN_SEMICOLON)){
         expression();
         consume(TOKEN_SEMICOLON,"Expect ';' after loop condition.");
-        current->currentExitJump = emitJump(OP_JUMP_IF_FALSE);
+        context->current->currentExitJump = emitJump(OP_JUMP_IF_FALSE);
         emitByte(OP_POP);
     }
     else{
         emitByte(OP_TRUE);
-        current->currentExitJump = emitJump(OP_JUMP_IF_FALSE);
+        context->current->currentExitJump = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(OP_POP);
     }
     if (!match(TOKEN_RIGHT_PAREN)){
         int bodyJump = emitJump(OP_JUMP);
@@ -920,63 +1606,76 @@ static void forStatement(){
         expression();
         emitByte(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-        emitLoop(current->currentLoopStart);
-        current->currentLoopStart = incrementStart;
+        emitLoop(context->current->currentLoopStart);
+        context->current->currentLoopStart = incrementStart;
         patchJump(bodyJump);
     }
-    statement();
-    emitLoop(current->currentLoopStart);
+    CountedLoop loop;
+    if(counter != -1 && matchCountedLoop(conditionStart,counter,&loop)){
+        truncateCode(conditionStart);
+        countedLoopBody(&loop,line);
+    }
+    else{
+        statement();
+        emitLoop(context->current->currentLoopStart);
 
-    patchJump(current->currentExitJump);
-    emitByte(OP_POP);
-    current->currentExitJump = sorroundingExitJump;
-    current->currentLoopScope = sorroundingLoopScope;
-    current->currentLoopStart = sorroundingLoopStart;
+        patchJump(context->current->currentExitJump);
+        emitByte(OP_POP);
+    }
+    context->current->currentExitJump = sorroundingExitJump;
+    context->current->currentLoopScope = sorroundingLoopScope;
+    context->current->currentLoopStart = sorroundingLoopStart;
     endScope();
 }
 
 static void continueStatement(){
-    if(current->currentLoopStart == -1){
+    if(context->current->currentLoopStart == -1){
         error("Can't use 'continue' outside of a loop.");
     }
 
     consume(TOKEN_SEMICOLON,"Expect ';' after 'continue'.");
 
-    for(int i = current->localCount-1;
-        i>=0 && current->locals[i].depth>current->currentLoopScope;
+    for(int i = context->current->localCount-1;
+        i>=0 && context->current->locals[i].depth>context->current->currentLoopScope;
         i--)
     {
-        emitByte(OP_POP);
+        emitByte(context->current->locals[i].allocSite != -1 ? OP_RELEASE : OP_POP);
     }
-    emitLoop(current->currentLoopStart);
+    emitLoop(context->current->currentLoopStart);
 }
 
 static void breakStatement(){
-    if(current->currentExitJump == -1){
+    if(context->current->currentExitJump == -1){
         error("Can't use 'break' outside of a loop.");
     }
     consume(TOKEN_SEMICOLON,"Expect ';' after 'break'.");
-    for(int i = current->localCount-1;
-        i>=0 && current->locals[i].depth>current->currentLoopScope;
+    for(int i = context->current->localCount-1;
+        i>=0 && context->current->locals[i].depth>context->current->currentLoopScope;
         i--)
     {
-        emitByte(OP_POP);
+        emitByte(context->current->locals[i].allocSite != -1 ? OP_RELEASE : OP_POP);
     }
     emitByte(OP_FALSE);
-    emitLoop(current->currentExitJump-1);
+    emitLoop(context->current->currentExitJump-1);
 }
 
 static void returnStatement() {
-  if (current->type == TYPE_SCRIPT) {
+  if (context->current->type == TYPE_SCRIPT) {
     error("Can't return from top-level code.");
   }
   if (match(TOKEN_SEMICOLON)) {
     emitReturn();
-  } else if(current->type == TYPE_INITIALIZER){
+  } else if(context->current->type == TYPE_INITIALIZER){
     error("Can't return a value from an initializer.");
   }else {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    if(context->current->lastCall != -1 && context->current->lastCall == currentChunk()->count - 2){
+        currentChunk()->code[context->current->lastCall] = OP_TAIL_CALL;//nothing in this frame is needed once the callee starts
+    }
+    else if(context->current->lastInvoke != -1 && context->current->lastInvoke == currentChunk()->count - 4){
+        currentChunk()->code[context->current->lastInvoke] = OP_TAIL_INVOKE;
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -988,10 +1687,10 @@ static void printStatement(){
 }
 
 static void synchronize(){
-    parser.panicMode = false;
-    while(parser.current.type!=TOKEN_EOF){
-        if(parser.previous.type == TOKEN_SEMICOLON) return;
-        switch(parser.current.type){
+    context->parser.panicMode = false;
+    while(context->parser.current.type!=TOKEN_EOF){
+        if(context->parser.previous.type == TOKEN_SEMICOLON) return;
+        switch(context->parser.current.type){
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -1017,7 +1716,7 @@ static void declaration(){
   }else {
     statement();
   }
-    if(parser.panicMode) synchronize();
+    if(context->parser.panicMode) synchronize();
 }
 static void statement(){
     if(match(TOKEN_PRINT)){
@@ -1055,24 +1754,150 @@ static void comma(bool canAssign){
     emitByte(OP_POP);
     parsePrecedence(PREC_COMMA);
 }
-ObjFunction* compile(const char* source){
-    initScanner(source);
+//--lazy parses bodies long after compile() returns , so it works on a copy that lives as long as the vm
+typedef struct RetainedSource{
+    struct RetainedSource* next;
+    char chars[];
+}RetainedSource;
+
+static THREAD_LOCAL RetainedSource* retainedSources = NULL;
+
+static const char* retainSource(const char* source,RetainedSource** list){
+    size_t length = strlen(source);
+    RetainedSource* retained = (RetainedSource*)malloc(sizeof(RetainedSource) + length + 1);
+    if(retained == NULL) exit(1);
+    memcpy(retained->chars,source,length + 1);
+    retained->next = *list;
+    *list = retained;
+    return retained->chars;
+}
+
+void freeRetainedSources(){
+    while(retainedSources != NULL){
+        RetainedSource* next = retainedSources->next;
+        free(retainedSources);
+        retainedSources = next;
+    }
+}
+
+//hands back the context that was active before , a compile puts it back when it is done
+static CompileContext* enterContext(CompileContext* fresh){
+    CompileContext* enclosing = context;
+    fresh->parser.hadError = false;
+    fresh->parser.panicMode = false;
+    fresh->current = NULL;
+    fresh->currentClass = NULL;
+    fresh->skippingBody = false;
+    fresh->arena = NULL;
+    context = fresh;
+    return enclosing;
+}
+
+static void leaveContext(CompileContext* enclosing){
+    freeArena();
+    context = enclosing;
+}
+
+bool compileLazy(ObjFunction* function){
+    LazyBody* lazy = function->lazy;
+    CompileContext fresh;
+    CompileContext* enclosing = enterContext(&fresh);
+    initScannerAt(&context->scanner,lazy->start,lazy->line);
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = NULL;
+    classCompiler.hasSuperclass = lazy->classDepth == 2;
+    context->currentClass = lazy->classDepth > 0 ? &classCompiler : NULL;
+    context->parser.previous.start = function->name != NULL ? function->name->chars : "";
+    context->parser.previous.length = function->name != NULL ? function->name->length : 0;
+    Compiler compiler;
+    initCompiler(&compiler,(FunctionType)lazy->type);
+    compiler.lazy = lazy;
+    beginScope();
+    advance();
+    parameters((FunctionType)lazy->type);
+    block();
+    ObjFunction* compiled = endCompiler();
+    bool hadError = context->parser.hadError;
+    leaveContext(enclosing);
+    if(hadError) return false;
+    //the closures already point at function , so the code moves over to it
+    function->chunk = compiled->chunk;
+    initChunk(&compiled->chunk);
+    function->maxStack = compiled->maxStack;
+    function->inlineKind = compiled->inlineKind;
+    function->inlineSlot = compiled->inlineSlot;
+    function->inlineValue = compiled->inlineValue;
+    function->lazy = NULL;
+    FREE_ARRAY(LazyName,lazy->upvalueNames,lazy->upvalueCount);
+    FREE_ARRAY(LazyBody,lazy,1);
+    return true;
+}
+
+static ObjFunction* compileSource(const char* source,RetainedSource** retained){
+    if(compilerOptions.lazy) source = retainSource(source,retained);
+    CompileContext fresh;
+    CompileContext* enclosing = enterContext(&fresh);
+    initScanner(&context->scanner,source);
     Compiler compiler;
     initCompiler(&compiler,TYPE_SCRIPT);
-    parser.hadError = false;
-    parser.panicMode = false;
     advance();
     while(!match(TOKEN_EOF)){
         declaration();
     }
     ObjFunction* function = endCompiler();
-    return parser.hadError ? NULL : function;
+    bool hadError = context->parser.hadError;
+    leaveContext(enclosing);
+    return hadError ? NULL : function;
+}
+
+ObjFunction* compile(const char* source){
+    return compileSource(source,&retainedSources);
+}
+
+void compileDetached(const char* source,CompiledUnit* unit){
+    ObjectPool* enclosing = objectPool;
+    initObjectPool(&unit->pool);
+    unit->retained = NULL;
+    objectPool = &unit->pool;
+    unit->function = compileSource(source,&unit->retained);
+    objectPool = enclosing;
+}
+
+//strings in the unit were interned against its own table , each one is swapped for the vm's copy if it has one
+static void adoptConstants(ObjFunction* function){
+    if(function->name != NULL) function->name = internString(function->name);
+    ValueArray* constants = &function->chunk.constants;
+    for(int i = 0; i < constants->count; i++){
+        Value constant = constants->values[i];
+        if(IS_STRING(constant)) constants->values[i] = OBJ_VAL(internString(AS_STRING(constant)));
+        else if(isObjType(constant,OBJ_FUNCTION)) adoptConstants(AS_FUNCTION(constant));
+    }
+    if(IS_STRING(function->inlineValue)) function->inlineValue = OBJ_VAL(internString(AS_STRING(function->inlineValue)));
+}
+
+ObjFunction* adoptCompiled(CompiledUnit* unit){
+    adoptObjectPool(&unit->pool);
+    ObjFunction* function = unit->function;
+    if(function != NULL){
+        push(OBJ_VAL(function));//interning can collect , the strings it hasn't got to yet are only reachable from here
+        adoptConstants(function);
+        pop();
+    }
+    while(unit->retained != NULL){
+        RetainedSource* next = unit->retained->next;
+        unit->retained->next = retainedSources;
+        retainedSources = unit->retained;
+        unit->retained = next;
+    }
+    unit->function = NULL;
+    return function;
 }
 
 void markCompilerRoots(){
-    Compiler* compiler = current;
+    if(context == NULL) return;
+    Compiler* compiler = context->current;
     while(compiler!=NULL){
         markObject((Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
-}
\ No newline at end of file
+}
@@ -58,6 +58,34 @@ static int byteInstructionLong(const char* name, Chunk* chunk, int offset) {
   return offset + 3;
 }
 
+static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
+  int constant = chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
+  int argCount = chunk->code[offset + 3];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int countedLoopInstruction(const char* name, Chunk* chunk, int offset) {
+  static const char* comparisons[] = {"<", "<=", ">", ">="};
+  uint8_t* code = &chunk->code[offset];
+  int counter = (code[1] << 8) | code[2];
+  int limit = (code[4] << 8) | code[5];
+  printf("%-16s %4d %s ", name, counter, comparisons[code[6]]);
+  if (code[3]) {
+    printValue(chunk->constants.values[limit]);
+  } else {
+    printf("[%d]", limit);
+  }
+  if (code[0] == OP_FOR_LOOP) {
+    printf(" step ");
+    printValue(chunk->constants.values[(code[7] << 8) | code[8]]);
+  }
+  printf(" -> %d\n", jumpTarget(chunk, offset));
+  return offset + instructionLength(chunk, offset);
+}
+
 int dissassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
   int line = getLine(chunk, offset);
@@ -112,7 +140,19 @@ int dissassembleInstruction(Chunk* chunk, int offset) {
   &&SUPER_INVOKE,
   &&MAKE_LIST,
   &&GET_ELEMENT,
-  &&SET_ELEMENT
+  &&SET_ELEMENT,
+  &&CALL_LOCAL,
+  &&RELEASE,
+  &&ADD_NUM,
+  &&SUBTRACT_NUM,
+  &&MULTIPLY_NUM,
+  &&DIVIDE_NUM,
+  &&LESS_NUM,
+  &&GREATER_NUM,
+  &&TAIL_CALL,
+  &&FOR_PREP,
+  &&FOR_LOOP,
+  &&TAIL_INVOKE
   };
 
   uint8_t instruction = chunk->code[offset];
@@ -193,7 +233,7 @@ int dissassembleInstruction(Chunk* chunk, int offset) {
         int isLocal = chunk->code[offset++];
         int index = chunk->code[offset++]<<8|chunk->code[offset++];
         printf("%04d      |                     %s %d\n",
-               offset - 2, isLocal ? "local" : "upvalue", index);
+               offset - 2, isLocal == 2 ? "value" : isLocal ? "local" : "upvalue", index);
       }
       return offset;    
     }
@@ -212,15 +252,9 @@ int dissassembleInstruction(Chunk* chunk, int offset) {
   METHOD:
     return constantInstructionLong("OP_METHOD", chunk, offset);
   INVOKE:
-    {
-      offset++;
-      int constant = chunk->code[offset++]<<8|chunk->code[offset++];
-      int argCount = chunk->code[offset++];
-      printf("%-16s (%d args) %4d '", "OP_INVOKE", argCount, constant);
-      printValue(chunk->constants.values[constant]);
-      printf("'\n");
-      return offset;
-    }
+    return invokeInstruction("OP_INVOKE", chunk, offset);
+  TAIL_INVOKE:
+    return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
   INHERIT:
     return simpleInstruction("OP_INHERIT", offset);
   SUPER_GET:
@@ -241,4 +275,26 @@ int dissassembleInstruction(Chunk* chunk, int offset) {
     return simpleInstruction("OP_GET_ELEMENT", offset);
   SET_ELEMENT:
     return simpleInstruction("OP_SET_ELEMENT", offset);
+  CALL_LOCAL:
+    return byteInstruction("OP_CALL_LOCAL", chunk, offset);
+  RELEASE:
+    return simpleInstruction("OP_RELEASE", offset);
+  ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+  SUBTRACT_NUM:
+    return simpleInstruction("OP_SUBTRACT_NUM", offset);
+  MULTIPLY_NUM:
+    return simpleInstruction("OP_MULTIPLY_NUM", offset);
+  DIVIDE_NUM:
+    return simpleInstruction("OP_DIVIDE_NUM", offset);
+  LESS_NUM:
+    return simpleInstruction("OP_LESS_NUM", offset);
+  GREATER_NUM:
+    return simpleInstruction("OP_GREATER_NUM", offset);
+  TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
+  FOR_PREP:
+    return countedLoopInstruction("OP_FOR_PREP", chunk, offset);
+  FOR_LOOP:
+    return countedLoopInstruction("OP_FOR_LOOP", chunk, offset);
 }
\ No newline at end of file
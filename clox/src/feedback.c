@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include "feedback.h"
+#include "chunk.h"
+#include "memory.h"
+
+static THREAD_LOCAL Feedback* profiled = NULL;
+
+static bool isSite(uint8_t instruction,uint8_t* kind){
+    switch(instruction){
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE: case OP_POWER:
+        case OP_LESS: case OP_GREATER: case OP_EQUAL: case OP_NEGATE:
+            *kind = SITE_OPERANDS;
+            return true;
+        case OP_GET_PROPERTY: case OP_SET_PROPERTY: case OP_INVOKE: case OP_TAIL_INVOKE:
+            *kind = SITE_RECEIVER;
+            return true;
+        case OP_CALL: case OP_TAIL_CALL: case OP_CALL_LOCAL:
+            *kind = SITE_CALL;
+            return true;
+        case OP_LOOP: case OP_FOR_LOOP:
+            *kind = SITE_LOOP;
+            return true;
+        default:
+            return false;
+    }
+}
+
+//malloced rather than gc accounted , making one must not start a collection in the middle of an instruction
+static Feedback* feedbackFor(ObjFunction* function){
+    if(function->feedback != NULL) return function->feedback;
+    Chunk* chunk = &function->chunk;
+    Feedback* feedback = (Feedback*)malloc(sizeof(Feedback));
+    uint16_t* siteAt = (uint16_t*)calloc(chunk->count + 1,sizeof(uint16_t));
+    if(feedback == NULL || siteAt == NULL) exit(1);
+    int count = 0;
+    uint8_t kind;
+    for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk,offset)){
+        if(isSite(chunk->code[offset],&kind) && count < UINT16_MAX) siteAt[offset] = (uint16_t)++count;
+    }
+    feedback->sites = (FeedbackSite*)calloc(count + 1,sizeof(FeedbackSite));
+    if(feedback->sites == NULL) exit(1);
+    for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk,offset)){
+        if(siteAt[offset] == 0) continue;
+        FeedbackSite* site = &feedback->sites[siteAt[offset] - 1];
+        isSite(chunk->code[offset],&site->kind);
+        site->offset = (uint32_t)offset;
+    }
+    feedback->siteAt = siteAt;
+    feedback->siteCount = count;
+    feedback->invocations = 0;
+    feedback->function = function;
+    feedback->next = profiled;
+    profiled = feedback;
+    function->feedback = feedback;
+    return feedback;
+}
+
+static FeedbackSite* siteFor(ObjFunction* function,uint8_t* at){
+    Feedback* feedback = feedbackFor(function);
+    uint16_t index = feedback->siteAt[at - function->chunk.code];
+    if(index == 0) return NULL;
+    FeedbackSite* site = &feedback->sites[index - 1];
+    site->count++;
+    return site;
+}
+
+static uint8_t typeOf(Value value){
+    if(IS_NUMBER(value)) return FEEDBACK_NUMBER;
+    if(IS_STRING(value)) return FEEDBACK_STRING;
+    if(IS_BOOL(value)) return FEEDBACK_BOOL;
+    if(IS_NIL(value)) return FEEDBACK_NIL;
+    if(IS_INSTANCE(value)) return FEEDBACK_INSTANCE;
+    return FEEDBACK_OTHER;
+}
+
+static void see(FeedbackSite* site,Obj* object){
+    for(int i = 0; i < site->ways && i < FEEDBACK_WAYS; i++){
+        if(site->seen[i] == object) return;
+    }
+    if(site->ways < FEEDBACK_WAYS) site->seen[site->ways++] = object;
+    else site->ways = FEEDBACK_WAYS + 1;
+}
+
+void feedbackOperands(ObjFunction* function,uint8_t* at,Value a,Value b){
+    FeedbackSite* site = siteFor(function,at);
+    if(site != NULL) site->types |= typeOf(a) | typeOf(b);
+}
+
+void feedbackReceiver(ObjFunction* function,uint8_t* at,Value receiver){
+    FeedbackSite* site = siteFor(function,at);
+    if(site == NULL) return;
+    site->types |= typeOf(receiver);
+    if(IS_INSTANCE(receiver)) see(site,(Obj*)AS_INSTANCE(receiver)->klass);
+}
+
+void feedbackCall(ObjFunction* function,uint8_t* at,Value callee){
+    FeedbackSite* site = siteFor(function,at);
+    if(site == NULL) return;
+    site->types |= typeOf(callee);
+    if(IS_CLOSURE(callee)) see(site,(Obj*)AS_CLOSURE(callee)->function);
+    else if(IS_BOUND_METHOD(callee)) see(site,(Obj*)AS_BOUND_METHOD(callee)->method->function);
+    else if(IS_OBJ(callee)) see(site,AS_OBJ(callee));//classes and natives
+}
+
+void feedbackLoop(ObjFunction* function,uint8_t* at){
+    siteFor(function,at);
+}
+
+void feedbackInvocation(ObjFunction* function){
+    if(function == NULL) return;//natives , and classes without an initializer
+    feedbackFor(function)->invocations++;
+}
+
+void markFeedback(){
+    for(Feedback* feedback = profiled; feedback != NULL; feedback = feedback->next){
+        for(int i = 0; i < feedback->siteCount; i++){
+            FeedbackSite* site = &feedback->sites[i];
+            for(int j = 0; j < site->ways && j < FEEDBACK_WAYS; j++) markObject(site->seen[j]);
+        }
+    }
+}
+
+void freeFeedback(ObjFunction* function){
+    Feedback* feedback = function->feedback;
+    if(feedback == NULL) return;
+    Feedback** link = &profiled;
+    while(*link != feedback) link = &(*link)->next;
+    *link = feedback->next;
+    free(feedback->sites);
+    free(feedback->siteAt);
+    free(feedback);
+    function->feedback = NULL;
+}
+
+static const char* siteName(uint8_t instruction){
+    switch(instruction){
+        case OP_ADD: return "OP_ADD";
+        case OP_SUBTRACT: return "OP_SUBTRACT";
+        case OP_MULTIPLY: return "OP_MULTIPLY";
+        case OP_DIVIDE: return "OP_DIVIDE";
+        case OP_POWER: return "OP_POWER";
+        case OP_LESS: return "OP_LESS";
+        case OP_GREATER: return "OP_GREATER";
+        case OP_EQUAL: return "OP_EQUAL";
+        case OP_NEGATE: return "OP_NEGATE";
+        case OP_GET_PROPERTY: return "OP_GET_PROPERTY";
+        case OP_SET_PROPERTY: return "OP_SET_PROPERTY";
+        case OP_INVOKE: return "OP_INVOKE";
+        case OP_CALL: return "OP_CALL";
+        case OP_TAIL_CALL: return "OP_TAIL_CALL";
+        case OP_TAIL_INVOKE: return "OP_TAIL_INVOKE";
+        case OP_CALL_LOCAL: return "OP_CALL_LOCAL";
+        case OP_LOOP: return "OP_LOOP";
+        default: return "OP_FOR_LOOP";
+    }
+}
+
+static void printTypes(FILE* out,uint8_t types){
+    static const char* names[] = {"number","string","bool","nil","instance","other"};
+    bool first = true;
+    for(int i = 0; i < 6; i++){
+        if(!(types & (1 << i))) continue;
+        fprintf(out,first ? " %s" : "|%s",names[i]);
+        first = false;
+    }
+}
+
+static void printSeen(FILE* out,Obj* object){
+    switch(object->type){
+        case OBJ_FUNCTION:{
+            ObjString* name = ((ObjFunction*)object)->name;
+            fprintf(out," %s",name != NULL ? name->chars : "<script>");
+            break;
+        }
+        case OBJ_CLASS:
+            fprintf(out," %s",((ObjClass*)object)->name->chars);
+            break;
+        default:
+            fprintf(out," <%s>",objTypeName(object->type));
+            break;
+    }
+}
+
+static void dumpFunction(FILE* out,Feedback* feedback){
+    ObjFunction* function = feedback->function;
+    fprintf(out,"== %s == %u calls\n",function->name != NULL ? function->name->chars : "<script>",feedback->invocations);
+    for(int i = 0; i < feedback->siteCount; i++){
+        FeedbackSite* site = &feedback->sites[i];
+        if(site->count == 0) continue;
+        fprintf(out,"%04u %-16s %10u",site->offset,siteName(function->chunk.code[site->offset]),site->count);
+        if(site->kind == SITE_LOOP){
+            fprintf(out," iterations\n");
+            continue;
+        }
+        printTypes(out,site->types);
+        for(int j = 0; j < site->ways && j < FEEDBACK_WAYS; j++) printSeen(out,site->seen[j]);
+        if(site->ways > FEEDBACK_WAYS) fprintf(out," (megamorphic)");
+        else if(site->ways > 1) fprintf(out," (polymorphic)");
+        fprintf(out,"\n");
+    }
+}
+
+//oldest first , the script comes before what it called
+void dumpFeedback(FILE* out){
+    int count = 0;
+    for(Feedback* feedback = profiled; feedback != NULL; feedback = feedback->next) count++;
+    Feedback** order = (Feedback**)malloc(sizeof(Feedback*)*(count + 1));
+    if(order == NULL) exit(1);
+    int i = count;
+    for(Feedback* feedback = profiled; feedback != NULL; feedback = feedback->next) order[--i] = feedback;
+    for(i = 0; i < count; i++) dumpFunction(out,order[i]);
+    free(order);
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "isolate.h"
+#include "compiler.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+struct Isolate{
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+    char* source;
+    Message* argument;
+    InterpretResult result;
+    Isolate* next;//in the spawner's list
+};
+
+static THREAD_LOCAL Isolate* spawned = NULL;
+static THREAD_LOCAL Message* argument = NULL;
+
+//the whole life of a vm , on the isolate's own thread
+static void runIsolate(Isolate* isolate){
+    argument = isolate->argument;
+    initVM();
+    isolate->result = interpret(isolate->source);
+    freeVM();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI isolateThread(LPVOID isolate){
+    runIsolate((Isolate*)isolate);
+    return 0;
+}
+#else
+static void* isolateThread(void* isolate){
+    runIsolate((Isolate*)isolate);
+    return NULL;
+}
+#endif
+
+static void freeArgument(Message* argument){
+    if(argument == NULL) return;
+    freeMessage(argument);
+    free(argument);
+}
+
+Isolate* spawnIsolate(const char* source,Message* argument){
+    Isolate* isolate = (Isolate*)malloc(sizeof(Isolate));
+    size_t length = strlen(source);
+    char* copy = (char*)malloc(length + 1);
+    if(isolate == NULL || copy == NULL) exit(1);
+    memcpy(copy,source,length + 1);
+    isolate->source = copy;
+    isolate->argument = argument;
+    isolate->result = INTERPRET_OK;
+    isolate->next = NULL;
+#ifdef _WIN32
+    isolate->thread = CreateThread(NULL,0,isolateThread,isolate,0,NULL);
+    bool started = isolate->thread != NULL;
+#else
+    bool started = pthread_create(&isolate->thread,NULL,isolateThread,isolate) == 0;
+#endif
+    if(!started){
+        freeArgument(argument);
+        free(copy);
+        free(isolate);
+        return NULL;
+    }
+    return isolate;
+}
+
+InterpretResult joinIsolate(Isolate* isolate){
+#ifdef _WIN32
+    WaitForSingleObject(isolate->thread,INFINITE);
+    CloseHandle(isolate->thread);
+#else
+    pthread_join(isolate->thread,NULL);
+#endif
+    InterpretResult result = isolate->result;
+    freeArgument(isolate->argument);
+    free(isolate->source);
+    free(isolate);
+    return result;
+}
+
+static char* readSource(const char* path){
+    FILE* file = fopen(path,"rb");
+    if(file == NULL) return NULL;
+    fseek(file,0L,SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    char* source = size >= 0 ? (char*)malloc(size + 1) : NULL;
+    if(source == NULL || fread(source,1,size,file) < (size_t)size){
+        free(source);
+        fclose(file);
+        return NULL;
+    }
+    source[size] = '\0';
+    fclose(file);
+    return source;
+}
+
+bool spawnFile(const char* path,Message* argument){
+    char* source = readSource(path);
+    if(source == NULL){
+        freeArgument(argument);
+        return false;
+    }
+    Isolate* isolate = spawnIsolate(source,argument);
+    free(source);
+    if(isolate == NULL) return false;
+    isolate->next = spawned;
+    spawned = isolate;
+    return true;
+}
+
+//a script that is done waits for the ones it started , their errors were already reported
+void joinSpawned(){
+    while(spawned != NULL){
+        Isolate* isolate = spawned;
+        spawned = isolate->next;
+        joinIsolate(isolate);
+    }
+}
+
+Message* isolateArgument(){
+    return argument;
+}
+
+struct CompileJob{
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+    char* source;
+    CompiledUnit unit;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI compileThread(LPVOID job){
+    compileDetached(((CompileJob*)job)->source,&((CompileJob*)job)->unit);
+    return 0;
+}
+#else
+static void* compileThread(void* job){
+    compileDetached(((CompileJob*)job)->source,&((CompileJob*)job)->unit);
+    return NULL;
+}
+#endif
+
+CompileJob* startCompile(const char* path){
+    char* source = readSource(path);
+    if(source == NULL) return NULL;
+    CompileJob* job = (CompileJob*)malloc(sizeof(CompileJob));
+    if(job == NULL) exit(1);
+    job->source = source;
+#ifdef _WIN32
+    job->thread = CreateThread(NULL,0,compileThread,job,0,NULL);
+    bool started = job->thread != NULL;
+#else
+    bool started = pthread_create(&job->thread,NULL,compileThread,job) == 0;
+#endif
+    if(!started){
+        free(source);
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+
+ObjFunction* finishCompile(CompileJob* job){
+#ifdef _WIN32
+    WaitForSingleObject(job->thread,INFINITE);
+    CloseHandle(job->thread);
+#else
+    pthread_join(job->thread,NULL);
+#endif
+    ObjFunction* function = adoptCompiled(&job->unit);//a failed compile's objects are adopted too , the gc frees them
+    free(job->source);//--lazy keeps a copy of its own
+    free(job);
+    return function;
+}
@@ -0,0 +1,423 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "jit.h"
+#include "chunk.h"
+#include "x64.h"
+
+#ifdef JIT_ENABLED
+
+//a baseline compiler , every instruction becomes a fixed template and the templates are stitched together
+//in bytecode order. values stay boxed on the vm stack , doubles are only unboxed inside an instruction.
+//the simple instructions run inline , the rest call back into the vm (jitStep and friends).
+//while the code runs
+//  rbx  the CallFrame
+//  r12  the stack top , written to vm.stackTop before anything else gets to look at the stack
+//  r13  frame->slots , reloaded after every call since the stack can move
+//  r14  the VM
+//  r15  QNAN , for the number checks
+
+//jump targets that aren't bytecode offsets
+#define EXIT_ERROR (-1)
+#define EXIT_RETURNED (-2)
+#define EXIT_TAIL_CALLED (-3)
+
+static void pushValue(Assembler* as,int reg){
+    x64Store(as,R12,0,reg);
+    x64AddImmediate(as,R12,8);
+}
+
+//the helper gets the frame and the instruction , NULL back means the error was already reported
+static void callVm(Assembler* as,CallFrame* (*helper)(CallFrame*,uint8_t*),uint8_t* at){
+    x64Store(as,R14,offsetof(VM,stackTop),R12);
+    x64Alu(as,ALU_MOV,RDI,RBX);
+    x64LoadImmediate(as,RSI,(uint64_t)(uintptr_t)at);
+    x64Call(as,(void*)helper);
+    x64Alu(as,ALU_TEST,RAX,RAX);
+    x64JumpTo(as,CC_E,EXIT_ERROR);
+}
+
+static void reloadFrame(Assembler* as){
+    x64Alu(as,ALU_MOV,RBX,RAX);
+    x64Load(as,R13,RBX,offsetof(CallFrame,slots));
+    x64Load(as,R12,R14,offsetof(VM,stackTop));
+}
+
+static void stepInVm(Assembler* as,uint8_t* at){
+    callVm(as,jitStep,at);
+    reloadFrame(as);
+}
+
+//a and b from the top two slots into xmm0 and xmm1 , the labels are for when either isn't a number
+static void loadOperands(Assembler* as,bool check,int* slow){
+    x64Load(as,RAX,R12,-16);
+    x64Load(as,RDX,R12,-8);
+    if(check){
+        slow[0] = x64UnlessNumber(as,RAX);
+        slow[1] = x64UnlessNumber(as,RDX);
+    }
+    x64ToXmm(as,0,RAX);
+    x64ToXmm(as,1,RDX);
+}
+
+//the result in rax replaces both operands
+static void finishBinary(Assembler* as,bool check,int* slow,uint8_t* at){
+    x64Store(as,R12,-16,RAX);
+    x64AddImmediate(as,R12,-8);
+    if(!check) return;
+    int done = x64JumpForward(as,-1);
+    x64Land(as,slow[0]);
+    x64Land(as,slow[1]);
+    stepInVm(as,at);
+    x64Land(as,done);
+}
+
+static void arithmetic(Assembler* as,uint8_t op,bool check,uint8_t* at){
+    int slow[2];
+    loadOperands(as,check,slow);
+    x64ScalarDouble(as,op,0,1);
+    x64FromXmm(as,RAX,0);
+    finishBinary(as,check,slow,at);
+}
+
+static void comparison(Assembler* as,bool less,bool check,uint8_t* at){
+    int slow[2];
+    loadOperands(as,check,slow);
+    if(less) x64CompareDoubles(as,1,0);//b > a
+    else x64CompareDoubles(as,0,1);
+    x64SetCondition(as,CC_A,RAX);
+    x64BoxBool(as);
+    finishBinary(as,check,slow,at);
+}
+
+static void equal(Assembler* as){
+    x64Load(as,RAX,R12,-16);
+    x64Load(as,RDX,R12,-8);
+    int bits[2];
+    bits[0] = x64UnlessNumber(as,RAX);
+    bits[1] = x64UnlessNumber(as,RDX);
+    x64ToXmm(as,0,RAX);
+    x64ToXmm(as,1,RDX);
+    x64CompareDoubles(as,0,1);
+    x64SetCondition(as,CC_E,RAX);
+    x64SetCondition(as,CC_NP,RCX);
+    x64Byte(as,0x20);//and al,cl
+    x64Byte(as,0xc8);
+    int done = x64JumpForward(as,-1);
+    x64Land(as,bits[0]);
+    x64Land(as,bits[1]);
+    x64Alu(as,ALU_CMP,RAX,RDX);
+    x64SetCondition(as,CC_E,RAX);
+    x64Land(as,done);
+    x64BoxBool(as);
+    x64Store(as,R12,-16,RAX);
+    x64AddImmediate(as,R12,-8);
+}
+
+//counter in xmm0 , limit in xmm1 , jumps when the loop keeps going (or when it stops , for OP_FOR_PREP)
+static void loopTest(Assembler* as,uint8_t comparison,bool keepGoing,int target){
+    bool swap = comparison == LOOP_LESS || comparison == LOOP_GREATER_EQUAL;
+    if(swap) x64CompareDoubles(as,1,0);
+    else x64CompareDoubles(as,0,1);
+    //<= and >= are the negated opposite test , which keeps NaN going like loopContinues() does
+    int cc = comparison == LOOP_LESS || comparison == LOOP_GREATER ? CC_A : CC_BE;
+    if(!keepGoing) cc = cc == CC_A ? CC_BE : CC_A;
+    x64JumpTo(as,cc,target);
+}
+
+static void forLoop(Assembler* as,Chunk* chunk,int offset){
+    uint8_t* at = &chunk->code[offset];
+    bool step = at[0] == OP_FOR_LOOP;
+    uint16_t slot = (uint16_t)(at[1] << 8 | at[2]);
+    uint16_t limit = (uint16_t)(at[4] << 8 | at[5]);
+    x64Load(as,RAX,R13,8*slot);
+    if(at[3]) x64LoadImmediate(as,RDX,chunk->constants.values[limit]);
+    else x64Load(as,RDX,R13,8*limit);
+    int slow[2];
+    slow[0] = x64UnlessNumber(as,RAX);
+    slow[1] = x64UnlessNumber(as,RDX);
+    x64ToXmm(as,0,RAX);
+    if(step){
+        x64LoadImmediate(as,RCX,chunk->constants.values[(uint16_t)(at[7] << 8 | at[8])]);
+        x64ToXmm(as,1,RCX);
+        x64ScalarDouble(as,SSE_ADD,0,1);
+        x64FromXmm(as,RAX,0);
+        x64Store(as,R13,8*slot,RAX);
+    }
+    x64ToXmm(as,1,RDX);
+    loopTest(as,at[6],step,jumpTarget(chunk,offset));
+    int done = x64JumpForward(as,-1);
+    x64Land(as,slow[0]);
+    x64Land(as,slow[1]);
+    stepInVm(as,at);//only ever reports the error
+    x64Land(as,done);
+}
+
+//nothing to close and no frame objects is the common case , that one pops the frame inline
+//a global that already exists when the function is compiled is read and written in place. its entry
+//only moves when vm.globals grows , which always changes the capacity , so that is what gets checked
+static void global(Assembler* as,Chunk* chunk,uint8_t* at,bool set){
+    bool isLong = at[0] == OP_GET_GLOBAL_LONG || at[0] == OP_SET_GLOBAL_LONG;
+    ObjString* name = AS_STRING(chunk->constants.values[isLong ? at[1] << 8 | at[2] : at[1]]);
+    Value* address = tableValueAddress(&vm.globals,name);
+    if(address == NULL){
+        stepInVm(as,at);
+        return;
+    }
+    x64Byte(as,0x41);//cmp dword [r14+capacity],imm32
+    x64Byte(as,0x81);
+    x64Memory(as,7,R14,offsetof(VM,globals) + offsetof(Table,capacity));
+    x64Int32(as,(uint32_t)vm.globals.capacity);
+    int slow = x64JumpForward(as,CC_NE);
+    x64LoadImmediate(as,RCX,(uint64_t)(uintptr_t)address);
+    if(set){
+        x64Load(as,RAX,R12,-8);
+        x64Store(as,RCX,0,RAX);
+    }
+    else{
+        x64Load(as,RAX,RCX,0);
+        pushValue(as,RAX);
+    }
+    int done = x64JumpForward(as,-1);
+    x64Land(as,slow);
+    stepInVm(as,at);
+    x64Land(as,done);
+}
+
+static void returnFromFrame(Assembler* as,uint8_t* at){
+    x64Load(as,RAX,R14,offsetof(VM,openUpvalues));
+    x64Alu(as,ALU_TEST,RAX,RAX);
+    int closed = x64JumpForward(as,CC_E);
+    x64Load(as,RAX,RAX,offsetof(ObjUpvalue,location));
+    x64Alu(as,ALU_CMP,RAX,R13);
+    int open = x64JumpForward(as,CC_AE);
+    x64Land(as,closed);
+    x64Load(as,RAX,RBX,offsetof(CallFrame,frameObjects));
+    x64Alu(as,ALU_TEST,RAX,RAX);
+    int objects = x64JumpForward(as,CC_NE);
+    x64Load(as,RAX,R12,-8);
+    x64Store(as,R13,0,RAX);
+    x64Alu(as,ALU_MOV,R12,R13);
+    x64AddImmediate(as,R12,8);
+    x64Store(as,R14,offsetof(VM,stackTop),R12);
+    x64Byte(as,0x41);//dec dword [r14+frameCount]
+    x64Byte(as,0xff);
+    x64Memory(as,1,R14,offsetof(VM,frameCount));
+    x64JumpTo(as,-1,EXIT_RETURNED);
+    x64Land(as,open);
+    x64Land(as,objects);
+    callVm(as,jitReturn,at);
+    x64JumpTo(as,-1,EXIT_RETURNED);
+}
+
+static void compileInstruction(Assembler* as,Chunk* chunk,int offset){
+    uint8_t* at = &chunk->code[offset];
+    switch(at[0]){
+        case OP_CONSTANT:
+            x64LoadImmediate(as,RAX,chunk->constants.values[at[1]]);
+            pushValue(as,RAX);
+            break;
+        case OP_CONSTANT_LONG:
+            x64LoadImmediate(as,RAX,chunk->constants.values[(uint16_t)(at[1] << 8 | at[2])]);
+            pushValue(as,RAX);
+            break;
+        case OP_NIL:
+            x64LoadImmediate(as,RAX,NIL_VAL);
+            pushValue(as,RAX);
+            break;
+        case OP_TRUE:
+            x64LoadImmediate(as,RAX,TRUE_VAL);
+            pushValue(as,RAX);
+            break;
+        case OP_FALSE:
+            x64LoadImmediate(as,RAX,FALSE_VAL);
+            pushValue(as,RAX);
+            break;
+        case OP_POP:
+            x64AddImmediate(as,R12,-8);
+            break;
+        case OP_GET_LOCAL:
+            x64Load(as,RAX,R13,8*(at[1] << 8 | at[2]));
+            pushValue(as,RAX);
+            break;
+        case OP_SET_LOCAL:
+            x64Load(as,RAX,R12,-8);
+            x64Store(as,R13,8*(at[1] << 8 | at[2]),RAX);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            global(as,chunk,at,false);
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+            global(as,chunk,at,true);
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            x64JumpTo(as,-1,jumpTarget(chunk,offset));
+            break;
+        case OP_JUMP_IF_FALSE:{
+            int target = jumpTarget(chunk,offset);
+            x64Load(as,RAX,R12,-8);
+            x64LoadImmediate(as,RCX,FALSE_VAL);
+            x64Alu(as,ALU_CMP,RAX,RCX);
+            x64JumpTo(as,CC_E,target);
+            x64LoadImmediate(as,RCX,NIL_VAL);
+            x64Alu(as,ALU_CMP,RAX,RCX);
+            x64JumpTo(as,CC_E,target);
+            break;
+        }
+        case OP_EQUAL:
+            equal(as);
+            break;
+        case OP_NOT:
+            x64Load(as,RAX,R12,-8);
+            x64Falsey(as);
+            x64BoxBool(as);
+            x64Store(as,R12,-8,RAX);
+            break;
+        case OP_NEGATE:{
+            x64Load(as,RAX,R12,-8);
+            int slow = x64UnlessNumber(as,RAX);
+            x64LoadImmediate(as,RCX,SIGN_BIT);
+            x64Alu(as,ALU_XOR,RAX,RCX);
+            x64Store(as,R12,-8,RAX);
+            int done = x64JumpForward(as,-1);
+            x64Land(as,slow);
+            stepInVm(as,at);
+            x64Land(as,done);
+            break;
+        }
+        case OP_ADD: arithmetic(as,SSE_ADD,true,at); break;
+        case OP_SUBTRACT: arithmetic(as,SSE_SUB,true,at); break;
+        case OP_MULTIPLY: arithmetic(as,SSE_MUL,true,at); break;
+        case OP_DIVIDE: arithmetic(as,SSE_DIV,true,at); break;
+        case OP_ADD_NUM: arithmetic(as,SSE_ADD,false,at); break;
+        case OP_SUBTRACT_NUM: arithmetic(as,SSE_SUB,false,at); break;
+        case OP_MULTIPLY_NUM: arithmetic(as,SSE_MUL,false,at); break;
+        case OP_DIVIDE_NUM: arithmetic(as,SSE_DIV,false,at); break;
+        case OP_LESS: comparison(as,true,true,at); break;
+        case OP_GREATER: comparison(as,false,true,at); break;
+        case OP_LESS_NUM: comparison(as,true,false,at); break;
+        case OP_GREATER_NUM: comparison(as,false,false,at); break;
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:
+            forLoop(as,chunk,offset);
+            break;
+        case OP_RETURN:
+            returnFromFrame(as,at);
+            break;
+        case OP_CALL:
+            callVm(as,jitCall,at);
+            reloadFrame(as);
+            break;
+        case OP_TAIL_CALL:
+        case OP_TAIL_INVOKE:
+            callVm(as,jitTailCall,at);
+            x64Byte(as,0x48);//cmp rax,1
+            x64Byte(as,0x83);
+            x64Byte(as,0xf8);
+            x64Byte(as,0x01);
+            x64JumpTo(as,CC_E,EXIT_TAIL_CALLED);
+            reloadFrame(as);
+            break;
+        default:
+            stepInVm(as,at);
+            break;
+    }
+}
+
+static void prologue(Assembler* as){
+    x64Push(as,RBX);//five pushes on top of the return address keep calls 16 byte aligned
+    x64Push(as,R12);
+    x64Push(as,R13);
+    x64Push(as,R14);
+    x64Push(as,R15);
+    x64Alu(as,ALU_MOV,RBX,RDI);
+    x64Alu(as,ALU_MOV,R14,RSI);
+    x64Load(as,R13,RBX,offsetof(CallFrame,slots));
+    x64Load(as,R12,R14,offsetof(VM,stackTop));
+    x64LoadImmediate(as,R15,QNAN);
+}
+
+//frame->ip is the code's start when the frame was just called , or a loop header when run() hands a
+//frame over in the middle of a loop (see enterLoop in vm.c). functions without loops skip this
+static void loopEntries(Assembler* as,Chunk* chunk){
+    bool loaded = false;
+    for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk,offset)){
+        if(chunk->code[offset] != OP_LOOP && chunk->code[offset] != OP_FOR_LOOP) continue;
+        if(!loaded) x64Load(as,RAX,RBX,offsetof(CallFrame,ip));
+        loaded = true;
+        x64LoadImmediate(as,RCX,(uint64_t)(uintptr_t)&chunk->code[jumpTarget(chunk,offset)]);
+        x64Alu(as,ALU_CMP,RAX,RCX);
+        x64JumpTo(as,CC_E,jumpTarget(chunk,offset));
+    }
+}
+
+static void epilogue(Assembler* as,int* exits){
+    int statuses[3] = {JIT_ERROR,JIT_RETURNED,JIT_TAIL_CALLED};
+    int done[2];
+    for(int i = 0; i < 3; i++){
+        exits[i] = as->count;
+        x64Byte(as,0xb8);//mov eax,status
+        x64Int32(as,statuses[i]);
+        if(i < 2) done[i] = x64JumpForward(as,-1);
+    }
+    x64Land(as,done[0]);
+    x64Land(as,done[1]);
+    x64Pop(as,R15);
+    x64Pop(as,R14);
+    x64Pop(as,R13);
+    x64Pop(as,R12);
+    x64Pop(as,RBX);
+    x64Byte(as,0xc3);
+}
+
+bool jitCompile(ObjFunction* function){
+    Chunk* chunk = &function->chunk;
+    if(function->native != NULL || chunk->count == 0) return function->native != NULL;
+    Assembler as = {NULL,0,0,NULL,0,0};
+    int exits[3];
+    int* starts = (int*)malloc(sizeof(int)*chunk->count);//machine code offset of every instruction
+    if(starts == NULL) exit(1);
+    for(int i = 0; i < chunk->count; i++) starts[i] = -1;
+    prologue(&as);
+    loopEntries(&as,chunk);
+    for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk,offset)){
+        starts[offset] = as.count;
+        compileInstruction(&as,chunk,offset);
+    }
+    epilogue(&as,exits);
+    bool resolved = true;
+    for(int i = 0; i < as.patchCount; i++){
+        int target = as.patches[i].target;
+        int to = target < 0 ? exits[-1 - target] : target < chunk->count ? starts[target] : -1;
+        if(to < 0){
+            resolved = false;
+            break;
+        }
+        x64Patch(&as,as.patches[i].at,to - (as.patches[i].at + 4));
+    }
+    if(resolved) function->native = x64Finish(&as,&function->nativeSize);
+    freeAssembler(&as);
+    free(starts);
+    return function->native != NULL;
+}
+
+void jitFree(ObjFunction* function){
+    if(function->native == NULL || function->nativeSize == 0) return;//0 is code compiled into the program by --emit-c
+    x64Release(function->native,function->nativeSize);
+    function->native = NULL;
+    function->nativeSize = 0;
+}
+
+#else
+
+bool jitCompile(ObjFunction* function){
+    return false;
+}
+
+void jitFree(ObjFunction* function){
+}
+
+#endif
@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "loxc.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+//layout , all integers little endian:
+//  "LOXC" version:u32 flags:u8 sourceLength:u32 sourceHash:u64 function
+//a function is
+//  arity:u32 upvalueCount:u32 maxStack:u32 name:value inlineKind:u8 inlineSlot:u16
+//  codeCount:u32 code lineCount:u32 (offset:u32 line:u32)* constantCount:u32 value* inlineValue:value
+//a string is length:u32 followed by its chars and a nul
+//upvalue descriptors live in the OP_CLOSURE operands , so the code carries them
+
+//loaded images are mapped read only and stay mapped until the vm is done , code arrays and
+//string chars point straight into them and the objects holding them are immortal
+
+#define MAGIC "LOXC"
+
+typedef enum{
+    LOXC_NIL,
+    LOXC_FALSE,
+    LOXC_TRUE,
+    LOXC_NUMBER,
+    LOXC_STRING,
+    LOXC_FUNCTION
+}ValueTag;
+
+typedef struct{
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    bool failed;//something in the function can't be stored
+}Writer;
+
+typedef struct{
+    const uint8_t* bytes;
+    size_t count;
+    size_t at;
+    bool failed;
+}Reader;
+
+typedef struct Image{
+    struct Image* next;
+    void* bytes;
+    size_t size;
+}Image;
+
+static THREAD_LOCAL Image* images = NULL;
+
+static uint64_t hashSource(const char* source,size_t length){
+    uint64_t hash = 14695981039346656037u;//fnv-1a
+    for(size_t i = 0; i < length; i++){
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static uint8_t flags(){
+    return compilerOptions.optimize ? 1 : 0;
+}
+
+static void writeBytes(Writer* writer,const void* bytes,size_t count){
+    if(writer->count + count > writer->capacity){
+        size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+        while(capacity < writer->count + count) capacity *= 2;
+        writer->bytes = (uint8_t*)realloc(writer->bytes,capacity);
+        if(writer->bytes == NULL) exit(1);
+        writer->capacity = capacity;
+    }
+    memcpy(writer->bytes + writer->count,bytes,count);
+    writer->count += count;
+}
+
+static void writeInt(Writer* writer,uint64_t value,int size){
+    uint8_t bytes[8];
+    for(int i = 0; i < size; i++) bytes[i] = (value >> (8*i)) & 0xff;
+    writeBytes(writer,bytes,size);
+}
+
+static void writeFunction(Writer* writer,ObjFunction* function);
+
+static void writeValue(Writer* writer,Value value){
+    if(IS_NIL(value)) writeInt(writer,LOXC_NIL,1);
+    else if(IS_BOOL(value)) writeInt(writer,AS_BOOL(value) ? LOXC_TRUE : LOXC_FALSE,1);
+    else if(IS_NUMBER(value)){
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits,&number,sizeof(bits));
+        writeInt(writer,LOXC_NUMBER,1);
+        writeInt(writer,bits,8);
+    }
+    else if(IS_STRING(value)){
+        writeInt(writer,LOXC_STRING,1);
+        writeInt(writer,AS_STRING(value)->length,4);
+        writeBytes(writer,AS_STRING(value)->chars,AS_STRING(value)->length + 1);
+    }
+    else if(isObjType(value,OBJ_FUNCTION)){
+        writeInt(writer,LOXC_FUNCTION,1);
+        writeFunction(writer,AS_FUNCTION(value));
+    }
+    else writer->failed = true;
+}
+
+static void writeFunction(Writer* writer,ObjFunction* function){
+    Chunk* chunk = &function->chunk;
+    if(function->lazy != NULL) writer->failed = true;//nothing to store before it has been called
+    writeInt(writer,function->arity,4);
+    writeInt(writer,function->upvalueCount,4);
+    writeInt(writer,function->maxStack,4);
+    writeValue(writer,function->name != NULL ? OBJ_VAL(function->name) : NIL_VAL);
+    writeInt(writer,function->inlineKind,1);
+    writeInt(writer,function->inlineSlot,2);
+    writeInt(writer,chunk->count,4);
+    writeBytes(writer,chunk->code,chunk->count);
+    writeInt(writer,chunk->lineCount,4);
+    for(int i = 0; i < chunk->lineCount; i++){
+        writeInt(writer,chunk->lines[i].offset,4);
+        writeInt(writer,chunk->lines[i].line,4);
+    }
+    writeInt(writer,chunk->constants.count,4);
+    for(int i = 0; i < chunk->constants.count; i++){
+        writeValue(writer,chunk->constants.values[i]);
+    }
+    writeValue(writer,function->inlineValue);
+}
+
+static void writeImage(Writer* writer,const char* source,ObjFunction* function){
+    size_t length = strlen(source);
+    writeBytes(writer,MAGIC,4);
+    writeInt(writer,LOXC_VERSION,4);
+    writeInt(writer,flags(),1);
+    writeInt(writer,length,4);
+    writeInt(writer,hashSource(source,length),8);
+    writeFunction(writer,function);
+}
+
+void saveBytecode(const char* path,const char* source,ObjFunction* function){
+    Writer writer = {NULL,0,0,false};
+    writeImage(&writer,source,function);
+    if(!writer.failed){
+        //written next to it and renamed so a run that starts halfway never sees part of a file
+        size_t pathLength = strlen(path);
+        char* temporary = (char*)malloc(pathLength + 5);
+        if(temporary == NULL) exit(1);
+        memcpy(temporary,path,pathLength);
+        memcpy(temporary + pathLength,".tmp",5);
+        FILE* file = fopen(temporary,"wb");
+        if(file != NULL){
+            bool written = fwrite(writer.bytes,1,writer.count,file) == writer.count;
+            if(fclose(file) != 0) written = false;
+            if(!written || rename(temporary,path) != 0) remove(temporary);
+        }
+        free(temporary);
+    }
+    free(writer.bytes);
+}
+
+uint8_t* saveImage(ObjFunction* function,size_t* size){
+    Writer writer = {NULL,0,0,false};
+    writeImage(&writer,"",function);
+    if(writer.failed){
+        free(writer.bytes);
+        return NULL;
+    }
+    *size = writer.count;
+    return writer.bytes;
+}
+
+static uint64_t readInt(Reader* reader,int size){
+    if(reader->failed || reader->count - reader->at < (size_t)size){
+        reader->failed = true;
+        return 0;
+    }
+    uint64_t value = 0;
+    for(int i = 0; i < size; i++) value |= (uint64_t)reader->bytes[reader->at + i] << (8*i);
+    reader->at += size;
+    return value;
+}
+
+static const uint8_t* readBytes(Reader* reader,size_t count){
+    if(reader->failed || reader->count - reader->at < count){
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = &reader->bytes[reader->at];
+    reader->at += count;
+    return bytes;
+}
+
+static ObjFunction* readFunction(Reader* reader);
+
+//whatever comes back isn't rooted , the caller stores it before allocating again
+static Value readValue(Reader* reader){
+    switch(readInt(reader,1)){
+        case LOXC_NIL: return NIL_VAL;
+        case LOXC_FALSE: return BOOL_VAL(false);
+        case LOXC_TRUE: return BOOL_VAL(true);
+        case LOXC_NUMBER:{
+            uint64_t bits = readInt(reader,8);
+            double number;
+            memcpy(&number,&bits,sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case LOXC_STRING:{
+            uint32_t length = (uint32_t)readInt(reader,4);
+            const uint8_t* chars = readBytes(reader,(size_t)length + 1);
+            if(chars == NULL || chars[length] != '\0'){
+                reader->failed = true;
+                return NIL_VAL;
+            }
+            return OBJ_VAL(mappedString((const char*)chars,length));
+        }
+        case LOXC_FUNCTION:{
+            ObjFunction* function = readFunction(reader);
+            return function != NULL ? OBJ_VAL(function) : NIL_VAL;
+        }
+        default:
+            reader->failed = true;
+            return NIL_VAL;
+    }
+}
+
+static ObjFunction* readFunction(Reader* reader){
+    if(vm.stackTop - vm.stack >= vm.stackCapacity - STACK_SLACK){
+        reader->failed = true;//nested deeper than we have room to keep them rooted
+        return NULL;
+    }
+    ObjFunction* function = newFunction();
+    function->obj.isImmortal = true;
+    push(OBJ_VAL(function));
+    Chunk* chunk = &function->chunk;
+    function->arity = (int)readInt(reader,4);
+    function->upvalueCount = (int)readInt(reader,4);
+    function->maxStack = (int)readInt(reader,4);
+    Value name = readValue(reader);
+    if(IS_STRING(name)) function->name = AS_STRING(name);
+    function->inlineKind = (uint8_t)readInt(reader,1);
+    function->inlineSlot = (uint16_t)readInt(reader,2);
+    uint32_t codeCount = (uint32_t)readInt(reader,4);
+    const uint8_t* code = readBytes(reader,codeCount);
+    if(code != NULL){
+        chunk->code = (uint8_t*)code;//capacity stays 0 , nothing ever writes to it
+        chunk->count = codeCount;
+    }
+    uint32_t lineCount = (uint32_t)readInt(reader,4);
+    if(!reader->failed && reader->count - reader->at >= (size_t)lineCount*8 && lineCount > 0){
+        chunk->lines = ALLOCATE(LineStart,lineCount);
+        chunk->lineCapacity = lineCount;
+        for(uint32_t i = 0; i < lineCount; i++){
+            chunk->lines[i].offset = (int)readInt(reader,4);
+            chunk->lines[i].line = (int)readInt(reader,4);
+        }
+        chunk->lineCount = lineCount;
+    }
+    else if(lineCount > 0) reader->failed = true;
+    uint32_t constantCount = (uint32_t)readInt(reader,4);
+    for(uint32_t i = 0; i < constantCount && !reader->failed; i++){
+        addConstant(chunk,readValue(reader));
+    }
+    //after the constants , so a string here is the interned one they already keep alive
+    function->inlineValue = readValue(reader);
+    pop();
+    return reader->failed ? NULL : function;
+}
+
+static Image* mapImage(const char* path){
+#ifdef _WIN32
+    FILE* file = fopen(path,"rb");
+    if(file == NULL) return NULL;
+    fseek(file,0L,SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    void* bytes = size > 0 ? malloc(size) : NULL;
+    if(bytes != NULL && fread(bytes,1,size,file) != (size_t)size){
+        free(bytes);
+        bytes = NULL;
+    }
+    fclose(file);
+#else
+    int file = open(path,O_RDONLY);
+    if(file < 0) return NULL;
+    struct stat info;
+    void* bytes = NULL;
+    off_t size = 0;
+    if(fstat(file,&info) == 0 && info.st_size > 0){
+        size = info.st_size;
+        bytes = mmap(NULL,size,PROT_READ,MAP_PRIVATE,file,0);
+        if(bytes == MAP_FAILED) bytes = NULL;
+    }
+    close(file);//the mapping keeps the file alive , and the cache is only ever replaced by rename
+#endif
+    if(bytes == NULL) return NULL;
+    Image* image = (Image*)malloc(sizeof(Image));
+    if(image == NULL) exit(1);
+    image->bytes = bytes;
+    image->size = (size_t)size;
+    image->next = NULL;
+    return image;
+}
+
+static void unmapImage(Image* image){
+#ifdef _WIN32
+    free(image->bytes);
+#else
+    munmap(image->bytes,image->size);
+#endif
+    free(image);
+}
+
+//the header , false if the image is from another version or was compiled from other source
+static bool readHeader(Reader* reader,const char* source,bool checkFlags){
+    const uint8_t* magic = readBytes(reader,4);
+    bool fresh = magic != NULL && memcmp(magic,MAGIC,4) == 0 &&
+        readInt(reader,4) == LOXC_VERSION &&
+        (readInt(reader,1) == flags() || !checkFlags);
+    uint64_t length = readInt(reader,4);
+    uint64_t hash = readInt(reader,8);
+    if(source != NULL) fresh = fresh && length == strlen(source) && hash == hashSource(source,length);
+    return fresh && !reader->failed;
+}
+
+ObjFunction* loadBytecode(const char* path,const char* source){
+    Image* image = mapImage(path);
+    if(image == NULL) return NULL;
+    Reader reader = {(const uint8_t*)image->bytes,image->size,0,false};
+    if(!readHeader(&reader,source,true)){
+        unmapImage(image);
+        return NULL;
+    }
+    //kept even if reading fails halfway , the objects made so far already point into it
+    image->next = images;
+    images = image;
+    return readFunction(&reader);
+}
+
+ObjFunction* loadImage(const uint8_t* bytes,size_t size){
+    Reader reader = {bytes,size,0,false};
+    if(!readHeader(&reader,NULL,false)) return NULL;
+    return readFunction(&reader);
+}
+
+void unmapBytecode(){
+    while(images != NULL){
+        Image* next = images->next;
+        unmapImage(images);
+        images = next;
+    }
+}
@@ -5,6 +5,13 @@
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
+#include "compiler.h"
+#include "loxc.h"
+#include "scanner.h"
+#include "aot.h"
+#include "feedback.h"
+#include "isolate.h"
+#include <time.h>
 
 static void repl(){
   char line[1024];
@@ -44,31 +51,201 @@ static char* readFile(const char* path) {
   return buffer;
 }
 
+static bool useCache = true;
+
+//script.lox is cached as script.loxc , anything else just gets .loxc added
+static char* cachePath(const char* path){
+  size_t length = strlen(path);
+  char* cache = (char*)malloc(length + 6);
+  if(cache==NULL){
+    fprintf(stderr,"Not enough memory to read \"%s\".\n",path);
+    exit(74);
+  }
+  memcpy(cache,path,length+1);
+  strcat(cache,length >= 4 && strcmp(path + length - 4,".lox") == 0 ? "c" : ".loxc");
+  return cache;
+}
+
+static bool isImage(const char* path){
+  size_t length = strlen(path);
+  return length >= 5 && strcmp(path + length - 5,".loxc") == 0;
+}
+
+//a shipped .loxc , run without looking for its source
+static void runImage(const char* path) {
+  ObjFunction* function = loadBytecode(path,NULL);
+  if(function==NULL){
+    fprintf(stderr,"Could not load image \"%s\".\n",path);
+    exit(74);
+  }
+  InterpretResult result = interpretFunction(function);
+  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
 static void runFile(const char* path) {
+  if(isImage(path)){
+    runImage(path);
+    return;
+  }
   char* source = readFile(path);
 #ifdef DUMP_PROGRAM_OUTPUT
   freopen("output.txt","w",stdout);
 #endif
-  InterpretResult result = interpret(source);
+  InterpretResult result;
+  if(useCache){
+    char* cache = cachePath(path);
+    ObjFunction* function = loadBytecode(cache,source);
+    if(function==NULL){
+      function = compile(source);
+      if(function!=NULL) saveBytecode(cache,source,function);
+    }
+    free(cache);
+    result = function!=NULL ? interpretFunction(function) : INTERPRET_COMPILE_ERROR;
+  }
+  else{
+    result = interpret(source);
+  }
   free(source); 
+  if(compilerOptions.feedback) dumpFeedback(stderr);//a runtime error still gets its profile
 
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+//the script as a C program on stdout , see aot.h
+static void emitFile(const char* path) {
+  char* source = readFile(path);
+  compilerOptions.lazy = false;//every body has to be there to be translated
+  ObjFunction* function = compile(source);
+  free(source);
+  if(function==NULL) exit(65);
+  if(!emitC(stdout,function,path)){
+    fprintf(stderr,"Could not translate \"%s\".\n",path);
+    exit(70);
+  }
+}
+
+//scanner throughput , tokenizes the file over and over for about a second
+static void scanFile(const char* path) {
+  char* source = readFile(path);
+  size_t length = strlen(source);
+  long tokens = 0;
+  int passes = 0;
+  clock_t start = clock();
+  double elapsed;
+  Scanner scanner;
+  do{
+    initScanner(&scanner,source);
+    for(;;){
+      Token token = scanToken(&scanner);
+      tokens++;
+      if(token.type==TOKEN_EOF) break;
+    }
+    passes++;
+    elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+  }while(elapsed < 1.0);
+  printf("%d passes, %ld tokens, %.1f MB/s\n",passes,tokens,
+         (double)length * passes / (1024*1024) / elapsed);
+  free(source);
+}
+
+//the same script n times at once , each in a vm of its own on a thread of its own
+static void runIsolates(const char* path,int count){
+  char* source = readFile(path);
+  Isolate** isolates = (Isolate**)malloc(sizeof(Isolate*)*count);
+  if(isolates==NULL) exit(1);
+  for(int i = 0; i < count; i++){
+    isolates[i] = spawnIsolate(source,NULL);
+    if(isolates[i]==NULL){
+      fprintf(stderr,"Could not start isolate %d.\n",i + 1);
+      exit(71);
+    }
+  }
+  InterpretResult worst = INTERPRET_OK;
+  for(int i = 0; i < count; i++){
+    InterpretResult result = joinIsolate(isolates[i]);
+    if(result > worst) worst = result;
+  }
+  free(isolates);
+  free(source);
+  if (worst == INTERPRET_COMPILE_ERROR) exit(65);
+  if (worst == INTERPRET_RUNTIME_ERROR) exit(70);
+}
 
 int main(int argc, const char* argv[]) {
+  int arg = 1;
+  bool scanOnly = false;
+  bool emitOnly = false;
+  int isolates = 0;
+  for(; arg < argc && strncmp(argv[arg],"--",2) == 0; arg++){
+    if(strcmp(argv[arg],"--opt") == 0){
+      compilerOptions.optimize = true;
+    }
+    else if(strcmp(argv[arg],"--lazy") == 0){
+      compilerOptions.lazy = true;
+    }
+    else if(strcmp(argv[arg],"--jit") == 0){
+      compilerOptions.jit = true;
+    }
+    else if(strcmp(argv[arg],"--dump-feedback") == 0){
+      compilerOptions.feedback = true;
+    }
+    else if(strcmp(argv[arg],"--no-cache") == 0){
+      useCache = false;
+    }
+    else if(strcmp(argv[arg],"--emit-c") == 0){
+      emitOnly = true;
+    }
+    else if(strcmp(argv[arg],"--isolates") == 0 && arg + 1 < argc){
+      isolates = atoi(argv[++arg]);
+      if(isolates < 1){
+        fprintf(stderr,"--isolates needs a count of at least 1.\n");
+        exit(64);
+      }
+    }
+    else if(strcmp(argv[arg],"--scan-bench") == 0){
+      scanOnly = true;
+    }
+    else{
+      fprintf(stderr,"Unknown option \"%s\".\n",argv[arg]);
+      exit(64);
+    }
+  }
+  if(scanOnly){
+    if(arg!=argc-1){
+      fprintf(stderr,"Usage: clox --scan-bench path\n");
+      exit(64);
+    }
+    scanFile(argv[arg]);
+    return 0;
+  }
+  if(isolates > 0){//each one sets up its own vm
+    if(arg!=argc-1){
+      fprintf(stderr,"Usage: clox [--opt] [--jit] --isolates n path\n");
+      exit(64);
+    }
+    runIsolates(argv[arg],isolates);
+    return 0;
+  }
   initVM();
-  if(argc==1){
+  if(emitOnly){
+    if(arg!=argc-1){
+      fprintf(stderr,"Usage: clox [--opt] --emit-c path\n");
+      exit(64);
+    }
+    emitFile(argv[arg]);
+  }
+  else if(arg==argc){
     repl();
   }
-  else if(argc==2){
-    runFile(argv[1]);
+  else if(arg==argc-1){
+    runFile(argv[arg]);
   }
   else{
-    fprintf(stderr,"Usage: clox [path]\n");
+    fprintf(stderr,"Usage: clox [--opt] [--lazy] [--jit] [--dump-feedback] [--no-cache] [--emit-c] [--isolates n] [--scan-bench] [path]\n");
     exit(64);
   }
   freeVM();
+  unmapBytecode();
   return 0;
 }
\ No newline at end of file
@@ -1,23 +1,123 @@
+#ifdef __linux__
+#define _GNU_SOURCE //for mremap
+#endif
 #include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "memory.h"
 #include "object.h"
 #include "vm.h" 
+#include "channel.h"
 #include "compiler.h"
+#include "jit.h"
+#include "trace.h"
+#include "feedback.h"
 #define GC_HEAP_GROW_FACTOR 2
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.h"
 #endif
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-  vm.bytesAllocated += newSize - oldSize;
-  if(newSize>oldSize){
+#ifndef _WIN32
+static size_t pageAlign(size_t size){
+  static THREAD_LOCAL size_t pageSize = 0;
+  if(pageSize == 0) pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+static void* mapPages(size_t size){
+  void* result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (result == MAP_FAILED) exit(1);
+  return result;
+}
+
+static void* remapPages(void* pointer, size_t oldSize, size_t newSize){
+  if(oldSize == newSize) return pointer;
+#ifdef __linux__
+  void* result = mremap(pointer, oldSize, newSize, MREMAP_MAYMOVE);//grows in place when the pages after it are free , otherwise the kernel moves the page table entries , never the bytes
+  if (result == MAP_FAILED) exit(1);
+  return result;
+#else
+  void* result = mapPages(newSize);
+  memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+  munmap(pointer, oldSize);
+  return result;
+#endif
+}
+#endif
+
+//arrays at or above LARGE_OBJECT_THRESHOLD (list backing arrays , long strings) get their own pages and their own gc budget
+//the size alone decides which space a block lives in , so every caller has to pass the exact size it allocated with
+static void* reallocateLarge(void* pointer, size_t oldSize, size_t newSize){
+#ifdef _WIN32
+  size_t oldLarge = oldSize >= LARGE_OBJECT_THRESHOLD ? oldSize : 0;
+  size_t newLarge = newSize >= LARGE_OBJECT_THRESHOLD ? newSize : 0;
+#else
+  size_t oldLarge = oldSize >= LARGE_OBJECT_THRESHOLD ? pageAlign(oldSize) : 0;
+  size_t newLarge = newSize >= LARGE_OBJECT_THRESHOLD ? pageAlign(newSize) : 0;
+#endif
+  if(objectPool == NULL){
+    vm.bytesAllocated += (newLarge ? 0 : newSize) - (oldLarge ? 0 : oldSize);
+    vm.largeBytesAllocated += newLarge - oldLarge;
+    if(newSize > oldSize){
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
+      collectGarbage();
 #endif
-  if(vm.bytesAllocated > vm.nextGC){
-    collectGarbage();
+      if(vm.largeBytesAllocated > vm.nextLargeGC || vm.bytesAllocated > vm.nextGC){
+        collectGarbage();
+      }
+    }
+  }
+  else{//counted against the pool until the vm adopts it , nothing collects before that
+    objectPool->bytesAllocated += (newLarge ? 0 : newSize) - (oldLarge ? 0 : oldSize);
+    objectPool->largeBytesAllocated += newLarge - oldLarge;
+  }
+#ifdef _WIN32
+  if(newSize == 0){
+    free(pointer);
+    return NULL;
   }
+  void* result = realloc(pointer, newSize);
+  if (result == NULL) exit(1);
+  return result;
+#else
+  if(oldLarge && newLarge) return remapPages(pointer, oldLarge, newLarge);
+  if(newLarge){//small block crossing the threshold
+    void* result = mapPages(newLarge);
+    if(pointer != NULL) memcpy(result, pointer, oldSize);
+    free(pointer);
+    return result;
+  }
+  void* result = NULL;
+  if(newSize > 0){//shrinking back below the threshold
+    result = malloc(newSize);
+    if (result == NULL) exit(1);
+    memcpy(result, pointer, newSize);
+  }
+  munmap(pointer, oldLarge);
+  return result;
+#endif
+}
 
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  if(oldSize >= LARGE_OBJECT_THRESHOLD || newSize >= LARGE_OBJECT_THRESHOLD){
+    return reallocateLarge(pointer, oldSize, newSize);
+  }
+  if(objectPool == NULL){
+    vm.bytesAllocated += newSize - oldSize;
+    if(newSize>oldSize){
+#ifdef DEBUG_STRESS_GC
+      collectGarbage();
+#endif
+      if(vm.bytesAllocated > vm.nextGC){
+        collectGarbage();
+      }
+    }
+  }
+  else{
+    objectPool->bytesAllocated += newSize - oldSize;//counted against the pool until the vm adopts it , nothing collects before that
   }
 
   if (newSize == 0) {
@@ -52,13 +152,25 @@ static void freeObject(Obj* object) {
     }
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
+      if(object->isShared) releaseString(SHARED_STRING(string));
+      else if(!object->isImmortal) FREE_ARRAY(char, string->chars, string->length + 1);
       FREE(ObjString, object);
       break;
     }
     case OBJ_FUNCTION:{
       ObjFunction* function = (ObjFunction*)object;
+      if(object->isImmortal){//the code belongs to the mapping
+        function->chunk.code = NULL;
+        function->chunk.capacity = 0;
+      }
       freeChunk(&function->chunk);
+      jitFree(function);
+      freeTraces(function);
+      freeFeedback(function);
+      if(function->lazy != NULL){
+        FREE_ARRAY(LazyName,function->lazy->upvalueNames,function->lazy->upvalueCount);
+        FREE(LazyBody,function->lazy);
+      }
       FREE(ObjFunction,object);
       break;
     }
@@ -68,8 +180,7 @@ static void freeObject(Obj* object) {
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues,closure->upvalueCount);
-      FREE(ObjClosure, object);
+      reallocate(object, sizeof(ObjClosure) + sizeof(Value) * closure->upvalueCount, 0);
       break;
     }
     case OBJ_UPVALUE:{
@@ -82,6 +193,21 @@ static void freeObject(Obj* object) {
       FREE(ObjList,object);
       break;
     }
+    case OBJ_CHANNEL:{
+      releaseChannel(((ObjChannel*)object)->channel);
+      FREE(ObjChannel,object);
+      break;
+    }
+    case OBJ_FIBER:{
+      FiberStacks* saved = &((ObjFiber*)object)->saved;
+      for(int i = 0; i < saved->frameCount; i++){
+        freeObjectList(saved->frames[i].frameObjects);
+      }
+      free(saved->frames);
+      free(saved->stack);
+      FREE(ObjFiber,object);
+      break;
+    }
   }
 }
 
@@ -116,6 +242,18 @@ void markValue(Value slot){
     }
 }
 
+static void markStacks(FiberStacks* stacks){
+  for(Value* slot = stacks->stack;slot<stacks->stackTop;slot++){
+    markValue(*slot);
+  }
+  for(int i = 0; i < stacks->frameCount; i++){
+    markObject((Obj*)stacks->frames[i].closure);
+  }
+  for (ObjUpvalue* upvalue = stacks->openUpvalues;upvalue != NULL;upvalue = upvalue->next){
+    markObject((Obj*)upvalue);
+  }
+}
+
 static void blackenObject(Obj* object){
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void*)object);
@@ -145,13 +283,14 @@ static void blackenObject(Obj* object){
       ObjClosure* closure = (ObjClosure*)object;
       markObject((Obj*)closure->function);
       for(int i = 0; i<closure->upvalueCount;i++){
-        markObject((Obj*)closure->upvalues[i]);
+        markValue(closure->upvalues[i]);
       }
       break;
     }
     case OBJ_FUNCTION:{
     ObjFunction* function = (ObjFunction*)object;
     markObject((Obj*)function->name);
+    markObject((Obj*)function->closure);
     markArray(&function->chunk.constants);
     break;
   }
@@ -164,8 +303,16 @@ static void blackenObject(Obj* object){
     markValue(((ObjUpvalue*)object)->closed);
     break;
     }
+    case OBJ_FIBER:{
+      ObjFiber* fiber = (ObjFiber*)object;
+      markObject((Obj*)fiber->function);
+      markObject((Obj*)fiber->caller);
+      if(fiber != vm.fiber) markStacks(&fiber->saved);//the running one's are the vm's , see markRoots()
+      break;
+    }
     case OBJ_NATIVE:
     case OBJ_STRING:
+    case OBJ_CHANNEL:
       break;
   }
 }
@@ -180,8 +327,13 @@ static void markRoots(){
   for (ObjUpvalue* upvalue = vm.openUpvalues;upvalue != NULL;upvalue = upvalue->next){//mark upvalues
     markObject((Obj*)upvalue);
   }
+  if(vm.fiber != NULL){//mark the script's stacks and , through the fiber , every fiber waiting on it
+    markObject((Obj*)vm.fiber);
+    markStacks(&vm.script);
+  }
   markTable(&vm.globals);//mark globals table
   markCompilerRoots();//mark compiler roots . the compiler accesses runtime memory so we need to mark it
+  markFeedback();//classes and functions the profiled sites saw
 }
 static void traceReferences(){
   while(vm.grayCount > 0){
@@ -190,11 +342,30 @@ static void traceReferences(){
   }
 }
 
+//a suspended fiber nobody can resume any more still has the upvalues its closures captured pointing into
+//its stack. they get closed while they are all still there , before the sweep frees the stack
+static void closeLostFibers(){
+  ObjFiber** link = &vm.fibers;
+  while(*link != NULL){
+    ObjFiber* fiber = *link;
+    if(fiber->obj.isMarked){
+      link = &fiber->nextFiber;
+      continue;
+    }
+    for(ObjUpvalue* upvalue = fiber->saved.openUpvalues; upvalue != NULL; upvalue = upvalue->next){
+      upvalue->closed = *upvalue->location;
+      upvalue->location = &upvalue->closed;
+    }
+    fiber->saved.openUpvalues = NULL;
+    *link = fiber->nextFiber;
+  }
+}
+
 static void sweep(){
   Obj* previous = NULL;
   Obj* object = vm.objects;
   while(object != NULL){
-    if(object->isMarked){
+    if(object->isMarked || object->isImmortal){
       object->isMarked = false;
       previous = object;
       object = object->next;
@@ -213,13 +384,47 @@ static void sweep(){
   }
 }
 
+//frame local objects are not swept , so their marks are cleared here. that goes for the frames
+//of suspended fibers and of the script too , or a field they hold would look marked at the next gc
+static void clearFrameMarks(CallFrame* frames,int frameCount){
+  for(int i = 0; i < frameCount; i++){
+    for(Obj* object = frames[i].frameObjects; object != NULL; object = object->next){
+      object->isMarked = false;
+    }
+  }
+}
+
+void freeObjectList(Obj* objects){
+  while(objects != NULL){
+    Obj* next = objects->next;
+    freeObject(objects);
+    objects = next;
+  }
+}
+
 void freeObjects(){
-  Obj* object = vm.objects;
-  while(object != NULL){
-    Obj* next = object->next;
-    freeObject(object);
-    object = next;
+  freeObjectList(vm.objects);
+}
+
+static void unlinkObject(Obj** list, Obj* object){
+  while(*list != object){
+    list = &(*list)->next;
   }
+  *list = object->next;
+}
+
+//frame local objects are usually released in reverse allocation order so the walk stops at the head
+void releaseObject(Obj** list, Obj* object){
+  unlinkObject(list, object);
+  freeObject(object);
+}
+
+//hands a frame local object over to the gc when it is about to escape the frame
+void promoteObject(Obj** list, Obj* object){
+  unlinkObject(list, object);
+  object->isFrameLocal = false;
+  object->next = vm.objects;
+  vm.objects = object;
 }
 
 
@@ -228,18 +433,29 @@ void collectGarbage(){
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
   size_t before = vm.bytesAllocated;
+  size_t largeBefore = vm.largeBytesAllocated;
 #endif
   markObject((Obj*)vm.initString);
   markRoots();
   traceReferences();
   tableRemoveWhite(&vm.strings);
+  closeLostFibers();
   sweep();
+  clearFrameMarks(vm.frames,vm.frameCount);
+  for(ObjFiber* fiber = vm.fibers; fiber != NULL; fiber = fiber->nextFiber){//only the ones that survived are left
+    if(fiber != vm.fiber) clearFrameMarks(fiber->saved.frames,fiber->saved.frameCount);
+  }
+  if(vm.fiber != NULL) clearFrameMarks(vm.script.frames,vm.script.frameCount);
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm.nextLargeGC = vm.largeBytesAllocated * GC_HEAP_GROW_FACTOR;
+  if(vm.nextLargeGC < LARGE_HEAP_MIN) vm.nextLargeGC = LARGE_HEAP_MIN;
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
   printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
          before - vm.bytesAllocated, before, vm.bytesAllocated,
          vm.nextGC);
+  printf("   large space %zu bytes (from %zu) next at %zu\n",
+         vm.largeBytesAllocated, largeBefore, vm.nextLargeGC);
 #endif
 }
 
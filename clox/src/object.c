@@ -6,22 +6,71 @@
 #include "value.h"
 #include "vm.h"
 #include "table.h"
+#include "channel.h"
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
 
-static Obj* allocateObject(size_t size, ObjType type) {
+static Obj* allocateObjectIn(size_t size, ObjType type, Obj** list) {
   Obj* object = (Obj*)reallocate(NULL, 0, size);
   object->type = type;
-  object->next = vm.objects;
+  object->next = *list;
   object->isMarked = false;
-  vm.objects = object;
+  object->isFrameLocal = list != &vm.objects;
+  object->isImmortal = false;
+  object->isShared = false;
+  *list = object;
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %ld for %d %s\n", (void*)object, size, type,objTypeName(type));
 #endif
   return object;
 }
 
+THREAD_LOCAL ObjectPool* objectPool = NULL;
+
+static Obj* allocateObject(size_t size, ObjType type) {
+  if(objectPool != NULL){
+    Obj* object = allocateObjectIn(size, type, &objectPool->objects);
+    object->isFrameLocal = false;
+    return object;
+  }
+  return allocateObjectIn(size, type, &vm.objects);
+}
+
+static Table* internTable(){
+  return objectPool != NULL ? &objectPool->strings : &vm.strings;
+}
+
+void initObjectPool(ObjectPool* pool){
+  pool->objects = NULL;
+  pool->bytesAllocated = 0;
+  pool->largeBytesAllocated = 0;
+  ObjectPool* enclosing = objectPool;
+  objectPool = pool;//the table's own array is counted against the pool too
+  initTable(&pool->strings,0);
+  objectPool = enclosing;
+}
+
+//on the vm's thread , the objects join the vm's list and the pool's strings are left for internString() to sort out
+void adoptObjectPool(ObjectPool* pool){
+  vm.bytesAllocated += pool->bytesAllocated;
+  vm.largeBytesAllocated += pool->largeBytesAllocated;
+  freeTable(&pool->strings);
+  Obj** last = &pool->objects;
+  while(*last != NULL) last = &(*last)->next;
+  *last = vm.objects;
+  vm.objects = pool->objects;
+  pool->objects = NULL;
+}
+
+//a string from a pool that the vm already has is dropped for the vm's one , the caller keeps string reachable
+ObjString* internString(ObjString* string){
+  ObjString* interned = tableFindString(&vm.strings, string->chars, string->length, string->hash);
+  if(interned != NULL) return interned;
+  tableSet(&vm.strings, string, NIL_VAL);
+  return string;
+}
+
 ObjBoundMethod* newBoundMethod(Value reciever,ObjClosure* method){
   ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod,OBJ_BOUND_METHOD);
   bound->receiver = reciever;
@@ -30,14 +79,19 @@ ObjBoundMethod* newBoundMethod(Value reciever,ObjClosure* method){
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*,function->upvalueCount);
-  for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
+  if (function->upvalueCount == 0 && function->closure != NULL) {
+    return function->closure;//nothing captured so every closure over it would be identical
   }
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure* closure = (ObjClosure*)allocateObject(
+      sizeof(ObjClosure) + sizeof(Value) * function->upvalueCount, OBJ_CLOSURE);
   closure->function = function;
-  closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    closure->upvalues[i] = NIL_VAL;
+  }
+  if (function->upvalueCount == 0) {
+    function->closure = closure;
+  }
   return closure;
 }
 
@@ -48,6 +102,14 @@ ObjInstance* newInstance(ObjClass* klass){
   return instance;
 }
 
+//the compiler proved the instance never leaves its local slot , so it lives on the frame's list and dies with the frame
+ObjInstance* newFrameInstance(ObjClass* klass, Obj** frameObjects){
+  ObjInstance* instance = (ObjInstance*)allocateObjectIn(sizeof(ObjInstance), OBJ_INSTANCE, frameObjects);
+  instance->klass = klass;
+  initTable(&instance->fields,0);
+  return instance;
+}
+
 ObjClass* newClass(ObjString* name) {
   ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);//use klass as identifier so that c++ compiler does not get confused with class keyword
   klass->name = name;
@@ -59,7 +121,18 @@ ObjFunction* newFunction(){
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction,OBJ_FUNCTION);
   function->arity=0;
   function->upvalueCount = 0;
+  function->maxStack = 0;
   function->name=NULL;
+  function->closure = NULL;
+  function->inlineKind = INLINE_NONE;
+  function->inlineSlot = 0;
+  function->inlineValue = NIL_VAL;
+  function->lazy = NULL;
+  function->calls = 0;
+  function->native = NULL;
+  function->nativeSize = 0;
+  function->traces = NULL;
+  function->feedback = NULL;
   initChunk(&function->chunk);
   return function;
 }
@@ -76,11 +149,35 @@ ObjList* newList(){
   return list;
 }
 
+//the stacks start as small as the vm's and grow the same way
+ObjFiber* newFiber(ObjClosure* function){
+  ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber,OBJ_FIBER);
+  fiber->state = FIBER_NEW;
+  fiber->pending = 0;
+  fiber->function = function;
+  fiber->caller = NULL;
+  fiber->saved.frameCapacity = FRAMES_INITIAL;
+  fiber->saved.frames = (CallFrame*)malloc(sizeof(CallFrame)*FRAMES_INITIAL);
+  fiber->saved.frameCount = 0;
+  fiber->saved.stackCapacity = STACK_SEGMENT;
+  fiber->saved.stack = (Value*)malloc(sizeof(Value)*STACK_SEGMENT);
+  if(fiber->saved.frames == NULL || fiber->saved.stack == NULL) exit(1);
+  fiber->saved.stackTop = fiber->saved.stack;
+  fiber->saved.openUpvalues = NULL;
+  fiber->nextFiber = vm.fibers;
+  vm.fibers = fiber;
+  return fiber;
+}
+
 static ObjString* allocateString(char* chars, int length,uint32_t hash) {
   ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
   string->length = length;
   string->chars = chars;
   string->hash = hash;
+  if(objectPool != NULL){
+    tableSet(&objectPool->strings,string, NIL_VAL);//nothing is collected while a pool is active
+    return string;
+  }
   push(OBJ_VAL(string));
   tableSet(&vm.strings,string, NIL_VAL);
   pop();
@@ -98,7 +195,7 @@ static uint32_t hashString(const char* key, int length) {
 
 ObjString* takeString(char* chars, int length) {
   uint32_t hash = hashString(chars,length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length,hash);
+  ObjString* interned = tableFindString(internTable(), chars, length,hash);
   if(interned!=NULL) {
     
     FREE_ARRAY(char,chars,length+1);
@@ -109,7 +206,7 @@ ObjString* takeString(char* chars, int length) {
 
 ObjString* copyString(const char* chars, int length) {
   uint32_t hash = hashString(chars,length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length,hash);
+  ObjString* interned = tableFindString(internTable(), chars, length,hash);
   if(interned!=NULL) return interned;
   
   char* heapChars = ALLOCATE(char, length + 1);
@@ -118,6 +215,33 @@ ObjString* copyString(const char* chars, int length) {
   return allocateString(heapChars, length,hash);
 }   
 
+//chars has to stay around (and end in a nul) for as long as the vm runs
+ObjString* mappedString(const char* chars, int length) {
+  uint32_t hash = hashString(chars,length);
+  ObjString* interned = tableFindString(internTable(), chars, length,hash);
+  if(interned!=NULL) return interned;
+  ObjString* string = allocateString((char*)chars, length,hash);
+  string->obj.isImmortal = true;
+  return string;
+}
+
+//the string holds a reference of its own , released when it is freed
+ObjString* sharedString(SharedString* shared) {
+  ObjString* interned = tableFindString(internTable(), shared->chars, shared->length,shared->hash);
+  if(interned!=NULL) return interned;
+  ObjString* string = allocateString(shared->chars, shared->length,shared->hash);
+  string->obj.isShared = true;
+  retainString(shared);
+  return string;
+}
+
+ObjChannel* newChannel(Channel* channel){
+  ObjChannel* object = ALLOCATE_OBJ(ObjChannel,OBJ_CHANNEL);
+  object->channel = channel;
+  retainChannel(channel);
+  return object;
+}
+
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->location = slot;
@@ -162,6 +286,12 @@ void printObject(Value value) {
     case OBJ_LIST:
       printf("<list : %u>",((ObjList*)AS_OBJ(value))->objects.count);
       break;
+    case OBJ_CHANNEL:
+      printf("<channel>");
+      break;
+    case OBJ_FIBER:
+      printf("<fiber>");
+      break;
   }
 }
 
@@ -185,6 +315,10 @@ const char* objTypeName(ObjType type){
       return "UPVALUE";
     case OBJ_LIST:
       return "LIST";
+    case OBJ_CHANNEL:
+      return "CHANNEL";
+    case OBJ_FIBER:
+      return "FIBER";
   }
   return "UNKNOWN";
 }
\ No newline at end of file
@@ -0,0 +1,947 @@
+#include <stdlib.h>
+#include <string.h>
+#include "optimizer.h"
+#include "object.h"
+#include "memory.h"
+
+//second tier over the bytecode of one function , only run with --opt
+//the code is decoded into a list of instructions with resolved jump targets , the passes
+//work on that list and on dataflow facts about stack slots before it is encoded back
+
+#define MAX_TRACKED 256 //stack slots past this are never assumed to hold anything in particular
+#define SET_WORDS (MAX_TRACKED/64)
+#define MAX_ROUNDS 16
+#define MAX_TEMPS 32 //extra local slots for values computed once and read again
+
+typedef struct{
+    uint64_t bits[SET_WORDS];
+}SlotSet;
+
+typedef struct{
+    int offset;//in the optimizer's copy of the code , operands are always read from there
+    int length;
+    int line;
+    uint8_t op;//may be rewritten to a specialised form
+    int target;//instruction a jump lands on , -1 for everything else
+    bool isTarget;//something other than the previous instruction can get here
+    bool removed;
+    int depth;//stack height before it runs , -1 if it is never reached
+    SlotSet numbers;//slots known to hold a number before it runs
+    SlotSet liveOut;//local slots read again after it runs
+}Instruction;
+
+typedef struct{
+    Chunk* chunk;
+    Instruction* code;
+    int count;
+    int initialDepth;
+    SlotSet escaped;//captured by reference , a closure can change them at any call
+    uint8_t* bytes;//the code as the compiler emitted it , instructions made here are added at the end
+    int byteCount;
+    int byteCapacity;
+    Chunk view;//the chunk with bytes as its code , for the helpers in chunk.c
+    int tempBase;//what the passes call the first extra slot , past anything the stack reaches
+    int temps;
+}Optimizer;
+
+static bool hasSlot(SlotSet* set,int slot){
+    if(slot < 0 || slot >= MAX_TRACKED) return false;
+    return (set->bits[slot/64] >> (slot%64)) & 1;
+}
+
+static void setSlot(SlotSet* set,int slot,bool value){
+    if(slot < 0 || slot >= MAX_TRACKED) return;
+    if(value) set->bits[slot/64] |= (uint64_t)1 << (slot%64);
+    else set->bits[slot/64] &= ~((uint64_t)1 << (slot%64));
+}
+
+static void fillSlots(SlotSet* set,bool value){
+    memset(set->bits,value ? 0xff : 0,sizeof(set->bits));
+}
+
+static bool sameSlots(SlotSet* a,SlotSet* b){
+    return memcmp(a->bits,b->bits,sizeof(a->bits)) == 0;
+}
+
+static uint8_t* operands(Optimizer* optimizer,int index){
+    return &optimizer->bytes[optimizer->code[index].offset + 1];
+}
+
+static int operandShort(Optimizer* optimizer,int index){
+    uint8_t* bytes = operands(optimizer,index);
+    return (bytes[0] << 8) | bytes[1];
+}
+
+static bool isJump(uint8_t op){
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP;
+}
+
+static bool fallsThrough(uint8_t op){
+    return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+}
+
+static int nextLive(Optimizer* optimizer,int index){
+    while(index < optimizer->count && optimizer->code[index].removed) index++;
+    return index;
+}
+
+//jumps to a removed instruction land on whatever comes after it
+static void removeInstruction(Optimizer* optimizer,int index){
+    Instruction* instruction = &optimizer->code[index];
+    instruction->removed = true;
+    if(!instruction->isTarget) return;
+    int next = nextLive(optimizer,index+1);
+    if(next < optimizer->count) optimizer->code[next].isTarget = true;
+}
+
+static bool decode(Optimizer* optimizer){
+    Chunk* chunk = optimizer->chunk;
+    int* indexOf = (int*)malloc(sizeof(int)*(chunk->count+1));
+    optimizer->code = (Instruction*)malloc(sizeof(Instruction)*(chunk->count+1));
+    optimizer->bytes = (uint8_t*)malloc(chunk->count);
+    if(indexOf == NULL || optimizer->code == NULL || optimizer->bytes == NULL) exit(1);
+    memcpy(optimizer->bytes,chunk->code,chunk->count);
+    optimizer->byteCount = optimizer->byteCapacity = chunk->count;
+    optimizer->view = *chunk;
+    optimizer->view.code = optimizer->bytes;
+    for(int i = 0; i <= chunk->count; i++) indexOf[i] = -1;
+    int count = 0;
+    for(int offset = 0; offset < chunk->count; offset += instructionLength(chunk,offset)){
+        Instruction* instruction = &optimizer->code[count];
+        instruction->offset = offset;
+        instruction->length = instructionLength(chunk,offset);
+        instruction->line = getLine(chunk,offset);
+        instruction->op = chunk->code[offset];
+        instruction->target = -1;
+        instruction->isTarget = false;
+        instruction->removed = false;
+        instruction->depth = -1;
+        indexOf[offset] = count++;
+    }
+    optimizer->count = count;
+    bool ok = true;
+    for(int i = 0; i < count && ok; i++){
+        Instruction* instruction = &optimizer->code[i];
+        int target = jumpTarget(chunk,instruction->offset);
+        if(target == -1) continue;
+        if(target < 0 || target >= chunk->count || indexOf[target] == -1) ok = false;
+        else instruction->target = indexOf[target];
+    }
+    fillSlots(&optimizer->escaped,false);
+    for(int i = 0; i < count; i++){
+        if(optimizer->code[i].op != OP_CLOSURE) continue;
+        uint8_t* bytes = operands(optimizer,i);
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[(bytes[0] << 8) | bytes[1]]);
+        for(int j = 0; j < function->upvalueCount; j++){
+            uint8_t* upvalue = &bytes[2 + j*3];
+            if(upvalue[0] == 1) setSlot(&optimizer->escaped,(upvalue[1] << 8) | upvalue[2],true);
+        }
+    }
+    free(indexOf);
+    return ok;
+}
+
+static void findTargets(Optimizer* optimizer){
+    for(int i = 0; i < optimizer->count; i++) optimizer->code[i].isTarget = false;
+    for(int i = 0; i < optimizer->count; i++){
+        Instruction* instruction = &optimizer->code[i];
+        if(instruction->removed || instruction->target == -1) continue;
+        int target = nextLive(optimizer,instruction->target);
+        if(target < optimizer->count) optimizer->code[target].isTarget = true;
+    }
+}
+
+//a jump that lands on another jump goes straight to where that one goes
+static bool threadJumps(Optimizer* optimizer){
+    bool changed = false;
+    int previous = -1;
+    for(int i = 0; i < optimizer->count; i++){
+        Instruction* instruction = &optimizer->code[i];
+        if(instruction->removed) continue;
+        //break pushes false and jumps back to the loop test , which is then known to exit
+        bool carriesFalse = previous != -1 && !instruction->isTarget &&
+            (optimizer->code[previous].op == OP_FALSE || optimizer->code[previous].op == OP_NIL);
+        previous = i;
+        if(!isJump(instruction->op)) continue;//counted loops keep their targets
+        for(int hops = 0; hops < 8; hops++){
+            int target = nextLive(optimizer,instruction->target);
+            if(target >= optimizer->count) break;
+            Instruction* landing = &optimizer->code[target];
+            int next = -1;
+            if(landing->op == OP_JUMP || landing->op == OP_LOOP) next = landing->target;
+            //the value is still on the stack and still falsey , so the second test jumps too
+            else if((instruction->op == OP_JUMP_IF_FALSE || carriesFalse) && landing->op == OP_JUMP_IF_FALSE) next = landing->target;
+            if(next == -1 || nextLive(optimizer,next) == target) break;
+            if(instruction->op == OP_JUMP_IF_FALSE && next <= i) break;//conditional jumps only go forward
+            instruction->target = next;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static int constantIndex(Optimizer* optimizer,int index){
+    Instruction* instruction = &optimizer->code[index];
+    if(instruction->op == OP_CONSTANT) return operands(optimizer,index)[0];
+    if(instruction->op == OP_CONSTANT_LONG) return operandShort(optimizer,index);
+    return -1;
+}
+
+//a branch on a value we pushed ourselves is decided here
+static bool foldBranches(Optimizer* optimizer){
+    bool changed = false;
+    for(int i = nextLive(optimizer,0); i < optimizer->count; i = nextLive(optimizer,i+1)){
+        uint8_t op = optimizer->code[i].op;
+        int truthiness = -1;
+        if(op == OP_TRUE || constantIndex(optimizer,i) != -1) truthiness = 1;//constants are numbers , strings and functions
+        else if(op == OP_FALSE || op == OP_NIL) truthiness = 0;
+        if(truthiness == -1) continue;
+        int branch = nextLive(optimizer,i+1);
+        if(branch >= optimizer->count) break;
+        Instruction* jump = &optimizer->code[branch];
+        if(jump->op != OP_JUMP_IF_FALSE || jump->isTarget) continue;
+        if(truthiness){
+            removeInstruction(optimizer,branch);
+        }
+        else{
+            jump->op = OP_JUMP;//the value stays for whoever pops it on the other side
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+static bool removeUnreachable(Optimizer* optimizer){
+    bool* reached = (bool*)calloc(optimizer->count+1,sizeof(bool));
+    int* worklist = (int*)malloc(sizeof(int)*(optimizer->count+1));
+    if(reached == NULL || worklist == NULL) exit(1);
+    int pending = 0;
+    worklist[pending++] = nextLive(optimizer,0);
+    while(pending > 0){
+        int i = worklist[--pending];
+        while(i < optimizer->count && !reached[i]){
+            reached[i] = true;
+            Instruction* instruction = &optimizer->code[i];
+            if(instruction->target != -1) worklist[pending++] = nextLive(optimizer,instruction->target);
+            if(!fallsThrough(instruction->op)) break;
+            i = nextLive(optimizer,i+1);
+        }
+    }
+    bool changed = false;
+    for(int i = 0; i < optimizer->count; i++){
+        if(!optimizer->code[i].removed && !reached[i]){
+            optimizer->code[i].removed = true;
+            changed = true;
+        }
+    }
+    free(reached);
+    free(worklist);
+    return changed;
+}
+
+static bool isPurePush(uint8_t op){
+    switch(op){
+        case OP_CONSTANT: case OP_CONSTANT_LONG: case OP_NIL: case OP_TRUE: case OP_FALSE:
+        case OP_GET_LOCAL: case OP_GET_UPVALUE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool sameOperands(Optimizer* optimizer,int a,int b){
+    Instruction* first = &optimizer->code[a];
+    Instruction* second = &optimizer->code[b];
+    return first->length == second->length && memcmp(operands(optimizer,a),operands(optimizer,b),first->length-1) == 0;
+}
+
+//local slots an instruction reads , anything this pass doesn't know about reads all of them
+static void slotsRead(Optimizer* optimizer,int index,SlotSet* read){
+    fillSlots(read,false);
+    switch(optimizer->code[index].op){
+        case OP_GET_LOCAL:
+            setSlot(read,operandShort(optimizer,index),true);
+            return;
+        case OP_FOR_PREP: case OP_FOR_LOOP:{
+            uint8_t* bytes = operands(optimizer,index);
+            setSlot(read,operandShort(optimizer,index),true);
+            if(!bytes[2]) setSlot(read,(bytes[3] << 8) | bytes[4],true);
+            return;
+        }
+        case OP_CLOSURE:{
+            uint8_t* bytes = operands(optimizer,index);
+            ObjFunction* function = AS_FUNCTION(optimizer->chunk->constants.values[(bytes[0] << 8) | bytes[1]]);
+            for(int j = 0; j < function->upvalueCount; j++){
+                uint8_t* upvalue = &bytes[2 + j*3];
+                if(upvalue[0] != 0) setSlot(read,(upvalue[1] << 8) | upvalue[2],true);
+            }
+            return;
+        }
+        case OP_RETURN: case OP_CONSTANT: case OP_NIL: case OP_TRUE: case OP_FALSE:
+        case OP_EQUAL: case OP_GREATER: case OP_LESS: case OP_CONSTANT_LONG: case OP_ADD:
+        case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE: case OP_NOT: case OP_NEGATE:
+        case OP_POWER: case OP_POP: case OP_PRINT: case OP_DEFINE_GLOBAL: case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL: case OP_GET_GLOBAL_LONG: case OP_SET_GLOBAL: case OP_SET_GLOBAL_LONG:
+        case OP_SET_LOCAL: case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_LOOP: case OP_CALL:
+        case OP_GET_UPVALUE: case OP_SET_UPVALUE: case OP_CLOSE_UPVALUE: case OP_CLASS:
+        case OP_GET_PROPERTY: case OP_SET_PROPERTY: case OP_METHOD: case OP_INVOKE: case OP_INHERIT:
+        case OP_GET_SUPER: case OP_INVOKE_SUPER: case OP_MAKE_LIST: case OP_GET_ELEMENT:
+        case OP_SET_ELEMENT: case OP_CALL_LOCAL: case OP_RELEASE:
+        case OP_ADD_NUM: case OP_SUBTRACT_NUM: case OP_MULTIPLY_NUM: case OP_DIVIDE_NUM:
+        case OP_LESS_NUM: case OP_GREATER_NUM: case OP_TAIL_CALL: case OP_TAIL_INVOKE:
+            return;
+        default:
+            fillSlots(read,true);
+            return;
+    }
+}
+
+//backwards over the instructions until nothing changes , only locals are tracked
+static void computeLiveness(Optimizer* optimizer){
+    for(int i = 0; i < optimizer->count; i++) fillSlots(&optimizer->code[i].liveOut,false);
+    bool changed = true;
+    while(changed){
+        changed = false;
+        for(int i = optimizer->count - 1; i >= 0; i--){
+            Instruction* instruction = &optimizer->code[i];
+            if(instruction->removed) continue;
+            SlotSet out;
+            fillSlots(&out,false);
+            int successors[2] = {-1,-1};
+            if(fallsThrough(instruction->op)) successors[0] = nextLive(optimizer,i+1);
+            if(instruction->target != -1) successors[1] = nextLive(optimizer,instruction->target);
+            for(int s = 0; s < 2; s++){
+                int next = successors[s];
+                if(next < 0 || next >= optimizer->count) continue;
+                SlotSet in = optimizer->code[next].liveOut;
+                if(optimizer->code[next].op == OP_SET_LOCAL) setSlot(&in,operandShort(optimizer,next),false);
+                SlotSet read;
+                slotsRead(optimizer,next,&read);
+                for(int w = 0; w < SET_WORDS; w++) out.bits[w] |= in.bits[w] | read.bits[w];
+            }
+            if(!sameSlots(&out,&instruction->liveOut)){
+                instruction->liveOut = out;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool isDeadStore(Optimizer* optimizer,int index){
+    int slot = operandShort(optimizer,index);
+    if(slot >= MAX_TRACKED || hasSlot(&optimizer->escaped,slot)) return false;
+    return !hasSlot(&optimizer->code[index].liveOut,slot);
+}
+
+static bool peephole(Optimizer* optimizer){
+    bool changed = false;
+    computeLiveness(optimizer);
+    for(int i = nextLive(optimizer,0); i < optimizer->count; i = nextLive(optimizer,i+1)){
+        Instruction* first = &optimizer->code[i];
+        int j = nextLive(optimizer,i+1);
+        if(j >= optimizer->count) break;
+        Instruction* second = &optimizer->code[j];
+        int k = nextLive(optimizer,j+1);
+        Instruction* third = k < optimizer->count ? &optimizer->code[k] : NULL;
+        if((first->op == OP_JUMP || first->op == OP_JUMP_IF_FALSE) && nextLive(optimizer,first->target) == j){
+            removeInstruction(optimizer,i);//lands on the next instruction either way
+            changed = true;
+            continue;
+        }
+        if(second->isTarget) continue;
+        if(isPurePush(first->op) && (second->op == OP_JUMP || second->op == OP_LOOP) &&
+            optimizer->code[nextLive(optimizer,second->target)].op == OP_POP){
+            removeInstruction(optimizer,i);//the value would only be popped where we land
+            second->target = nextLive(optimizer,second->target) + 1;
+            changed = true;
+            continue;
+        }
+        if(isPurePush(first->op) && second->op == OP_POP){
+            removeInstruction(optimizer,i);
+            removeInstruction(optimizer,j);
+            changed = true;
+            continue;
+        }
+        if(first->op == OP_SET_LOCAL && second->op == OP_POP && isDeadStore(optimizer,i)){
+            removeInstruction(optimizer,i);//nobody reads it again , the value only has to be popped
+            changed = true;
+            continue;
+        }
+        //store then load of the same variable , the stored value is still on the stack
+        if(third != NULL && !third->isTarget && second->op == OP_POP && sameOperands(optimizer,i,k) &&
+            ((first->op == OP_SET_LOCAL && third->op == OP_GET_LOCAL) ||
+             (first->op == OP_SET_UPVALUE && third->op == OP_GET_UPVALUE) ||
+             (first->op == OP_SET_GLOBAL && third->op == OP_GET_GLOBAL) ||
+             (first->op == OP_SET_GLOBAL_LONG && third->op == OP_GET_GLOBAL_LONG))){
+            removeInstruction(optimizer,j);
+            removeInstruction(optimizer,k);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+//how many values below the top an instruction consumes before it pushes its result , -1 if unknown
+static int stackInputs(Optimizer* optimizer,int index){
+    uint8_t* bytes = operands(optimizer,index);
+    switch(optimizer->code[index].op){
+        case OP_CONSTANT: case OP_CONSTANT_LONG: case OP_NIL: case OP_TRUE: case OP_FALSE:
+        case OP_GET_GLOBAL: case OP_GET_GLOBAL_LONG: case OP_GET_LOCAL: case OP_GET_UPVALUE:
+        case OP_CLOSURE: case OP_CLASS: case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_LOOP:
+        case OP_SET_GLOBAL: case OP_SET_GLOBAL_LONG: case OP_SET_UPVALUE: case OP_FOR_PREP:
+        case OP_FOR_LOOP:
+            return 0;
+        case OP_NOT: case OP_NEGATE: case OP_POP: case OP_PRINT: case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG: case OP_CLOSE_UPVALUE: case OP_RELEASE: case OP_GET_PROPERTY:
+        case OP_METHOD: case OP_INHERIT:
+            return 1;
+        case OP_EQUAL: case OP_GREATER: case OP_LESS: case OP_ADD: case OP_SUBTRACT:
+        case OP_MULTIPLY: case OP_DIVIDE: case OP_POWER: case OP_SET_PROPERTY: case OP_GET_SUPER:
+        case OP_GET_ELEMENT: case OP_ADD_NUM: case OP_SUBTRACT_NUM: case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM: case OP_LESS_NUM: case OP_GREATER_NUM:
+            return 2;
+        case OP_SET_ELEMENT:
+            return 3;
+        case OP_CALL: case OP_CALL_LOCAL: case OP_TAIL_CALL:
+            return bytes[0] + 1;
+        case OP_INVOKE: case OP_TAIL_INVOKE:
+            return bytes[2] + 1;
+        case OP_INVOKE_SUPER:
+            return bytes[2] + 2;
+        case OP_MAKE_LIST:
+            return (bytes[0] << 8) | bytes[1];
+        default:
+            return -1;
+    }
+}
+
+static bool isNumberConstant(Optimizer* optimizer,int index){
+    int constant = constantIndex(optimizer,index);
+    return constant != -1 && IS_NUMBER(optimizer->chunk->constants.values[constant]);
+}
+
+//what the stack looks like after the instruction , in terms of which slots hold numbers
+static int transfer(Optimizer* optimizer,int index,SlotSet* numbers,int depth){
+    Instruction* instruction = &optimizer->code[index];
+    int after = depth + stackEffect(&optimizer->view,instruction->offset);
+    switch(instruction->op){
+        case OP_CONSTANT: case OP_CONSTANT_LONG:
+            setSlot(numbers,depth,isNumberConstant(optimizer,index));
+            break;
+        case OP_GET_LOCAL:
+            setSlot(numbers,depth,hasSlot(numbers,operandShort(optimizer,index)));
+            break;
+        case OP_SET_LOCAL:
+            setSlot(numbers,operandShort(optimizer,index),hasSlot(numbers,depth-1));
+            break;
+        case OP_ADD:
+            setSlot(numbers,depth-2,hasSlot(numbers,depth-1) && hasSlot(numbers,depth-2));
+            break;
+        case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE: case OP_POWER: case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM: case OP_MULTIPLY_NUM: case OP_DIVIDE_NUM:
+            setSlot(numbers,depth-2,true);//anything else was a runtime error
+            break;
+        case OP_NEGATE:
+            setSlot(numbers,depth-1,true);
+            break;
+        case OP_FOR_PREP: case OP_FOR_LOOP:{//both go on only if the counter and limit are numbers
+            uint8_t* bytes = operands(optimizer,index);
+            setSlot(numbers,operandShort(optimizer,index),true);
+            if(!bytes[2]) setSlot(numbers,(bytes[3] << 8) | bytes[4],true);
+            break;
+        }
+        default:{
+            int inputs = stackInputs(optimizer,index);
+            if(inputs < 0){
+                fillSlots(numbers,false);
+                break;
+            }
+            for(int slot = depth - inputs; slot < after; slot++) setSlot(numbers,slot,false);
+            break;
+        }
+    }
+    for(int slot = after; slot < depth && slot < MAX_TRACKED; slot++) setSlot(numbers,slot,false);
+    for(int w = 0; w < SET_WORDS; w++) numbers->bits[w] &= ~optimizer->escaped.bits[w];
+    return after;
+}
+
+static void mergeInto(Optimizer* optimizer,int index,SlotSet* numbers,int depth,int* worklist,int* pending){
+    if(index >= optimizer->count) return;
+    Instruction* instruction = &optimizer->code[index];
+    if(instruction->depth == -1){
+        instruction->depth = depth;
+        instruction->numbers = *numbers;
+    }
+    else{
+        SlotSet merged;
+        for(int w = 0; w < SET_WORDS; w++) merged.bits[w] = instruction->numbers.bits[w] & numbers->bits[w];
+        if(sameSlots(&merged,&instruction->numbers)) return;
+        instruction->numbers = merged;
+    }
+    worklist[(*pending)++] = index;
+}
+
+//forward over the control flow graph , a slot is a number at a join only if it is one on every way in
+static void inferNumbers(Optimizer* optimizer){
+    int* worklist = (int*)malloc(sizeof(int)*(optimizer->count*2+1));
+    bool* queued = (bool*)calloc(optimizer->count+1,sizeof(bool));
+    if(worklist == NULL || queued == NULL) exit(1);
+    int pending = 0;
+    for(int i = 0; i < optimizer->count; i++) optimizer->code[i].depth = -1;
+    SlotSet numbers;
+    fillSlots(&numbers,false);
+    mergeInto(optimizer,nextLive(optimizer,0),&numbers,optimizer->initialDepth,worklist,&pending);
+    while(pending > 0){
+        int i = worklist[--pending];
+        queued[i] = false;
+        Instruction* instruction = &optimizer->code[i];
+        numbers = instruction->numbers;
+        int depth = transfer(optimizer,i,&numbers,instruction->depth);
+        int before = pending;
+        if(instruction->target != -1) mergeInto(optimizer,nextLive(optimizer,instruction->target),&numbers,depth,worklist,&pending);
+        if(fallsThrough(instruction->op)) mergeInto(optimizer,nextLive(optimizer,i+1),&numbers,depth,worklist,&pending);
+        //drop duplicates so the worklist stays bounded
+        int kept = before;
+        for(int p = before; p < pending; p++){
+            if(queued[worklist[p]]) continue;
+            queued[worklist[p]] = true;
+            worklist[kept++] = worklist[p];
+        }
+        pending = kept;
+    }
+    free(worklist);
+    free(queued);
+}
+
+static void specialize(Optimizer* optimizer){
+    inferNumbers(optimizer);
+    for(int i = 0; i < optimizer->count; i++){
+        Instruction* instruction = &optimizer->code[i];
+        if(instruction->removed || instruction->depth < 2) continue;
+        if(!hasSlot(&instruction->numbers,instruction->depth-1) || !hasSlot(&instruction->numbers,instruction->depth-2)) continue;
+        switch(instruction->op){
+            case OP_ADD: instruction->op = OP_ADD_NUM; break;
+            case OP_SUBTRACT: instruction->op = OP_SUBTRACT_NUM; break;
+            case OP_MULTIPLY: instruction->op = OP_MULTIPLY_NUM; break;
+            case OP_DIVIDE: instruction->op = OP_DIVIDE_NUM; break;
+            case OP_LESS: instruction->op = OP_LESS_NUM; break;
+            case OP_GREATER: instruction->op = OP_GREATER_NUM; break;
+            default: break;
+        }
+    }
+}
+
+//room for length more bytes at the end of the copy , returns where they start
+static int reserveBytes(Optimizer* optimizer,int length){
+    if(optimizer->byteCount + length > optimizer->byteCapacity){
+        optimizer->byteCapacity = (optimizer->byteCount + length)*2;
+        optimizer->bytes = (uint8_t*)realloc(optimizer->bytes,optimizer->byteCapacity);
+        if(optimizer->bytes == NULL) exit(1);
+        optimizer->view.code = optimizer->bytes;
+    }
+    optimizer->byteCount += length;
+    optimizer->view.count = optimizer->byteCount;
+    return optimizer->byteCount - length;
+}
+
+//operand is a slot for the local opcodes , -1 for opcodes without one
+static Instruction makeInstruction(Optimizer* optimizer,uint8_t op,int operand,int line){
+    Instruction instruction;
+    instruction.length = operand == -1 ? 1 : 3;
+    instruction.offset = reserveBytes(optimizer,instruction.length);
+    uint8_t* bytes = &optimizer->bytes[instruction.offset];
+    bytes[0] = op;
+    if(operand != -1){
+        bytes[1] = (uint8_t)(operand >> 8);
+        bytes[2] = (uint8_t)operand;
+    }
+    instruction.line = line;
+    instruction.op = op;
+    instruction.target = -1;
+    instruction.isTarget = false;
+    instruction.removed = false;
+    instruction.depth = -1;
+    return instruction;
+}
+
+//with bytes of its own , so renumbering one never touches the other
+static Instruction copyInstruction(Optimizer* optimizer,int index){
+    int offset = reserveBytes(optimizer,optimizer->code[index].length);
+    Instruction copy = optimizer->code[index];
+    memcpy(&optimizer->bytes[offset],&optimizer->bytes[copy.offset],copy.length);
+    copy.offset = offset;
+    copy.isTarget = false;
+    return copy;
+}
+
+//drops removed instructions for good , jumps to one land on whatever came after it
+static void compact(Optimizer* optimizer){
+    int* indexOf = (int*)malloc(sizeof(int)*(optimizer->count+1));
+    if(indexOf == NULL) exit(1);
+    int kept = 0;
+    for(int i = 0; i < optimizer->count; i++){
+        indexOf[i] = kept;
+        if(!optimizer->code[i].removed) kept++;
+    }
+    indexOf[optimizer->count] = kept;
+    kept = 0;
+    for(int i = 0; i < optimizer->count; i++){
+        Instruction instruction = optimizer->code[i];
+        if(instruction.removed) continue;
+        if(instruction.target != -1) instruction.target = indexOf[instruction.target];
+        optimizer->code[kept++] = instruction;
+    }
+    optimizer->count = kept;
+    free(indexOf);
+}
+
+//puts the added instructions in front of index , jumps from first to last that went to index still do ,
+//every other way there runs the added ones first
+static void insertCode(Optimizer* optimizer,int index,Instruction* added,int count,int first,int last){
+    Instruction* code = (Instruction*)malloc(sizeof(Instruction)*(optimizer->count+count+1));
+    if(code == NULL) exit(1);
+    for(int i = 0; i < optimizer->count; i++){
+        Instruction instruction = optimizer->code[i];
+        bool skips = i >= first && i <= last;
+        if(instruction.target > index || (instruction.target == index && skips)) instruction.target += count;
+        code[i < index ? i : i + count] = instruction;
+    }
+    for(int i = 0; i < count; i++) code[index + i] = added[i];
+    free(optimizer->code);
+    optimizer->code = code;
+    optimizer->count += count;
+}
+
+//a checked operator can fail on its operands , but gives the same value for the same operands when it doesn't
+static bool isOperator(uint8_t op,bool checked){
+    switch(op){
+        case OP_ADD_NUM: case OP_SUBTRACT_NUM: case OP_MULTIPLY_NUM: case OP_DIVIDE_NUM:
+        case OP_LESS_NUM: case OP_GREATER_NUM:
+            return true;
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE: case OP_POWER:
+        case OP_LESS: case OP_GREATER: case OP_EQUAL:
+            return checked;
+        default:
+            return false;
+    }
+}
+
+static bool isPureLeaf(Optimizer* optimizer,int index){
+    Instruction* instruction = &optimizer->code[index];
+    if(instruction->op == OP_CONSTANT || instruction->op == OP_CONSTANT_LONG) return true;
+    if(instruction->op != OP_GET_LOCAL) return false;
+    int slot = operandShort(optimizer,index);
+    return slot < MAX_TRACKED && !hasSlot(&optimizer->escaped,slot);
+}
+
+//first instruction of the expression whose last one is index , when the whole of it is arithmetic over
+//constants and locals , -1 if it isn't or something jumps into the middle of it
+static int expressionStart(Optimizer* optimizer,int index,bool checked){
+    if(!isOperator(optimizer->code[index].op,checked)) return -1;
+    int needed = 2;
+    int start = index;
+    while(needed > 0){
+        if(optimizer->code[start].isTarget) return -1;
+        if(--start < 0) return -1;
+        if(isOperator(optimizer->code[start].op,checked)) needed++;
+        else if(isPureLeaf(optimizer,start)) needed--;
+        else return -1;
+    }
+    return start;
+}
+
+static bool sameExpression(Optimizer* optimizer,int a,int b,int length){
+    for(int i = 0; i < length; i++){
+        if(optimizer->code[a+i].op != optimizer->code[b+i].op || !sameOperands(optimizer,a+i,b+i)) return false;
+    }
+    return true;
+}
+
+//the instruction may leave something else in the slot
+static bool changesSlot(Optimizer* optimizer,int index,int slot){
+    Instruction* instruction = &optimizer->code[index];
+    if(instruction->op == OP_SET_LOCAL || instruction->op == OP_FOR_PREP || instruction->op == OP_FOR_LOOP){
+        if(operandShort(optimizer,index) == slot) return true;
+    }
+    //popped , whatever is pushed there next is another variable
+    return slot < optimizer->tempBase && instruction->depth <= slot;
+}
+
+static bool changesAny(Optimizer* optimizer,int index,int start,int end){
+    for(int i = start; i <= end; i++){
+        if(optimizer->code[i].op == OP_GET_LOCAL && changesSlot(optimizer,index,operandShort(optimizer,i))) return true;
+    }
+    return false;
+}
+
+//depths and jump targets for the list as it is now
+static void analyze(Optimizer* optimizer){
+    compact(optimizer);
+    findTargets(optimizer);
+    inferNumbers(optimizer);
+}
+
+static int newTemp(Optimizer* optimizer){
+    return optimizer->tempBase + optimizer->temps++;
+}
+
+//the last instruction becomes a load of the slot , the rest go
+static void replaceWithLoad(Optimizer* optimizer,int start,int end,int slot){
+    for(int i = start; i < end; i++) optimizer->code[i].removed = true;
+    optimizer->code[end] = makeInstruction(optimizer,OP_GET_LOCAL,slot,optimizer->code[end].line);
+    optimizer->code[end].depth = optimizer->code[start].depth;
+}
+
+typedef struct{
+    int header;
+    int end;//the last jump back to the header
+}Loop;
+
+//one loop per header , spanning every jump back to it. loops that only partly overlap are one loop
+static int findLoops(Optimizer* optimizer,Loop* loops){
+    int count = 0;
+    for(int i = 0; i < optimizer->count; i++){
+        int target = optimizer->code[i].target;
+        if(target == -1 || target > i) continue;
+        Loop loop = {target,i};
+        for(int j = 0; j < count; j++){
+            Loop* other = &loops[j];
+            bool overlaps = loop.header <= other->end && other->header <= loop.end;
+            bool nested = (loop.header > other->header && loop.end <= other->end) ||
+                (other->header > loop.header && other->end <= loop.end);
+            if(!overlaps || nested) continue;
+            if(other->header < loop.header) loop.header = other->header;
+            if(other->end > loop.end) loop.end = other->end;
+            loops[j--] = loops[--count];
+        }
+        loops[count++] = loop;
+    }
+    //outer loops first , so a value is hoisted as far out as it can go
+    for(int i = 1; i < count; i++){
+        Loop loop = loops[i];
+        int j = i;
+        for(; j > 0 && loops[j-1].header > loop.header; j--) loops[j] = loops[j-1];
+        loops[j] = loop;
+    }
+    return count;
+}
+
+//control only gets into the loop through its header
+static bool enteredAtHeader(Optimizer* optimizer,Loop* loop){
+    for(int i = 0; i < optimizer->count; i++){
+        if(i >= loop->header && i <= loop->end){
+            if(optimizer->code[i].depth == -1) return false;
+            continue;
+        }
+        int target = optimizer->code[i].target;
+        if(target > loop->header && target <= loop->end) return false;
+    }
+    return true;
+}
+
+static bool isInvariant(Optimizer* optimizer,Loop* loop,int start,int end){
+    for(int i = start; i <= end; i++){
+        if(optimizer->code[i].op != OP_GET_LOCAL) continue;
+        int slot = operandShort(optimizer,i);
+        if(slot < optimizer->tempBase && slot >= optimizer->code[loop->header].depth) return false;//declared inside the loop
+    }
+    for(int i = loop->header; i <= loop->end; i++){
+        if(changesAny(optimizer,i,start,end)) return false;
+    }
+    return true;
+}
+
+//arithmetic on locals the loop never assigns is done once before it , the loop reads the result from a new slot
+static bool hoistInvariant(Optimizer* optimizer){
+    Loop* loops = (Loop*)malloc(sizeof(Loop)*(optimizer->count+1));
+    if(loops == NULL) exit(1);
+    int loopCount = findLoops(optimizer,loops);
+    bool changed = false;
+    for(int l = 0; l < loopCount && !changed; l++){
+        Loop loop = loops[l];
+        if(!enteredAtHeader(optimizer,&loop)) continue;
+        int bestStart = -1,bestEnd = -1;
+        for(int i = loop.header; i <= loop.end; i++){
+            int start = expressionStart(optimizer,i,false);//running it before the loop mustn't be able to fail
+            if(start < loop.header || (bestStart != -1 && i - start <= bestEnd - bestStart)) continue;
+            if(!isInvariant(optimizer,&loop,start,i)) continue;
+            bestStart = start;
+            bestEnd = i;
+        }
+        if(bestStart == -1) continue;
+        int slot = newTemp(optimizer);
+        int length = bestEnd - bestStart + 1;
+        Instruction* preheader = (Instruction*)malloc(sizeof(Instruction)*(length+2));
+        if(preheader == NULL) exit(1);
+        for(int i = 0; i < length; i++) preheader[i] = copyInstruction(optimizer,bestStart + i);
+        int line = optimizer->code[bestEnd].line;
+        preheader[length] = makeInstruction(optimizer,OP_SET_LOCAL,slot,line);
+        preheader[length+1] = makeInstruction(optimizer,OP_POP,-1,line);
+        replaceWithLoad(optimizer,bestStart,bestEnd,slot);
+        insertCode(optimizer,loop.header,preheader,length+2,loop.header,loop.end);
+        free(preheader);
+        changed = true;
+    }
+    free(loops);
+    return changed;
+}
+
+//the same arithmetic again further down a straight line of code , before any of its locals change ,
+//reads what the first one left in a new slot
+static bool shareRepeated(Optimizer* optimizer){
+    int bestEnd = -1,bestLength = 0;
+    for(int end = 0; end < optimizer->count; end++){
+        int start = expressionStart(optimizer,end,true);//only reached again if the first one didn't fail
+        if(start == -1 || end - start + 1 <= bestLength) continue;
+        int length = end - start + 1;
+        for(int i = end + 1; i < optimizer->count; i++){
+            if(optimizer->code[i].isTarget || changesAny(optimizer,i,start,end)) break;
+            int other = i - length + 1;
+            if(other > end && expressionStart(optimizer,i,true) == other && sameExpression(optimizer,start,other,length)){
+                bestEnd = end;
+                bestLength = length;
+                break;
+            }
+        }
+    }
+    if(bestEnd == -1) return false;
+    int start = bestEnd - bestLength + 1;
+    int slot = newTemp(optimizer);
+    for(int i = bestEnd + 1; i < optimizer->count; i++){
+        if(optimizer->code[i].isTarget || changesAny(optimizer,i,start,bestEnd)) break;
+        int other = i - bestLength + 1;
+        if(other > bestEnd && !optimizer->code[other].removed && expressionStart(optimizer,i,true) == other &&
+            sameExpression(optimizer,start,other,bestLength)) replaceWithLoad(optimizer,other,i,slot);
+    }
+    Instruction store = makeInstruction(optimizer,OP_SET_LOCAL,slot,optimizer->code[bestEnd].line);
+    insertCode(optimizer,bestEnd+1,&store,1,0,optimizer->count-1);
+    return true;
+}
+
+static void renumberSlot(Optimizer* optimizer,uint8_t* at){
+    int slot = (at[0] << 8) | at[1];
+    if(slot >= optimizer->tempBase) slot = optimizer->initialDepth + slot - optimizer->tempBase;
+    else if(slot >= optimizer->initialDepth) slot += optimizer->temps;
+    at[0] = (uint8_t)(slot >> 8);
+    at[1] = (uint8_t)slot;
+}
+
+//the passes numbered the new slots past the stack , they become locals right after the parameters
+//and the function starts by pushing a nil for each
+static void renumberSlots(Optimizer* optimizer){
+    for(int i = 0; i < optimizer->count; i++){
+        uint8_t op = optimizer->code[i].op;
+        uint8_t* bytes = operands(optimizer,i);
+        if(op == OP_GET_LOCAL || op == OP_SET_LOCAL || op == OP_FOR_PREP || op == OP_FOR_LOOP) renumberSlot(optimizer,bytes);
+        if((op == OP_FOR_PREP || op == OP_FOR_LOOP) && !bytes[2]) renumberSlot(optimizer,&bytes[3]);
+        if(op == OP_CLOSURE){
+            ObjFunction* function = AS_FUNCTION(optimizer->chunk->constants.values[(bytes[0] << 8) | bytes[1]]);
+            for(int j = 0; j < function->upvalueCount; j++){
+                if(bytes[2 + j*3] != 0) renumberSlot(optimizer,&bytes[3 + j*3]);
+            }
+        }
+    }
+    Instruction nils[MAX_TEMPS];
+    for(int i = 0; i < optimizer->temps; i++) nils[i] = makeInstruction(optimizer,OP_NIL,-1,optimizer->code[0].line);
+    insertCode(optimizer,0,nils,optimizer->temps,0,optimizer->count-1);
+}
+
+static void keepInSlots(Optimizer* optimizer){
+    analyze(optimizer);
+    int top = 0;
+    for(int i = 0; i < optimizer->count; i++){
+        if(optimizer->code[i].depth > top) top = optimizer->code[i].depth;
+    }
+    optimizer->tempBase = top;
+    optimizer->temps = 0;
+    if(top + MAX_TEMPS > MAX_TRACKED) return;
+    while(optimizer->temps < MAX_TEMPS && hoistInvariant(optimizer)) analyze(optimizer);
+    while(optimizer->temps < MAX_TEMPS && shareRepeated(optimizer)) analyze(optimizer);
+    if(optimizer->temps > 0) renumberSlots(optimizer);
+}
+
+static bool encode(Optimizer* optimizer){
+    Chunk* chunk = optimizer->chunk;
+    int* newOffset = (int*)malloc(sizeof(int)*(optimizer->count+1));
+    if(newOffset == NULL) exit(1);
+    int length = 0;
+    for(int i = 0; i < optimizer->count; i++){
+        newOffset[i] = length;
+        if(!optimizer->code[i].removed) length += optimizer->code[i].length;
+    }
+    newOffset[optimizer->count] = length;
+    uint8_t* code = (uint8_t*)malloc(length+1);
+    if(code == NULL) exit(1);
+    bool ok = true;
+    for(int i = 0; i < optimizer->count && ok; i++){
+        Instruction* instruction = &optimizer->code[i];
+        if(instruction->removed) continue;
+        uint8_t* out = &code[newOffset[i]];
+        memcpy(out,&optimizer->bytes[instruction->offset],instruction->length);
+        out[0] = instruction->op;
+        if(instruction->target == -1) continue;
+        int target = nextLive(optimizer,instruction->target);
+        if(target >= optimizer->count){
+            ok = false;
+            break;
+        }
+        int next = newOffset[i] + instruction->length;
+        int jump;
+        if(newOffset[target] >= next){
+            if(instruction->op == OP_FOR_LOOP){
+                ok = false;
+                break;
+            }
+            if(instruction->op == OP_LOOP) out[0] = OP_JUMP;
+            jump = newOffset[target] - next;
+        }
+        else{
+            if(instruction->op == OP_JUMP_IF_FALSE || instruction->op == OP_FOR_PREP){
+                ok = false;
+                break;
+            }
+            if(instruction->op != OP_FOR_LOOP) out[0] = OP_LOOP;
+            jump = next - newOffset[target];
+        }
+        out[instruction->length-2] = (jump >> 8) & 0xff;
+        out[instruction->length-1] = jump & 0xff;
+    }
+    if(ok){
+        //written again from the start , the code can come out longer than it went in
+        chunk->count = 0;
+        chunk->lineCount = 0;
+        for(int i = 0; i < optimizer->count; i++){
+            Instruction* instruction = &optimizer->code[i];
+            if(instruction->removed) continue;
+            for(int b = 0; b < instruction->length; b++) writeChunk(chunk,code[newOffset[i] + b],instruction->line);
+        }
+    }
+    free(newOffset);
+    free(code);
+    return ok;
+}
+
+void optimizeChunk(Chunk* chunk,int initialDepth){
+    if(chunk->count == 0) return;
+    Optimizer optimizer;
+    optimizer.chunk = chunk;
+    optimizer.initialDepth = initialDepth;
+    if(decode(&optimizer)){
+        for(int round = 0; round < MAX_ROUNDS; round++){
+            findTargets(&optimizer);
+            bool changed = threadJumps(&optimizer);
+            findTargets(&optimizer);
+            changed |= foldBranches(&optimizer);
+            changed |= removeUnreachable(&optimizer);
+            findTargets(&optimizer);
+            changed |= peephole(&optimizer);
+            if(!changed) break;
+        }
+        findTargets(&optimizer);
+        specialize(&optimizer);
+        keepInSlots(&optimizer);
+        encode(&optimizer);
+    }
+    free(optimizer.code);
+    free(optimizer.bytes);
+}
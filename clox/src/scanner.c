@@ -2,217 +2,262 @@
 #include<string.h>
 #include "common.h"
 #include "scanner.h"
+#if defined(__SSE2__)
+#include<emmintrin.h>
+#endif
 
-typedef struct{
-    const char* start;
-    const char* current;
-    int line;
-}Scanner;
-
-Scanner scanner;
+void initScanner(Scanner* scanner,const char* source){
+    initScannerAt(scanner,source,1);
+}
 
-void initScanner(const char* source){
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+void initScannerAt(Scanner* scanner,const char* source,int line){
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = line;
 }
+
+#define CHAR_DIGIT 1
+#define CHAR_ALPHA 2
+#define CHAR_BLANK 4
+
+//one lookup instead of a chain of range checks , anything >= 0x80 is in no class
+static const uint8_t charClass[256] = {
+    ['\t'] = CHAR_BLANK,['\r'] = CHAR_BLANK,[' '] = CHAR_BLANK,
+    ['0'] = CHAR_DIGIT,['1'] = CHAR_DIGIT,['2'] = CHAR_DIGIT,['3'] = CHAR_DIGIT,['4'] = CHAR_DIGIT,
+    ['5'] = CHAR_DIGIT,['6'] = CHAR_DIGIT,['7'] = CHAR_DIGIT,['8'] = CHAR_DIGIT,['9'] = CHAR_DIGIT,
+    ['_'] = CHAR_ALPHA,
+#define ALPHA(c) [c] = CHAR_ALPHA,[c - 'a' + 'A'] = CHAR_ALPHA
+    ALPHA('a'),ALPHA('b'),ALPHA('c'),ALPHA('d'),ALPHA('e'),ALPHA('f'),ALPHA('g'),ALPHA('h'),ALPHA('i'),
+    ALPHA('j'),ALPHA('k'),ALPHA('l'),ALPHA('m'),ALPHA('n'),ALPHA('o'),ALPHA('p'),ALPHA('q'),ALPHA('r'),
+    ALPHA('s'),ALPHA('t'),ALPHA('u'),ALPHA('v'),ALPHA('w'),ALPHA('x'),ALPHA('y'),ALPHA('z'),
+#undef ALPHA
+};
+
 static bool isDigit(char c){
-    return c>='0' && c<='9';
+    return charClass[(uint8_t)c] & CHAR_DIGIT;
 }
 static bool isAlpha(char c){
-    return (c>='a' && c<='z') || (c>='A' && c<='Z') || c=='_';
+    return charClass[(uint8_t)c] & CHAR_ALPHA;
 }
 static bool isAlphaNumeric(char c){
-    return isAlpha(c) || isDigit(c);
+    return charClass[(uint8_t)c] & (CHAR_ALPHA | CHAR_DIGIT);
 }
-static bool isAtEnd(){
-    return *scanner.current == '\0';
+
+//comment and string bodies are the only runs long enough for sse2 to pay off , identifiers and blanks
+//are a handful of chars and the table beats setting up a vector for them.
+//loads are aligned so a block holding the terminating nul never crosses into the next page , that still
+//reads past the end of the allocation though , which is fine for the hardware but not for asan or tsan
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define NO_SANITIZE __attribute__((no_sanitize("address","thread")))
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+#define NO_SANITIZE __attribute__((no_sanitize("address","thread")))
+#endif
+#endif
+#ifndef NO_SANITIZE
+#define NO_SANITIZE
+#endif
+
+//the first a , b or nul from p on
+#if defined(__SSE2__)
+NO_SANITIZE static const char* findEither(const char* p,char a,char b){
+    const char* block = (const char*)((uintptr_t)p & ~(uintptr_t)15);
+    unsigned skip = (unsigned)(p - block);
+    __m128i first = _mm_set1_epi8(a);
+    __m128i second = _mm_set1_epi8(b);
+    for(;;block += 16,skip = 0){
+        __m128i bytes = _mm_load_si128((const __m128i*)block);
+        __m128i stop = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes,first),_mm_cmpeq_epi8(bytes,second)),
+                                    _mm_cmpeq_epi8(bytes,_mm_setzero_si128()));
+        unsigned stops = ((unsigned)_mm_movemask_epi8(stop) >> skip) << skip;//bytes before p don't count
+        if(stops != 0) return block + __builtin_ctz(stops);
+    }
+}
+#else
+static const char* findEither(const char* p,char a,char b){
+    while(*p != a && *p != b && *p != '\0') p++;
+    return p;
+}
+#endif
+
+static bool isAtEnd(Scanner* scanner){
+    return *scanner->current == '\0';
 }
 
-static char advance(){
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner* scanner){
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static char peek(){
-    return *scanner.current;
+static char peek(Scanner* scanner){
+    return *scanner->current;
 }
 
-static char peekNext(){
-    if(isAtEnd()) return '\0';
-    return scanner.current[1];
+static char peekNext(Scanner* scanner){
+    if(isAtEnd(scanner)) return '\0';
+    return scanner->current[1];
 }
 
-static bool match(char expected) {
-  if (isAtEnd()) return false;
-  if (*scanner.current != expected) return false;
-  scanner.current++;
+static bool match(Scanner* scanner,char expected) {
+  if (isAtEnd(scanner)) return false;
+  if (*scanner->current != expected) return false;
+  scanner->current++;
   return true;
 }
 
-static Token makeToken(TokenType type){
+static Token makeToken(Scanner* scanner,TokenType type){
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current-scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current-scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
-static Token errorToken(const char* message){
+static Token errorToken(Scanner* scanner,const char* message){
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
 
 
-static void skipWhitespace(){
+static void skipWhitespace(Scanner* scanner){
     for(;;){
-        char c = peek();
-        switch(c){
+        while(charClass[(uint8_t)peek(scanner)] & CHAR_BLANK) scanner->current++;
+        switch(peek(scanner)){
             case '/':
-                if(peekNext()=='/'){
-                    while(peek()!='\n' && !isAtEnd()){
-                        advance();
-                    }
-                    if(peek()=='\n'){
-                        scanner.line++;
-                    }
+                if(peekNext(scanner)=='/'){
+                    scanner->current = findEither(scanner->current,'\n','\n');
+                    if(isAtEnd(scanner)) return;//stepping over the nul would run off the end of the source
+                    scanner->line++;
                 }
                 else{
                     return;
                 }
                 break;
-            case '\0': return;
-            case ' ':
-            case '\r':
-            case '\t':
-                break;
             case '\n':
-                scanner.line++;
+                scanner->line++;
                 break;
             default:
                 return;
         }
-        scanner.current++;
+        scanner->current++;
     }
 }
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type){
-    if(scanner.current-scanner.start==start+length && memcmp(scanner.start+start,rest,length)==0){
-        return type;
-    }
-    return TOKEN_IDENTIFIER;
-}
-static TokenType identifiertype(){
-    switch (scanner.start[0]) {
-    case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'b': return checkKeyword(1, 4, "reak", TOKEN_BREAK);
-    case 'c': 
-        if(scanner.current-scanner.start>1){
-            switch (scanner.start[1]) {
-            case 'l': return checkKeyword(2,3,"ass",TOKEN_CLASS);
-            case 'o': return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
-            }
-        }
-    case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    case 'f': 
-        if(scanner.current-scanner.start>1){
-            switch (scanner.start[1]) {
-            case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-            case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-            case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-            }
-        }
-        break;
-    case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-    case 't': if(scanner.current-scanner.start>1){
-        switch (scanner.start[1]) {
-        case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-        case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-        }
-    }
-    break;
-    case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-    default:
-        break;
-  }
-  return TOKEN_IDENTIFIER;
 
+typedef struct{
+    const char* name;
+    int length;
+    TokenType type;
+}Keyword;
+
+//perfect hash over the keywords , first char + 7 * last char + 2 * length picks a distinct slot for each ,
+//so a single slot is all there is to check
+#define KEYWORD_HASH(start,length) (((uint8_t)(start)[0] + 7*(uint8_t)(start)[(length)-1] + 2*(length)) & 31)
+
+//slots are KEYWORD_HASH worked out by hand , the rest stay empty
+static const Keyword keywords[32] = {
+    [3] = {"and",3,TOKEN_AND},
+    [25] = {"break",5,TOKEN_BREAK},
+    [18] = {"class",5,TOKEN_CLASS},
+    [22] = {"continue",8,TOKEN_CONTINUE},
+    [16] = {"else",4,TOKEN_ELSE},
+    [19] = {"false",5,TOKEN_FALSE},
+    [10] = {"for",3,TOKEN_FOR},
+    [14] = {"fun",3,TOKEN_FUN},
+    [23] = {"if",2,TOKEN_IF},
+    [8] = {"nil",3,TOKEN_NIL},
+    [17] = {"or",2,TOKEN_OR},
+    [6] = {"print",5,TOKEN_PRINT},
+    [0] = {"return",6,TOKEN_RETURN},
+    [27] = {"super",5,TOKEN_SUPER},
+    [1] = {"this",4,TOKEN_THIS},
+    [31] = {"true",4,TOKEN_TRUE},
+    [26] = {"var",3,TOKEN_VAR},
+    [4] = {"while",5,TOKEN_WHILE},
+};
+
+static TokenType identifiertype(Scanner* scanner){
+    int length = (int)(scanner->current-scanner->start);
+    if(length < 2 || length > 8) return TOKEN_IDENTIFIER;
+    const Keyword* keyword = &keywords[KEYWORD_HASH(scanner->start,length)];
+    if(keyword->length!=length) return TOKEN_IDENTIFIER;
+    //keywords are too short for a memcmp call to pay off
+    for(int i = 0; i < length; i++){
+        if(scanner->start[i]!=keyword->name[i]) return TOKEN_IDENTIFIER;
+    }
+    return keyword->type;
 }
 
-static Token number(){
-    while(isDigit(peek())) advance();
-    if(peek()=='.'&& isDigit(peekNext())){
-        advance();
-        while(isDigit(peek())) advance();
+static Token number(Scanner* scanner){
+    while(isDigit(peek(scanner))) advance(scanner);
+    if(peek(scanner)=='.'&& isDigit(peekNext(scanner))){
+        advance(scanner);
+        while(isDigit(peek(scanner))) advance(scanner);
     }
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner,TOKEN_NUMBER);
 }
-static Token string(){
-    while(peek()!='"'&&!isAtEnd()){
-        if(peek()=='\n') scanner.line++;
-        advance();
+static Token string(Scanner* scanner){
+    for(;;){
+        scanner->current = findEither(scanner->current,'"','\n');
+        if(peek(scanner)!='\n') break;
+        scanner->line++;
+        advance(scanner);
     }
-    if (isAtEnd()) return errorToken("Unterminated string.");
-    advance(); //consume "
-    return makeToken(TOKEN_STRING);
+    if (isAtEnd(scanner)) return errorToken(scanner,"Unterminated string.");
+    advance(scanner); //consume "
+    return makeToken(scanner,TOKEN_STRING);
 }
-static Token identifier(){
-    while(isAlphaNumeric(peek())) advance();
-    return makeToken(identifiertype());
+static Token identifier(Scanner* scanner){
+    while(isAlphaNumeric(peek(scanner))) advance(scanner);
+    return makeToken(scanner,identifiertype(scanner));
 }
 
-Token scanToken(){
-    skipWhitespace();
-    scanner.start = scanner.current;
-    if(isAtEnd()){
-        return makeToken(TOKEN_EOF);
+Token scanToken(Scanner* scanner){
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
+    if(isAtEnd(scanner)){
+        return makeToken(scanner,TOKEN_EOF);
     }
-    char c = advance();
-    if(isDigit(c)) return number();
-    if(isAlpha(c)) return identifier();
+    char c = advance(scanner);
+    if(isDigit(c)) return number(scanner);
+    if(isAlpha(c)) return identifier(scanner);
     switch (c) {
-    case '(': return makeToken(TOKEN_LEFT_PAREN);
-    case ')': return makeToken(TOKEN_RIGHT_PAREN);
-    case '{': return makeToken(TOKEN_LEFT_BRACE);
-    case '}': return makeToken(TOKEN_RIGHT_BRACE);
-    case '[': return makeToken(TOKEN_LEFT_SQUARE);
-    case ']': return makeToken(TOKEN_RIGHT_SQUARE);
-    case ';': return makeToken(TOKEN_SEMICOLON);
-    case ',': return makeToken(TOKEN_COMMA);
-    case ':': return makeToken(TOKEN_COLON);
-    case '?': return makeToken(TOKEN_QUESTION);
-    case '.': return makeToken(TOKEN_DOT);
-    case '-': return makeToken(TOKEN_MINUS);
-    case '+': return makeToken(TOKEN_PLUS);
-    case '/': return makeToken(TOKEN_SLASH);
-    case '*': return makeToken(TOKEN_STAR);
-    case '^': return makeToken(TOKEN_POWER);
+    case '(': return makeToken(scanner,TOKEN_LEFT_PAREN);
+    case ')': return makeToken(scanner,TOKEN_RIGHT_PAREN);
+    case '{': return makeToken(scanner,TOKEN_LEFT_BRACE);
+    case '}': return makeToken(scanner,TOKEN_RIGHT_BRACE);
+    case '[': return makeToken(scanner,TOKEN_LEFT_SQUARE);
+    case ']': return makeToken(scanner,TOKEN_RIGHT_SQUARE);
+    case ';': return makeToken(scanner,TOKEN_SEMICOLON);
+    case ',': return makeToken(scanner,TOKEN_COMMA);
+    case ':': return makeToken(scanner,TOKEN_COLON);
+    case '?': return makeToken(scanner,TOKEN_QUESTION);
+    case '.': return makeToken(scanner,TOKEN_DOT);
+    case '-': return makeToken(scanner,TOKEN_MINUS);
+    case '+': return makeToken(scanner,TOKEN_PLUS);
+    case '/': return makeToken(scanner,TOKEN_SLASH);
+    case '*': return makeToken(scanner,TOKEN_STAR);
+    case '^': return makeToken(scanner,TOKEN_POWER);
     case '!':
-      return makeToken(
-          match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+      return makeToken(scanner,
+          match(scanner,'=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-      return makeToken(
-          match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+      return makeToken(scanner,
+          match(scanner,'=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-      return makeToken(
-          match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+      return makeToken(scanner,
+          match(scanner,'=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
-      return makeToken(
-          match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-    case '"': return string();
+      return makeToken(scanner,
+          match(scanner,'=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+    case '"': return string(scanner);
     }
     
-    if(isAtEnd()) return makeToken(TOKEN_EOF);
-    return errorToken("Unexpected character.");
+    if(isAtEnd(scanner)) return makeToken(scanner,TOKEN_EOF);
+    return errorToken(scanner,"Unexpected character.");
 }
\ No newline at end of file
@@ -79,7 +79,7 @@ void markTable(Table* table){
 void tableRemoveWhite(Table* table){
     for(int i =0;i<table->capacity;i++){
         Entry* entry = &table->entries[i];
-        if(entry->key!=NULL&&!entry->key->obj.isMarked){
+        if(entry->key!=NULL&&!entry->key->obj.isMarked&&!entry->key->obj.isImmortal){
             tableDelete(table,entry->key);//after sweep() deletes the object , it won't create a dangling pointer
         }
     }
@@ -115,6 +115,13 @@ bool tableGet(Table* table,ObjString* key,Value* value){
     return true;
 }
 
+//where the key's value lives , good until the table next grows
+Value* tableValueAddress(Table* table,ObjString* key){
+    if(table->count==0) return NULL;
+    Entry* entry = findEntry(table->entries,table->capacity,key);
+    return entry->key==NULL ? NULL : &entry->value;
+}
+
 bool tableSet(Table* table,ObjString* key,Value value){
     if(table->count+1>table->capacity*TABLE_MAX_LOAD){
         int capacity = GROW_CAPACITY(table->capacity);
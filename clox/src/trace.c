@@ -0,0 +1,809 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include "trace.h"
+#include "chunk.h"
+#include "jit.h"
+#include "x64.h"
+
+//a tracing tier for loops. once a loop header gets hot the recorder runs the next iteration itself ,
+//for real , writing down what each instruction did as typed ir. anything it doesn't know ends the
+//recording where it stands and the interpreter carries on from that instruction.
+//the ir then goes through a small optimizer:
+//  - constant folding , and guards only where a value's type isn't known yet
+//  - locals and globals are forwarded from the last store , and each is loaded once per iteration
+//  - global lookups become addresses into vm.globals , resolved once when the trace is compiled
+//  - loads , guards and arithmetic that don't depend on anything the loop writes move in front of it
+//locals and globals are written straight back , so a side exit only has to put the temporaries the
+//interpreter would have on the stack back there and hand over the ip
+
+#define TRACE_STACK 64 //temporaries above the locals the recorder keeps track of
+#define TRACE_GLOBALS 32
+#define TRACE_REFS 1024 //stack entries across all snapshots
+
+typedef enum{
+    IR_CONSTANT,
+    IR_SLOT,
+    IR_GLOBAL,
+    IR_STORE_SLOT,
+    IR_STORE_GLOBAL,
+    IR_GUARD_NUMBER,
+    IR_GUARD_TRUTHY,
+    IR_GUARD_FALSEY,
+    IR_ADD,
+    IR_SUBTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,
+    IR_NEGATE,
+    IR_LESS,
+    IR_GREATER,
+    IR_LESS_EQUAL,//!(a > b) , so NaN compares the way the interpreter does it
+    IR_GREATER_EQUAL,//!(a < b)
+    IR_EQUAL_NUMBER,
+    IR_EQUAL,
+    IR_NOT
+}IrOp;
+
+typedef enum{
+    TYPE_ANY,
+    TYPE_NUMBER,
+    TYPE_BOOL
+}IrType;
+
+typedef struct{
+    uint8_t op;
+    uint8_t type;//of the result , a guard makes its operand a number from there on
+    bool invariant;//the same every iteration , computed once in front of the loop
+    int a;
+    int b;
+    int slot;
+    Value value;//IR_CONSTANT
+    Value* address;//IR_GLOBAL and IR_STORE_GLOBAL
+    int snapshot;//guards
+}IrIns;
+
+//the interpreter's state at a guard , apart from locals and globals which are always up to date
+typedef struct{
+    uint8_t* ip;
+    int start;//into refs
+    int count;
+}Snapshot;
+
+typedef struct{
+    Value* address;
+    int ref;
+}GlobalRef;
+
+typedef struct{
+    CallFrame* frame;
+    Chunk* chunk;
+    uint8_t* header;
+    int depth;//stack height at the header , counted from slots
+    IrIns ins[TRACE_MAX];
+    int count;
+    Snapshot snapshots[TRACE_MAX];
+    int snapshotCount;
+    int refs[TRACE_REFS];
+    int refCount;
+    int stack[TRACE_STACK];//the temporaries above depth
+    int stackCount;
+    int* slots;//ref each local below depth holds , -1 until it is loaded or stored
+    GlobalRef globals[TRACE_GLOBALS];
+    int globalCount;
+    bool failed;
+}Recorder;
+
+static Value peekValue(int distance){
+    return vm.stackTop[-1 - distance];
+}
+
+static bool isFalseyValue(Value value){
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static int emitIr(Recorder* rec,uint8_t op,uint8_t type,int a,int b){
+    if(rec->count == TRACE_MAX){
+        rec->failed = true;
+        return 0;
+    }
+    IrIns* ins = &rec->ins[rec->count];
+    ins->op = op;
+    ins->type = type;
+    ins->invariant = false;
+    ins->a = a;
+    ins->b = b;
+    ins->slot = 0;
+    ins->value = NIL_VAL;
+    ins->address = NULL;
+    ins->snapshot = -1;
+    return rec->count++;
+}
+
+static int constant(Recorder* rec,Value value){
+    int ref = emitIr(rec,IR_CONSTANT,IS_NUMBER(value) ? TYPE_NUMBER : IS_BOOL(value) ? TYPE_BOOL : TYPE_ANY,-1,-1);
+    rec->ins[ref].value = value;
+    return ref;
+}
+
+static bool isConstant(Recorder* rec,int ref){
+    return rec->ins[ref].op == IR_CONSTANT;
+}
+
+static void pushRef(Recorder* rec,int ref){
+    if(rec->stackCount == TRACE_STACK){
+        rec->failed = true;
+        return;
+    }
+    rec->stack[rec->stackCount++] = ref;
+}
+
+static int popRef(Recorder* rec){
+    return rec->stack[--rec->stackCount];
+}
+
+static int topRef(Recorder* rec,int distance){
+    return rec->stack[rec->stackCount - 1 - distance];
+}
+
+//the interpreter resumes at ip with everything the recorder has on its stack pushed back
+static int snapshot(Recorder* rec,uint8_t* ip){
+    if(rec->snapshotCount == TRACE_MAX || rec->refCount + rec->stackCount > TRACE_REFS){
+        rec->failed = true;
+        return 0;
+    }
+    Snapshot* snap = &rec->snapshots[rec->snapshotCount];
+    snap->ip = ip;
+    snap->start = rec->refCount;
+    snap->count = rec->stackCount;
+    for(int i = 0; i < rec->stackCount; i++) rec->refs[rec->refCount++] = rec->stack[i];
+    return rec->snapshotCount++;
+}
+
+static void guard(Recorder* rec,uint8_t op,int ref,uint8_t* exit){
+    int snap = snapshot(rec,exit);
+    int ins = emitIr(rec,op,TYPE_ANY,ref,-1);
+    rec->ins[ins].snapshot = snap;
+}
+
+//the ref as a number , guarded the first time it is used as one
+static int number(Recorder* rec,int ref,uint8_t* at){
+    if(rec->ins[ref].type == TYPE_NUMBER) return ref;
+    guard(rec,IR_GUARD_NUMBER,ref,at);
+    rec->ins[ref].type = TYPE_NUMBER;
+    return ref;
+}
+
+static int loadSlot(Recorder* rec,int slot){
+    if(slot >= rec->depth) return rec->stack[slot - rec->depth];
+    if(rec->slots[slot] < 0){
+        rec->slots[slot] = emitIr(rec,IR_SLOT,TYPE_ANY,-1,-1);
+        rec->ins[rec->slots[slot]].slot = slot;
+    }
+    return rec->slots[slot];
+}
+
+static void storeSlot(Recorder* rec,int slot,int ref){
+    if(slot >= rec->depth){
+        rec->stack[slot - rec->depth] = ref;
+        return;
+    }
+    int store = emitIr(rec,IR_STORE_SLOT,TYPE_ANY,ref,-1);
+    rec->ins[store].slot = slot;
+    rec->slots[slot] = ref;
+}
+
+static GlobalRef* findGlobal(Recorder* rec,Value* address){
+    for(int i = 0; i < rec->globalCount; i++){
+        if(rec->globals[i].address == address) return &rec->globals[i];
+    }
+    if(rec->globalCount == TRACE_GLOBALS){
+        rec->failed = true;
+        return NULL;
+    }
+    GlobalRef* global = &rec->globals[rec->globalCount++];
+    global->address = address;
+    global->ref = -1;
+    return global;
+}
+
+static int loadGlobal(Recorder* rec,Value* address){
+    GlobalRef* global = findGlobal(rec,address);
+    if(global == NULL) return 0;
+    if(global->ref < 0){
+        global->ref = emitIr(rec,IR_GLOBAL,TYPE_ANY,-1,-1);
+        rec->ins[global->ref].address = address;
+    }
+    return global->ref;
+}
+
+static void storeGlobal(Recorder* rec,Value* address,int ref){
+    GlobalRef* global = findGlobal(rec,address);
+    if(global == NULL) return;
+    int store = emitIr(rec,IR_STORE_GLOBAL,TYPE_ANY,ref,-1);
+    rec->ins[store].address = address;
+    global->ref = ref;
+}
+
+//numbers in , a number or a bool out , folded when both sides are constants
+static int arithmetic(Recorder* rec,uint8_t op,int a,int b){
+    if(isConstant(rec,a) && isConstant(rec,b)){
+        double x = AS_NUMBER(rec->ins[a].value);
+        double y = AS_NUMBER(rec->ins[b].value);
+        switch(op){
+            case IR_ADD: return constant(rec,NUMBER_VAL(x + y));
+            case IR_SUBTRACT: return constant(rec,NUMBER_VAL(x - y));
+            case IR_MULTIPLY: return constant(rec,NUMBER_VAL(x * y));
+            case IR_DIVIDE: return constant(rec,NUMBER_VAL(x / y));
+            case IR_LESS: return constant(rec,BOOL_VAL(x < y));
+            case IR_GREATER: return constant(rec,BOOL_VAL(x > y));
+            case IR_LESS_EQUAL: return constant(rec,BOOL_VAL(!(x > y)));
+            case IR_GREATER_EQUAL: return constant(rec,BOOL_VAL(!(x < y)));
+            case IR_EQUAL_NUMBER: return constant(rec,BOOL_VAL(x == y));
+        }
+    }
+    bool isBool = op >= IR_LESS;
+    return emitIr(rec,op,isBool ? TYPE_BOOL : TYPE_NUMBER,a,b);
+}
+
+static uint8_t comparisonIr(uint8_t comparison){
+    switch(comparison){
+        case LOOP_LESS: return IR_LESS;
+        case LOOP_LESS_EQUAL: return IR_LESS_EQUAL;
+        case LOOP_GREATER: return IR_GREATER;
+        default: return IR_GREATER_EQUAL;
+    }
+}
+
+static bool continues(double counter,double limit,uint8_t comparison){
+    switch(comparison){
+        case LOOP_LESS: return counter < limit;
+        case LOOP_LESS_EQUAL: return !(counter > limit);
+        case LOOP_GREATER: return counter > limit;
+        default: return !(counter < limit);
+    }
+}
+
+//a condition the recorded path depended on , the exit takes the branch it didn't
+static void branch(Recorder* rec,int condition,bool falsey,uint8_t* other){
+    if(isConstant(rec,condition)) return;
+    guard(rec,falsey ? IR_GUARD_FALSEY : IR_GUARD_TRUTHY,condition,other);
+}
+
+#define SHORT_AT(p) ((uint16_t)((p)[0] << 8 | (p)[1]))
+
+//runs and records one instruction , false stops the recording in front of it with nothing done.
+//*closed is set when it was the jump back to the header
+static bool recordInstruction(Recorder* rec,uint8_t** ipp,bool* closed){
+    uint8_t* at = *ipp;
+    Chunk* chunk = rec->chunk;
+    Value* slots = rec->frame->slots;
+    uint8_t* next = at + instructionLength(chunk,(int)(at - chunk->code));
+    switch(at[0]){
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:{
+            Value value = chunk->constants.values[at[0] == OP_CONSTANT ? at[1] : SHORT_AT(at + 1)];
+            push(value);
+            pushRef(rec,constant(rec,value));
+            break;
+        }
+        case OP_NIL: push(NIL_VAL); pushRef(rec,constant(rec,NIL_VAL)); break;
+        case OP_TRUE: push(TRUE_VAL); pushRef(rec,constant(rec,TRUE_VAL)); break;
+        case OP_FALSE: push(FALSE_VAL); pushRef(rec,constant(rec,FALSE_VAL)); break;
+        case OP_POP:
+            if(rec->stackCount == 0) return false;
+            pop();
+            popRef(rec);
+            break;
+        case OP_GET_LOCAL:{
+            uint16_t slot = SHORT_AT(at + 1);
+            push(slots[slot]);
+            pushRef(rec,loadSlot(rec,slot));
+            break;
+        }
+        case OP_SET_LOCAL:{
+            uint16_t slot = SHORT_AT(at + 1);
+            if(rec->stackCount == 0) return false;
+            slots[slot] = peekValue(0);
+            storeSlot(rec,slot,topRef(rec,0));
+            break;
+        }
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:{
+            Value name = chunk->constants.values[at[0] == OP_GET_GLOBAL ? at[1] : SHORT_AT(at + 1)];
+            Value* address = tableValueAddress(&vm.globals,AS_STRING(name));
+            if(address == NULL) return false;//the interpreter reports it
+            push(*address);
+            pushRef(rec,loadGlobal(rec,address));
+            break;
+        }
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:{
+            Value name = chunk->constants.values[at[0] == OP_SET_GLOBAL ? at[1] : SHORT_AT(at + 1)];
+            Value* address = tableValueAddress(&vm.globals,AS_STRING(name));
+            if(address == NULL || rec->stackCount == 0) return false;
+            *address = peekValue(0);
+            storeGlobal(rec,address,topRef(rec,0));
+            break;
+        }
+        case OP_JUMP:
+            next = &chunk->code[jumpTarget(chunk,(int)(at - chunk->code))];
+            break;
+        case OP_JUMP_IF_FALSE:{
+            if(rec->stackCount == 0) return false;
+            uint8_t* target = &chunk->code[jumpTarget(chunk,(int)(at - chunk->code))];
+            bool falsey = isFalseyValue(peekValue(0));
+            branch(rec,topRef(rec,0),falsey,falsey ? next : target);
+            if(falsey) next = target;
+            break;
+        }
+        case OP_LOOP:
+            if(&chunk->code[jumpTarget(chunk,(int)(at - chunk->code))] != rec->header || rec->stackCount != 0) return false;
+            *closed = true;
+            break;
+        case OP_EQUAL:{
+            if(rec->stackCount < 2) return false;
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(valuesEqual(a,b)));
+            int rb = popRef(rec);
+            int ra = popRef(rec);
+            if(rec->ins[ra].type == TYPE_NUMBER && rec->ins[rb].type == TYPE_NUMBER){
+                pushRef(rec,arithmetic(rec,IR_EQUAL_NUMBER,ra,rb));
+            }
+            else if(isConstant(rec,ra) && isConstant(rec,rb)){
+                pushRef(rec,constant(rec,BOOL_VAL(valuesEqual(a,b))));
+            }
+            else pushRef(rec,emitIr(rec,IR_EQUAL,TYPE_BOOL,ra,rb));
+            break;
+        }
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+        case OP_ADD_NUM: case OP_SUBTRACT_NUM: case OP_MULTIPLY_NUM: case OP_DIVIDE_NUM:
+        case OP_LESS: case OP_GREATER: case OP_LESS_NUM: case OP_GREATER_NUM:{
+            if(rec->stackCount < 2) return false;
+            Value b = peekValue(0);
+            Value a = peekValue(1);
+            if(!IS_NUMBER(a) || !IS_NUMBER(b)) return false;//strings and errors stay with the interpreter
+            int rb = number(rec,topRef(rec,0),at);
+            int ra = number(rec,topRef(rec,1),at);
+            double x = AS_NUMBER(a);
+            double y = AS_NUMBER(b);
+            Value result;
+            uint8_t op;
+            switch(at[0]){
+                case OP_ADD: case OP_ADD_NUM: op = IR_ADD; result = NUMBER_VAL(x + y); break;
+                case OP_SUBTRACT: case OP_SUBTRACT_NUM: op = IR_SUBTRACT; result = NUMBER_VAL(x - y); break;
+                case OP_MULTIPLY: case OP_MULTIPLY_NUM: op = IR_MULTIPLY; result = NUMBER_VAL(x * y); break;
+                case OP_DIVIDE: case OP_DIVIDE_NUM: op = IR_DIVIDE; result = NUMBER_VAL(x / y); break;
+                case OP_LESS: case OP_LESS_NUM: op = IR_LESS; result = BOOL_VAL(x < y); break;
+                default: op = IR_GREATER; result = BOOL_VAL(x > y); break;
+            }
+            pop();
+            pop();
+            push(result);
+            popRef(rec);
+            popRef(rec);
+            pushRef(rec,arithmetic(rec,op,ra,rb));
+            break;
+        }
+        case OP_NEGATE:{
+            if(rec->stackCount == 0 || !IS_NUMBER(peekValue(0))) return false;
+            int ra = number(rec,topRef(rec,0),at);
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            popRef(rec);
+            pushRef(rec,isConstant(rec,ra) ? constant(rec,NUMBER_VAL(-AS_NUMBER(rec->ins[ra].value))) :
+                emitIr(rec,IR_NEGATE,TYPE_NUMBER,ra,-1));
+            break;
+        }
+        case OP_NOT:{
+            if(rec->stackCount == 0) return false;
+            Value value = pop();
+            push(BOOL_VAL(isFalseyValue(value)));
+            int ra = popRef(rec);
+            pushRef(rec,isConstant(rec,ra) ? constant(rec,BOOL_VAL(isFalseyValue(value))) :
+                emitIr(rec,IR_NOT,TYPE_BOOL,ra,-1));
+            break;
+        }
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:{
+            uint16_t slot = SHORT_AT(at + 1);
+            bool limitIsConstant = at[3];
+            uint16_t limitIndex = SHORT_AT(at + 4);
+            uint8_t comparison = at[6];
+            uint8_t* target = &chunk->code[jumpTarget(chunk,(int)(at - chunk->code))];
+            Value counter = slots[slot];
+            Value limit = limitIsConstant ? chunk->constants.values[limitIndex] : slots[limitIndex];
+            if(!IS_NUMBER(counter) || !IS_NUMBER(limit)) return false;
+            bool step = at[0] == OP_FOR_LOOP;
+            double value = AS_NUMBER(counter);
+            Value increment = step ? chunk->constants.values[SHORT_AT(at + 7)] : NUMBER_VAL(0);
+            if(step) value += AS_NUMBER(increment);
+            bool keepGoing = continues(value,AS_NUMBER(limit),comparison);
+            //a for loop that finishes while recording , or an inner one , isn't this trace's loop
+            if(step && (!keepGoing || target != rec->header || rec->stackCount != 0)) return false;
+            int counterRef = number(rec,loadSlot(rec,slot),at);
+            int limitRef = limitIsConstant ? constant(rec,limit) : number(rec,loadSlot(rec,limitIndex),at);
+            if(step){
+                counterRef = arithmetic(rec,IR_ADD,counterRef,constant(rec,increment));
+                storeSlot(rec,slot,counterRef);
+                slots[slot] = NUMBER_VAL(value);
+            }
+            int condition = arithmetic(rec,comparisonIr(comparison),counterRef,limitRef);
+            if(step){
+                branch(rec,condition,false,next);
+                *closed = true;
+            }
+            else{
+                branch(rec,condition,!keepGoing,keepGoing ? target : next);
+                if(!keepGoing) next = target;
+            }
+            break;
+        }
+        default:
+            return false;
+    }
+    *ipp = next;
+    return true;
+}
+
+//what the loop never writes is the same on every iteration
+static void markInvariants(Recorder* rec){
+    for(int i = 0; i < rec->count; i++){
+        IrIns* ins = &rec->ins[i];
+        switch(ins->op){
+            case IR_CONSTANT:
+                ins->invariant = true;
+                break;
+            case IR_SLOT:
+            case IR_GLOBAL:{
+                ins->invariant = true;
+                for(int j = 0; j < rec->count; j++){
+                    IrIns* store = &rec->ins[j];
+                    if((ins->op == IR_SLOT && store->op == IR_STORE_SLOT && store->slot == ins->slot) ||
+                       (ins->op == IR_GLOBAL && store->op == IR_STORE_GLOBAL && store->address == ins->address)){
+                        ins->invariant = false;
+                        break;
+                    }
+                }
+                break;
+            }
+            case IR_STORE_SLOT:
+            case IR_STORE_GLOBAL:
+                break;
+            default:
+                ins->invariant = rec->ins[ins->a].invariant && (ins->b < 0 || rec->ins[ins->b].invariant);
+                //a hoisted guard fails before anything ran , so it leaves through the header with nothing pushed
+                if(ins->invariant && ins->snapshot >= 0) ins->snapshot = 0;
+                break;
+        }
+    }
+}
+
+#ifdef JIT_ENABLED
+
+//the code's frame
+//  r12  slots + depth , where a side exit puts the temporaries back
+//  r13  slots
+//  r14  the VM
+//  r15  QNAN
+//  rsp  one home per ir instruction , every value stays in its boxed form there
+
+#define LOOP_TOP (-1)
+
+static void loadRef(Assembler* as,Recorder* rec,int reg,int ref){
+    if(isConstant(rec,ref)) x64LoadImmediate(as,reg,rec->ins[ref].value);
+    else x64Load(as,reg,RSP,8*ref);
+}
+
+static void storeHome(Assembler* as,int ref){
+    x64Store(as,RSP,8*ref,RAX);
+}
+
+static void loadNumbers(Assembler* as,Recorder* rec,IrIns* ins){
+    loadRef(as,rec,RAX,ins->a);
+    loadRef(as,rec,RDX,ins->b);
+    x64ToXmm(as,0,RAX);
+    x64ToXmm(as,1,RDX);
+}
+
+static void compileIr(Assembler* as,Recorder* rec,int ref){
+    IrIns* ins = &rec->ins[ref];
+    switch(ins->op){
+        case IR_CONSTANT:
+            break;//loaded as an immediate wherever it is used
+        case IR_SLOT:
+            x64Load(as,RAX,R13,8*ins->slot);
+            storeHome(as,ref);
+            break;
+        case IR_GLOBAL:
+            x64LoadImmediate(as,RCX,(uint64_t)(uintptr_t)ins->address);
+            x64Load(as,RAX,RCX,0);
+            storeHome(as,ref);
+            break;
+        case IR_STORE_SLOT:
+            loadRef(as,rec,RAX,ins->a);
+            x64Store(as,R13,8*ins->slot,RAX);
+            break;
+        case IR_STORE_GLOBAL:
+            loadRef(as,rec,RAX,ins->a);
+            x64LoadImmediate(as,RCX,(uint64_t)(uintptr_t)ins->address);
+            x64Store(as,RCX,0,RAX);
+            break;
+        case IR_GUARD_NUMBER:
+            loadRef(as,rec,RAX,ins->a);
+            x64Alu(as,ALU_MOV,RCX,RAX);
+            x64Alu(as,ALU_AND,RCX,R15);
+            x64Alu(as,ALU_CMP,RCX,R15);
+            x64JumpTo(as,CC_E,ins->snapshot);
+            break;
+        case IR_GUARD_TRUTHY:
+        case IR_GUARD_FALSEY:{
+            bool truthy = ins->op == IR_GUARD_TRUTHY;
+            loadRef(as,rec,RAX,ins->a);
+            if(rec->ins[ins->a].type == TYPE_BOOL){
+                x64LoadImmediate(as,RCX,TRUE_VAL);
+                x64Alu(as,ALU_CMP,RAX,RCX);
+                x64JumpTo(as,truthy ? CC_NE : CC_E,ins->snapshot);
+                break;
+            }
+            x64LoadImmediate(as,RCX,FALSE_VAL);
+            x64Alu(as,ALU_CMP,RAX,RCX);
+            if(truthy){
+                x64JumpTo(as,CC_E,ins->snapshot);
+                x64LoadImmediate(as,RCX,NIL_VAL);
+                x64Alu(as,ALU_CMP,RAX,RCX);
+                x64JumpTo(as,CC_E,ins->snapshot);
+            }
+            else{
+                int falsey = x64JumpForward(as,CC_E);
+                x64LoadImmediate(as,RCX,NIL_VAL);
+                x64Alu(as,ALU_CMP,RAX,RCX);
+                x64JumpTo(as,CC_NE,ins->snapshot);
+                x64Land(as,falsey);
+            }
+            break;
+        }
+        case IR_ADD:
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE:{
+            static const uint8_t ops[] = {SSE_ADD,SSE_SUB,SSE_MUL,SSE_DIV};
+            loadNumbers(as,rec,ins);
+            x64ScalarDouble(as,ops[ins->op - IR_ADD],0,1);
+            x64FromXmm(as,RAX,0);
+            storeHome(as,ref);
+            break;
+        }
+        case IR_NEGATE:
+            loadRef(as,rec,RAX,ins->a);
+            x64LoadImmediate(as,RCX,SIGN_BIT);
+            x64Alu(as,ALU_XOR,RAX,RCX);
+            storeHome(as,ref);
+            break;
+        case IR_LESS:
+        case IR_GREATER:
+        case IR_LESS_EQUAL:
+        case IR_GREATER_EQUAL:
+            loadNumbers(as,rec,ins);
+            //b > a , a > b , !(a > b) , !(b > a)
+            if(ins->op == IR_LESS || ins->op == IR_GREATER_EQUAL) x64CompareDoubles(as,1,0);
+            else x64CompareDoubles(as,0,1);
+            x64SetCondition(as,ins->op == IR_LESS || ins->op == IR_GREATER ? CC_A : CC_BE,RAX);
+            x64BoxBool(as);
+            storeHome(as,ref);
+            break;
+        case IR_EQUAL_NUMBER:
+            loadNumbers(as,rec,ins);
+            x64CompareDoubles(as,0,1);
+            x64SetCondition(as,CC_E,RAX);
+            x64SetCondition(as,CC_NP,RCX);
+            x64Byte(as,0x20);//and al,cl
+            x64Byte(as,0xc8);
+            x64BoxBool(as);
+            storeHome(as,ref);
+            break;
+        case IR_EQUAL:{
+            loadRef(as,rec,RAX,ins->a);
+            loadRef(as,rec,RDX,ins->b);
+            int bits[2];
+            bits[0] = x64UnlessNumber(as,RAX);
+            bits[1] = x64UnlessNumber(as,RDX);
+            x64ToXmm(as,0,RAX);
+            x64ToXmm(as,1,RDX);
+            x64CompareDoubles(as,0,1);
+            x64SetCondition(as,CC_E,RAX);
+            x64SetCondition(as,CC_NP,RCX);
+            x64Byte(as,0x20);//and al,cl
+            x64Byte(as,0xc8);
+            int done = x64JumpForward(as,-1);
+            x64Land(as,bits[0]);
+            x64Land(as,bits[1]);
+            x64Alu(as,ALU_CMP,RAX,RDX);
+            x64SetCondition(as,CC_E,RAX);
+            x64Land(as,done);
+            x64BoxBool(as);
+            storeHome(as,ref);
+            break;
+        }
+        case IR_NOT:
+            loadRef(as,rec,RAX,ins->a);
+            if(rec->ins[ins->a].type == TYPE_BOOL){
+                x64LoadImmediate(as,RCX,TRUE_VAL ^ FALSE_VAL);
+                x64Alu(as,ALU_XOR,RAX,RCX);
+            }
+            else{
+                x64Falsey(as);
+                x64BoxBool(as);
+            }
+            storeHome(as,ref);
+            break;
+    }
+}
+
+static void* compileTrace(Recorder* rec,size_t* size){
+    Assembler as = {NULL,0,0,NULL,0,0};
+    int frameSize = (8*rec->count + 15) & ~15;
+    x64Push(&as,R12);
+    x64Push(&as,R13);
+    x64Push(&as,R14);
+    x64Push(&as,R15);
+    x64AddImmediate(&as,RSP,-frameSize);
+    x64Alu(&as,ALU_MOV,R13,RDI);
+    x64Alu(&as,ALU_MOV,R14,RSI);
+    x64Alu(&as,ALU_MOV,R12,R13);
+    x64AddImmediate(&as,R12,8*rec->depth);
+    x64LoadImmediate(&as,R15,QNAN);
+    for(int i = 0; i < rec->count; i++){
+        if(rec->ins[i].invariant) compileIr(&as,rec,i);
+    }
+    int top = as.count;
+    for(int i = 0; i < rec->count; i++){
+        if(!rec->ins[i].invariant) compileIr(&as,rec,i);
+    }
+    x64Byte(&as,0xe9);//back to the top of the loop
+    x64Int32(&as,(uint32_t)(top - (as.count + 4)));
+    int epilogue = as.count;
+    x64AddImmediate(&as,RSP,frameSize);
+    x64Pop(&as,R15);
+    x64Pop(&as,R14);
+    x64Pop(&as,R13);
+    x64Pop(&as,R12);
+    x64Byte(&as,0xc3);
+    int* exits = (int*)malloc(sizeof(int)*rec->snapshotCount);
+    if(exits == NULL) exit(1);
+    for(int i = 0; i < rec->snapshotCount; i++){
+        exits[i] = -1;
+    }
+    for(int i = 0; i < as.patchCount; i++){
+        int snap = as.patches[i].target;
+        if(exits[snap] < 0){
+            exits[snap] = as.count;
+            Snapshot* exit = &rec->snapshots[snap];
+            for(int j = 0; j < exit->count; j++){
+                loadRef(&as,rec,RAX,rec->refs[exit->start + j]);
+                x64Store(&as,R12,8*j,RAX);
+            }
+            x64Alu(&as,ALU_MOV,RAX,R12);
+            x64AddImmediate(&as,RAX,8*exit->count);
+            x64Store(&as,R14,offsetof(VM,stackTop),RAX);
+            x64LoadImmediate(&as,RAX,(uint64_t)(uintptr_t)exit->ip);
+            x64Byte(&as,0xe9);
+            x64Int32(&as,(uint32_t)(epilogue - (as.count + 4)));
+        }
+        x64Patch(&as,as.patches[i].at,exits[snap] - (as.patches[i].at + 4));
+    }
+    free(exits);
+    void* code = x64Finish(&as,size);
+    freeAssembler(&as);
+    return code;
+}
+
+static void releaseCode(Trace* trace){
+    if(trace->code != NULL) x64Release(trace->code,trace->size);
+    trace->code = NULL;
+}
+
+#else
+
+static void* compileTrace(Recorder* rec,size_t* size){
+    return NULL;
+}
+
+static void releaseCode(Trace* trace){
+}
+
+#endif
+
+//records the iteration that starts at the header , returns where the interpreter goes on
+static uint8_t* recordTrace(Trace* trace,CallFrame* frame){
+    Recorder* rec = (Recorder*)malloc(sizeof(Recorder));
+    if(rec == NULL) exit(1);
+    rec->frame = frame;
+    rec->chunk = &frame->closure->function->chunk;
+    rec->header = trace->header;
+    rec->depth = (int)(vm.stackTop - frame->slots);
+    rec->count = 0;
+    rec->snapshotCount = 0;
+    rec->refCount = 0;
+    rec->stackCount = 0;
+    rec->globalCount = 0;
+    rec->failed = false;
+    rec->slots = (int*)malloc(sizeof(int)*(rec->depth + 1));
+    if(rec->slots == NULL) exit(1);
+    for(int i = 0; i < rec->depth; i++) rec->slots[i] = -1;
+    snapshot(rec,trace->header);//0 , leaving through the header before the loop did anything
+    uint8_t* ip = trace->header;
+    bool closed = false;
+    while(!closed && !rec->failed && recordInstruction(rec,&ip,&closed));
+    if(closed){
+        trace->end = ip;
+        ip = trace->header;//the jump back was taken either way
+    }
+    if(closed && !rec->failed){
+        markInvariants(rec);
+        trace->code = compileTrace(rec,&trace->size);
+        trace->globals = vm.globals.entries;
+        trace->sideExits = 0;
+        if(trace->code != NULL) trace->attempts = 0;
+    }
+    free(rec->slots);
+    free(rec);
+    if(trace->code == NULL) return ip;
+    return ((TraceCode)trace->code)(frame->slots,&vm);
+}
+
+static Trace* findTrace(ObjFunction* function,uint8_t* header){
+    for(Trace* trace = function->traces; trace != NULL; trace = trace->next){
+        if(trace->header == header) return trace;
+    }
+    Trace* trace = (Trace*)malloc(sizeof(Trace));
+    if(trace == NULL) exit(1);
+    trace->header = header;
+    trace->end = header;
+    trace->code = NULL;
+    trace->size = 0;
+    trace->globals = NULL;
+    trace->attempts = 0;
+    trace->sideExits = 0;
+    trace->retraces = 0;
+    trace->next = function->traces;
+    function->traces = trace;
+    return trace;
+}
+
+#define HOT_SLOT(ip) ((((uintptr_t)(ip)) ^ ((uintptr_t)(ip) >> 7)) & (HOT_LOOPS - 1))
+
+uint8_t* hotLoop(CallFrame* frame,uint8_t* header){
+    int slot = HOT_SLOT(header);
+    Trace* trace = vm.loopTraces[slot];
+    if(trace != NULL && trace->header == header && trace->code != NULL){
+        if(trace->globals == vm.globals.entries){
+            uint8_t* ip = ((TraceCode)trace->code)(frame->slots,&vm);
+            if(ip < trace->header || ip >= trace->end || ++trace->sideExits < HOT_LOOP_THRESHOLD << trace->retraces) return ip;
+            //the recorded path isn't the common one any more , once the loop is hot again it is recorded afresh
+            releaseCode(trace);
+            if(trace->retraces < TRACE_BACKOFF) trace->retraces++;
+            return ip;
+        }
+        releaseCode(trace);//the globals table grew , record it again
+        trace->attempts = 0;
+    }
+    if(--vm.hotLoops[slot] > 0) return header;
+    vm.hotLoops[slot] = HOT_LOOP_THRESHOLD;
+    if(trace == NULL || trace->header != header){
+        trace = findTrace(frame->closure->function,header);
+        vm.loopTraces[slot] = trace;
+    }
+    if(trace->attempts >= TRACE_ATTEMPTS) return NULL;//keeps failing , over to the baseline jit
+    trace->attempts++;
+    return recordTrace(trace,frame);
+}
+
+void freeTraces(ObjFunction* function){
+    while(function->traces != NULL){
+        Trace* trace = function->traces;
+        function->traces = trace->next;
+        int slot = HOT_SLOT(trace->header);
+        if(vm.loopTraces[slot] == trace) vm.loopTraces[slot] = NULL;
+        releaseCode(trace);
+        free(trace);
+    }
+}
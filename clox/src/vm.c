@@ -10,7 +10,31 @@
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
-VM vm;
+#include "jit.h"
+#include "trace.h"
+#include "feedback.h"
+#include "channel.h"
+#include "isolate.h"
+THREAD_LOCAL VM vm;//one per thread , see isolate.h
+
+//a native that can't just return sets this , callValue() acts on it once the native is back
+typedef enum{
+  NATIVE_RETURNED,
+  NATIVE_ERROR,//nativeMessage is a runtime error
+  NATIVE_FIBER_FAILED,//a fiber it ran failed and reported it , the caller goes down too
+  NATIVE_SWITCHED//yield() or transfer() , run() unwinds to the resume() that started the fiber
+}NativeExit;
+
+static THREAD_LOCAL uint8_t nativeExit = NATIVE_RETURNED;
+static THREAD_LOCAL char nativeMessage[256];
+
+static void nativeError(const char* format,...){
+  va_list args;
+  va_start(args, format);
+  vsnprintf(nativeMessage,sizeof(nativeMessage),format,args);
+  va_end(args);
+  nativeExit = NATIVE_ERROR;
+}
 
 static Value clockNative(int argCount, Value* args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
@@ -29,18 +53,132 @@ static Value gcNative(int argCount,Value* args){
     return NIL_VAL;
 }
 
+static Value channelNative(int argCount,Value* args){
+    Channel* channel = openChannel();
+    ObjChannel* object = newChannel(channel);
+    releaseChannel(channel);//the object has its own
+    return OBJ_VAL(object);
+}
+
+static Value sendNative(int argCount,Value* args){
+    if(argCount != 2 || !IS_CHANNEL(args[0])){
+        nativeError("send() takes a channel and a value.");
+        return NIL_VAL;
+    }
+    Message message;
+    const char* error = packMessage(&message,args[1]);
+    if(error != NULL){
+        nativeError("%s",error);
+        return NIL_VAL;
+    }
+    channelSend(AS_CHANNEL(args[0])->channel,&message);
+    return NIL_VAL;
+}
+
+static Value receiveNative(int argCount,Value* args){
+    if(argCount != 1 || !IS_CHANNEL(args[0])){
+        nativeError("receive() takes a channel.");
+        return NIL_VAL;
+    }
+    Message message;
+    channelReceive(AS_CHANNEL(args[0])->channel,&message);
+    Value value;
+    const char* error = unpackMessage(&message,&value);
+    freeMessage(&message);
+    if(error != NULL){
+        nativeError("%s",error);
+        return NIL_VAL;
+    }
+    return value;
+}
+
+//spawn(path) or spawn(path,value) , the new isolate gets a copy of value from argument()
+static Value spawnNative(int argCount,Value* args){
+    if(argCount < 1 || argCount > 2 || !IS_STRING(args[0])){
+        nativeError("spawn() takes a path and an optional value.");
+        return NIL_VAL;
+    }
+    Message* argument = NULL;
+    if(argCount == 2){
+        argument = (Message*)malloc(sizeof(Message));
+        if(argument == NULL) exit(1);
+        const char* error = packMessage(argument,args[1]);
+        if(error != NULL){
+            free(argument);
+            nativeError("%s",error);
+            return NIL_VAL;
+        }
+    }
+    if(!spawnFile(AS_CSTRING(args[0]),argument)){
+        nativeError("Could not spawn '%s'.",AS_CSTRING(args[0]));
+    }
+    return NIL_VAL;
+}
+
+//load(path , ...) compiles every file at once , a thread each , and returns their scripts in the same order as
+//functions that haven't run yet. calling one runs that file against this isolate's globals
+static Value loadNative(int argCount,Value* args){
+    for(int i = 0; i < argCount; i++){
+        if(!IS_STRING(args[i])){
+            nativeError("load() takes paths.");
+            return NIL_VAL;
+        }
+    }
+    CompileJob* jobs[UINT8_MAX];
+    for(int i = 0; i < argCount; i++) jobs[i] = startCompile(AS_CSTRING(args[i]));
+    ObjList* scripts = newList();
+    push(OBJ_VAL(scripts));
+    int failed = -1;//the first file that didn't make it , every job is still waited for
+    bool unreadable = false;
+    for(int i = 0; i < argCount; i++){
+        ObjFunction* function = jobs[i] != NULL ? finishCompile(jobs[i]) : NULL;
+        if(function == NULL){
+            if(failed == -1){
+                failed = i;
+                unreadable = jobs[i] == NULL;
+            }
+            continue;
+        }
+        push(OBJ_VAL(function));
+        ObjClosure* closure = newClosure(function);
+        push(OBJ_VAL(closure));
+        writeValueArray(&scripts->objects,OBJ_VAL(closure));
+        pop();
+        pop();
+    }
+    pop();
+    if(failed != -1){
+        nativeError(unreadable ? "Could not open '%s'." : "Could not compile '%s'.",AS_CSTRING(args[failed]));
+        return NIL_VAL;
+    }
+    return OBJ_VAL(scripts);
+}
+
+static Value argumentNative(int argCount,Value* args){
+    Message* argument = isolateArgument();
+    if(argument == NULL) return NIL_VAL;
+    Value value;
+    const char* error = unpackMessage(argument,&value);
+    if(error != NULL){
+        nativeError("%s",error);
+        return NIL_VAL;
+    }
+    return value;
+}
+
+static void closeUpvalues(Value* last);
+
 static void resetStack(){
+    closeUpvalues(vm.stack);//closures that outlive the error must not point into a stack that gets reused
+    for(int i = 0; i < vm.frameCount; i++){
+        freeObjectList(vm.frames[i].frameObjects);
+    }
     vm.frameCount = 0;
     vm.stackTop = vm.stack;
     vm.openUpvalues = NULL;
 }
 
-static void runtimeError(const char* format, ...) {
-  va_list args;
-  va_start(args, format);
-  vfprintf(stderr, format, args);
-  va_end(args);
-  fputs("\n", stderr);
+static void printTrace(){
   int repeated = 0;
   int lastLine = -1;
   const char* lastFunctionName = NULL;
@@ -65,6 +203,15 @@ static void runtimeError(const char* format, ...) {
   if(repeated>0){
     fprintf(stderr, "[^ line repeated %d  time(s)]\n", repeated);
   }
+}
+
+static void runtimeError(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputs("\n", stderr);
+  printTrace();
   resetStack();
 }
 
@@ -78,13 +225,38 @@ static void defineNative(const char* name, NativeFn function) {
   pop();
 }
 
+//fibers , defined with run()
+static Value fiberNative(int argCount,Value* args);
+static Value resumeNative(int argCount,Value* args);
+static Value yieldNative(int argCount,Value* args);
+static Value transferNative(int argCount,Value* args);
+static Value isDoneNative(int argCount,Value* args);
+
 static void defineNatives(){
     defineNative("len",lenNative);
     defineNative("clock",clockNative);
     defineNative("gc",gcNative);
+    defineNative("channel",channelNative);
+    defineNative("send",sendNative);
+    defineNative("receive",receiveNative);
+    defineNative("spawn",spawnNative);
+    defineNative("argument",argumentNative);
+    defineNative("load",loadNative);
+    defineNative("fiber",fiberNative);
+    defineNative("resume",resumeNative);
+    defineNative("yield",yieldNative);
+    defineNative("transfer",transferNative);
+    defineNative("isDone",isDoneNative);
 }
 
 void initVM(){
+    vm.frameCapacity = FRAMES_INITIAL;
+    vm.frames = (CallFrame*)malloc(sizeof(CallFrame)*vm.frameCapacity);
+    vm.stackCapacity = STACK_SEGMENT;
+    vm.stack = (Value*)malloc(sizeof(Value)*vm.stackCapacity);
+    if(vm.frames == NULL || vm.stack == NULL) exit(1);
+    vm.frameCount = 0;
+    vm.openUpvalues = NULL;
     resetStack();
     vm.objects = NULL;
     initTable(&vm.strings,64);
@@ -93,18 +265,31 @@ void initVM(){
     vm.initString = copyString("init",4);
     vm.bytesAllocated = 0;
     vm.nextGC = 1024*16;
+    vm.largeBytesAllocated = 0;
+    vm.nextLargeGC = LARGE_HEAP_MIN;
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.nativeDepth = 0;
+    for(int i = 0; i < HOT_LOOPS; i++){
+        vm.hotLoops[i] = HOT_LOOP_THRESHOLD;
+        vm.loopTraces[i] = NULL;
+    }
+    vm.fiber = NULL;
+    vm.fibers = NULL;
     defineNatives();
 }
 
 void freeVM(){
+    joinSpawned();
     freeObjects();
     freeTable(&vm.strings);
     vm.initString = NULL;
     freeTable(&vm.globals);
     free(vm.grayStack);
+    free(vm.stack);
+    free(vm.frames);
+    freeRetainedSources();
 }   
 
 
@@ -123,7 +308,32 @@ static Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
 
-static bool call(ObjClosure* closure, int argCount) {
+//moves the stack to a bigger block and points everything that held an address into it at the new one
+static void growStack(int needed){
+    int capacity = vm.stackCapacity;
+    while(capacity < needed){
+        capacity += capacity < STACK_SEGMENT*8 ? STACK_SEGMENT : capacity;
+    }
+    //everything pointing into the stack is turned into an offset first , the old pointers mean nothing after realloc
+    int upvalueCount = 0;
+    for(ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) upvalueCount++;
+    ptrdiff_t* offsets = (ptrdiff_t*)malloc(sizeof(ptrdiff_t)*(vm.frameCount + upvalueCount + 1));
+    if(offsets == NULL) exit(1);
+    ptrdiff_t* offset = offsets;
+    *offset++ = vm.stackTop - vm.stack;
+    for(int i = 0; i < vm.frameCount; i++) *offset++ = vm.frames[i].slots - vm.stack;
+    for(ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) *offset++ = upvalue->location - vm.stack;
+    vm.stack = (Value*)realloc(vm.stack,sizeof(Value)*capacity);
+    if(vm.stack == NULL) exit(1);
+    vm.stackCapacity = capacity;
+    offset = offsets;
+    vm.stackTop = vm.stack + *offset++;
+    for(int i = 0; i < vm.frameCount; i++) vm.frames[i].slots = vm.stack + *offset++;
+    for(ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) upvalue->location = vm.stack + *offset++;
+    free(offsets);
+}
+
+static bool checkArity(ObjClosure* closure, int argCount) {
   if(closure->function->arity>=0&&argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d.",
         closure->function->arity, argCount);
@@ -133,14 +343,117 @@ static bool call(ObjClosure* closure, int argCount) {
     runtimeError("Expected 0 arguments for getter method but got %d.",argCount);
     return false;
   }
+  return true;
+}
+
+//trivial bodies (accessors , constants , identity) are answered right here without a frame
+//the method was already looked up on the receiver's class , so the right body is always used
+static bool callInline(ObjFunction* function, int argCount) {
+  Value* slots = vm.stackTop - argCount - 1;
+  Value result;
+  switch (function->inlineKind) {
+    case INLINE_CONSTANT:
+      result = function->inlineValue;
+      break;
+    case INLINE_SLOT:
+      result = slots[function->inlineSlot];
+      break;
+    case INLINE_FIELD:
+      if (!IS_INSTANCE(slots[0]) ||
+          !tableGet(&AS_INSTANCE(slots[0])->fields, AS_STRING(function->inlineValue), &result)) {
+        return false;//a method or getter of that name has to run for real
+      }
+      break;
+    default:
+      return false;
+  }
+  vm.stackTop = slots;
+  push(result);
+  return true;
+}
+
+//with --lazy a body is compiled the first time anything calls it
+static bool compileBody(ObjFunction* function){
+  if(compileLazy(function)) return true;
+  runtimeError("Could not compile %s.", function->name->length > 0 ? function->name->chars : "function expression");
+  return false;
+}
+
+static InterpretResult run(int base);
+static bool runFrame(int index);
+
+//the frame array is full , it doubles up to FRAMES_MAX (a multiple of FRAMES_INITIAL)
+static bool growFrames(){
   if (vm.frameCount == FRAMES_MAX) {
     runtimeError("Stack overflow.");
     return false;
-  } 
+  }
+  vm.frameCapacity *= 2;
+  vm.frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * vm.frameCapacity);
+  if (vm.frames == NULL) exit(1);
+  return true;
+}
+
+static bool reserveStack(int needed){
+  if (needed > STACK_MAX) {
+    runtimeError("Stack overflow.");
+    return false;
+  }
+  growStack(needed);
+  return true;
+}
+
+//hot functions with --jit , and all of them in a program from --emit-c , run as native code right here , to completion
+static bool callNative(ObjFunction* function){
+  if(compilerOptions.jit && function->native == NULL && ++function->calls == JIT_THRESHOLD) jitCompile(function);
+  //not in a fiber , a yield() would have machine code frames to get past
+  if(function->native != NULL && vm.nativeDepth < JIT_DEPTH_MAX && vm.fiber == NULL) return runFrame(vm.frameCount - 1);
+  return true;
+}
+
+//everything but a plain interpreted call is behind one test each , the work itself is in the helpers above
+static bool call(ObjClosure* closure, int argCount) {
+  ObjFunction* function = closure->function;
+  if(function->lazy != NULL && !compileBody(function)) return false;
+  if(argCount != function->arity && !checkArity(closure,argCount)) return false;
+  if(function->inlineKind != INLINE_NONE && callInline(function,argCount)) return true;
+  if(vm.frameCount == vm.frameCapacity && !growFrames()) return false;
+  int needed = (int)(vm.stackTop - vm.stack) - argCount - 1 + function->maxStack + STACK_SLACK;
+  //the one bounds check a call pays , pushes inside the function are covered by maxStack
+  if(needed > vm.stackCapacity && !reserveStack(needed)) return false;
   CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
-  frame->ip = closure->function->chunk.code;
+  frame->ip = function->chunk.code;
   frame->slots = vm.stackTop - argCount - 1;
+  frame->frameObjects = NULL;
+  if((compilerOptions.jit || function->native != NULL) && vm.frameCount > 1) return callNative(function);
+  return true;
+}
+
+//the callee takes over the caller's frame , so a chain of tail calls runs in constant stack
+static bool tailCall(ObjClosure* closure, int argCount) {
+  if(closure->function->lazy != NULL && !compileBody(closure->function)) return false;
+  if(!checkArity(closure,argCount)) return false;
+  if(closure->function->inlineKind != INLINE_NONE && callInline(closure->function,argCount)) return true;
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  int needed = (int)(frame->slots - vm.stack) + closure->function->maxStack + STACK_SLACK;
+  if (needed > vm.stackCapacity) {
+    if (needed > STACK_MAX) {
+      runtimeError("Stack overflow.");
+      return false;
+    }
+    growStack(needed);
+  }
+  closeUpvalues(frame->slots);
+  if(frame->frameObjects != NULL){//arguments never point at these , anything passed along has escaped to the heap
+    freeObjectList(frame->frameObjects);
+    frame->frameObjects = NULL;
+  }
+  Value* callee = vm.stackTop - argCount - 1;
+  memmove(frame->slots, callee, sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
   return true;
 }
 
@@ -168,6 +481,16 @@ static bool callValue(Value callee, int argCount) {
       case OBJ_NATIVE: {
         NativeFn native = AS_NATIVE(callee);
         Value result = native(argCount, vm.stackTop - argCount);
+        if(nativeExit != NATIVE_RETURNED){
+          uint8_t how = nativeExit;
+          nativeExit = NATIVE_RETURNED;
+          if(how == NATIVE_ERROR) runtimeError("%s", nativeMessage);
+          else if(how == NATIVE_FIBER_FAILED){//the error and the fiber's frames were printed , these follow them
+            printTrace();
+            resetStack();
+          }
+          return false;
+        }
         vm.stackTop -= argCount + 1;
         push(result);
         return true;
@@ -205,13 +528,45 @@ static bool invoke(ObjString* method,int argCount){
     return invokeFromClass(instance->klass,method,argCount);
 }
 
+//a closure or a bound method takes the frame over , anything else is called as usual and OP_RETURN hands its result back
+static bool tailCallValue(Value callee,int argCount){
+    if(IS_BOUND_METHOD(callee)){
+        vm.stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+        callee = OBJ_VAL(AS_BOUND_METHOD(callee)->method);
+    }
+    return IS_CLOSURE(callee) ? tailCall(AS_CLOSURE(callee),argCount) : callValue(callee,argCount);
+}
+
+//invoke() for a method call right before a return
+static bool tailInvoke(ObjString* method,int argCount){
+    Value receiver = peek(argCount);
+    if(!IS_INSTANCE(receiver)){
+        runtimeError("Only instances have methods.");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(receiver);
+    Value value;
+    if(tableGet(&instance->fields,method,&value)){
+        vm.stackTop[-argCount-1] = value;
+        return tailCallValue(value,argCount);
+    }
+    if(!tableGet(&instance->klass->methods,method,&value)){
+        runtimeError("Undefined property '%s'.",method->chars);
+        return false;
+    }
+    return tailCall(AS_CLOSURE(value),argCount);
+}
+
 static bool bindMethod(ObjClass* klass, ObjString* name) {
   Value method;
   if (!tableGet(&klass->methods, name, &method)) {
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
-  
+  if(AS_CLOSURE(method)->function->arity<0){//getters run right away , the receiver already sits where slot 0 goes so no bound method is needed
+    return call(AS_CLOSURE(method),0);
+  }
+
   ObjBoundMethod* bound = newBoundMethod(peek(0),
                                          AS_CLOSURE(method));
   
@@ -300,7 +655,70 @@ static void concatenate() {
   push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
+//<= and >= are compiled as the negated opposite test , so NaN behaves the same way here
+static inline bool loopContinues(double counter,double limit,uint8_t comparison){
+    switch(comparison){
+        case LOOP_LESS: return counter < limit;
+        case LOOP_LESS_EQUAL: return !(counter > limit);
+        case LOOP_GREATER: return counter > limit;
+        default: return !(counter < limit);
+    }
+}
+
+//on stack replacement for a loop the trace compiler gave up on , the frame carries on in the function's
+//baseline machine code from the loop header. that code keeps values on the vm stack the same way run()
+//does , so slots and stack are handed over as they are. this is what gets a long loop in <script> ,
+//which is never called again , out of the interpreter
+static bool enterLoop(CallFrame* frame,uint8_t* header){
+    ObjFunction* function = frame->closure->function;
+    if(function->native == NULL && function->calls < JIT_THRESHOLD){
+        function->calls = JIT_THRESHOLD;//one try , call() won't compile it again either
+        jitCompile(function);
+    }
+    //nativeSize 0 is code from --emit-c , which can only be entered at the top
+    if(function->native == NULL || function->nativeSize == 0 || vm.nativeDepth >= JIT_DEPTH_MAX || vm.fiber != NULL) return false;
+    frame->ip = header;//the machine code picks its entry from frame->ip
+    return true;
+}
+
+//what a call site is about to run , for --dump-feedback's call counts. calls answered by callInline() count
+//too , NULL for natives and classes without an initializer
+static ObjFunction* calledFunction(Value callee){
+  if(IS_CLOSURE(callee)) return AS_CLOSURE(callee)->function;
+  if(IS_BOUND_METHOD(callee)) return AS_BOUND_METHOD(callee)->method->function;
+  Value initializer;
+  if(IS_CLASS(callee) && tableGet(&AS_CLASS(callee)->methods,vm.initString,&initializer)) return AS_CLOSURE(initializer)->function;
+  return NULL;
+}
+
+static ObjFunction* invokedFunction(Value receiver,ObjString* name){
+  if(!IS_INSTANCE(receiver)) return NULL;
+  Value value;
+  if(tableGet(&AS_INSTANCE(receiver)->fields,name,&value)) return calledFunction(value);
+  if(tableGet(&AS_INSTANCE(receiver)->klass->methods,name,&value)) return AS_CLOSURE(value)->function;
+  return NULL;
+}
+
+//a property get runs a getter when the name isn't a field
+static ObjFunction* getterFunction(ObjClass* klass,Value receiver,ObjString* name){
+  Value value;
+  if(IS_INSTANCE(receiver) && tableGet(&AS_INSTANCE(receiver)->fields,name,&value)) return NULL;
+  if(klass == NULL || !tableGet(&klass->methods,name,&value) || AS_CLOSURE(value)->function->arity >= 0) return NULL;
+  return AS_CLOSURE(value)->function;
+}
+
+//whether the OP_FOR_LOOP at at goes round again , worked out before it runs
+static bool forLoopRepeats(CallFrame* frame,uint8_t* at){
+  Value* constants = frame->closure->function->chunk.constants.values;
+  Value counter = frame->slots[(at[1] << 8) | at[2]];
+  Value limit = at[3] ? constants[(at[4] << 8) | at[5]] : frame->slots[(at[4] << 8) | at[5]];
+  Value step = constants[(at[7] << 8) | at[8]];
+  if(!IS_NUMBER(counter) || !IS_NUMBER(limit)) return false;
+  return loopContinues(AS_NUMBER(counter) + AS_NUMBER(step),AS_NUMBER(limit),at[6]);
+}
+
+//runs frames until the one at base returns , 0 runs the whole script
+static InterpretResult run(int base) {
   CallFrame* frame = &vm.frames[vm.frameCount - 1];
   register uint8_t* ip = frame->ip;
 #define READ_BYTE() (*ip++)
@@ -325,6 +743,14 @@ static InterpretResult run() {
     }\
     while(0)\
 
+#define NUMBER_OP(valueType,op)\
+    do{\
+    double b = AS_NUMBER(pop());\
+    double a = AS_NUMBER(pop());\
+    push(valueType(a op b));\
+    }\
+    while(0)\
+
     register uint8_t instruction;
 static void* dispatch_table[] = 
   {&&RETURN,
@@ -371,8 +797,84 @@ static void* dispatch_table[] =
   &&SUPER_INVOKE,
   &&MAKE_LIST,
   &&GET_ELEMENT,
-  &&SET_ELEMENT
+  &&SET_ELEMENT,
+  &&CALL_LOCAL,
+  &&RELEASE,
+  &&ADD_NUM,
+  &&SUBTRACT_NUM,
+  &&MULTIPLY_NUM,
+  &&DIVIDE_NUM,
+  &&LESS_NUM,
+  &&GREATER_NUM,
+  &&TAIL_CALL,
+  &&FOR_PREP,
+  &&FOR_LOOP,
+  &&TAIL_INVOKE
+  };
+//with --dump-feedback the instructions worth specializing record what they see , then run as usual. copied
+//over dispatch_table on the first run() , so the plain handlers don't test for it
+static void* profiled_table[] =
+  {&&RETURN,
+  &&CONSTANT,
+  &&NIL,
+  &&TRUE,
+  &&FALSE,
+  &&PROFILED_EQUAL,
+  &&PROFILED_GREATER,
+  &&PROFILED_LESS,
+  &&CONSTANT_LONG,
+  &&PROFILED_ADD,
+  &&PROFILED_SUBTRACT,
+  &&PROFILED_MULTIPLY,
+  &&PROFILED_DIVIDE,
+  &&NOT,
+  &&PROFILED_NEGATE,
+  &&PROFILED_POWER,
+  &&POP,
+  &&PRINT,
+  &&DEFINE_GLOBAL,
+  &&DEFINE_GLOBAL_LONG,
+  &&GET_GLOBAL,
+  &&GET_GLOBAL_LONG,
+  &&SET_GLOBAL,
+  &&SET_GLOBAL_LONG,
+  &&GET_LOCAL,
+  &&SET_LOCAL,
+  &&JUMPOP,
+  &&JUMP_IF_FALSE,
+  &&PROFILED_LOOP,
+  &&PROFILED_CALL,
+  &&CLOSURE,
+  &&GET_UPVALUE,
+  &&SET_UPVALUE,
+  &&CLOSE_UPVALUE,
+  &&CLASS,
+  &&PROFILED_GET_MEM,
+  &&PROFILED_SET_MEM,
+  &&METHOD,
+  &&PROFILED_INVOKE,
+  &&INHERIT,
+  &&PROFILED_SUPER_GET,
+  &&PROFILED_SUPER_INVOKE,
+  &&MAKE_LIST,
+  &&GET_ELEMENT,
+  &&SET_ELEMENT,
+  &&PROFILED_CALL_LOCAL,
+  &&RELEASE,
+  &&ADD_NUM,
+  &&SUBTRACT_NUM,
+  &&MULTIPLY_NUM,
+  &&DIVIDE_NUM,
+  &&LESS_NUM,
+  &&GREATER_NUM,
+  &&PROFILED_TAIL_CALL,
+  &&FOR_PREP,
+  &&PROFILED_FOR_LOOP,
+  &&PROFILED_TAIL_INVOKE
   };
+    if(compilerOptions.feedback && dispatch_table[OP_CALL] != profiled_table[OP_CALL]){
+        memcpy(dispatch_table,profiled_table,sizeof(dispatch_table));
+    }
     JUMP:
     instruction = READ_BYTE();
 
@@ -396,13 +898,13 @@ static void* dispatch_table[] =
         {
         Value result = pop();
         closeUpvalues(frame->slots);
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-            pop();
-          return INTERPRET_OK;
+        if(frame->frameObjects != NULL){
+            freeObjectList(frame->frameObjects);
         }
+        vm.frameCount--;
         vm.stackTop = frame->slots;
-        push(result);
+        push(result);//the bottom frame's too , a fiber returns it from resume()
+        if (vm.frameCount == base) return INTERPRET_OK;
         frame = &vm.frames[vm.frameCount - 1];
         ip = frame->ip;
         goto JUMP;
@@ -510,25 +1012,26 @@ static void* dispatch_table[] =
     GET_GLOBAL:
         {
             ObjString* name = AS_STRING(READ_CONSTANT());
-            Value value;
-            if(!tableGet(&vm.globals,name,&value)){
+            //not tableGet() , a local whose address is taken costs the dispatch a register , see MakeFile
+            Value* value = tableValueAddress(&vm.globals,name);
+            if(value == NULL){
                 frame->ip = ip;
                 runtimeError("Undefined variable '%s'.",name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(value);
+            push(*value);
             goto JUMP;
         }
     GET_GLOBAL_LONG:
         {
             ObjString* name = AS_STRING(READ_CONSTANT_LONG());
-            Value value;
-            if(!tableGet(&vm.globals,name,&value)){
+            Value* value = tableValueAddress(&vm.globals,name);
+            if(value == NULL){
                 frame->ip = ip;
                 runtimeError("Undefined variable '%s'.",name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(value);
+            push(*value);
             goto JUMP;
         }
     SET_GLOBAL:
@@ -587,6 +1090,7 @@ static void* dispatch_table[] =
         {
             uint16_t combined = READ_SHORT();
             ip -= combined;
+            if(compilerOptions.jit) goto HOT_LOOP;
             goto JUMP;
         }
     CALL:
@@ -608,9 +1112,11 @@ static void* dispatch_table[] =
             for (int i = 0; i < closure->upvalueCount; i++) {
                 uint8_t isLocal = READ_BYTE();
                 uint16_t index = READ_SHORT();
-                if (isLocal) {
+                if (isLocal == 2) {//never assigned , copy it
+                    closure->upvalues[i] = frame->slots[index];
+                } else if (isLocal) {
                     closure->upvalues[i] =
-                        captureUpvalue(frame->slots + index);
+                        OBJ_VAL(captureUpvalue(frame->slots + index));
                 } else {
                     closure->upvalues[i] = frame->closure->upvalues[index];
                 }
@@ -620,13 +1126,14 @@ static void* dispatch_table[] =
     GET_UPVALUE:
     {
         uint16_t slot = READ_SHORT();
-        push(*frame->closure->upvalues[slot]->location);
+        Value upvalue = frame->closure->upvalues[slot];
+        push(IS_UPVALUE(upvalue) ? *AS_UPVALUE(upvalue)->location : upvalue);
         goto JUMP;
     }
     SET_UPVALUE:
     {
         uint16_t slot = READ_SHORT();
-        *frame->closure->upvalues[slot]->location = peek(0);
+        *AS_UPVALUE(frame->closure->upvalues[slot])->location = peek(0);
         goto JUMP;
     }
     CLOSE_UPVALUE:
@@ -651,23 +1158,20 @@ static void* dispatch_table[] =
             return INTERPRET_RUNTIME_ERROR;
         }
         ObjInstance* instance = AS_INSTANCE(peek(0));
-        Value value;
-        if(tableGet(&instance->fields,name,&value)){
-            pop();
-            push(value);
+        Value* value = tableValueAddress(&instance->fields,name);
+        if(value != NULL){
+            vm.stackTop[-1] = *value;
             goto JUMP;
         }
         frame->ip = ip;
+        if(instance->obj.isFrameLocal){//a method gets to see the receiver so it can no longer stay on the frame
+            promoteObject(&frame->frameObjects,(Obj*)instance);
+        }
         if(!bindMethod(instance->klass, name)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        if(IS_BOUND_METHOD(peek(0))&&AS_BOUND_METHOD(peek(0))->method->function->arity<0){
-            if(!callValue(peek(0),0)){
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &vm.frames[vm.frameCount-1];
-            ip = frame->ip;
-        }
+        frame = &vm.frames[vm.frameCount-1];
+        ip = frame->ip;
         goto JUMP;
     }
     SET_MEM:
@@ -723,13 +1227,8 @@ static void* dispatch_table[] =
         if(!bindMethod(superclass,name)){
             return INTERPRET_RUNTIME_ERROR;
         }
-        if(IS_BOUND_METHOD(peek(0))&&AS_BOUND_METHOD(peek(0))->method->function->arity<0){
-            if(!callValue(peek(0),0)){
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &vm.frames[vm.frameCount-1];
-            ip = frame->ip;
-        }
+        frame = &vm.frames[vm.frameCount-1];
+        ip = frame->ip;
         goto JUMP;
     }
     SUPER_INVOKE:{
@@ -800,7 +1299,182 @@ static void* dispatch_table[] =
         pop();
         goto JUMP;
     }
+    CALL_LOCAL:{//same as OP_CALL except a class without an initializer gets a frame local instance
+        uint8_t argCount = READ_BYTE();
+        frame->ip = ip;
+        Value callee = peek(argCount);
+        if(IS_CLASS(callee)&&argCount==0&&tableValueAddress(&AS_CLASS(callee)->methods,vm.initString) == NULL){
+            vm.stackTop[-1] = OBJ_VAL(newFrameInstance(AS_CLASS(callee),&frame->frameObjects));
+            goto JUMP;
+        }
+        if (!callValue(callee, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        ip = frame->ip;
+        goto JUMP;
+    }
+    RELEASE:{//pops a local going out of scope and frees it if it was frame local
+        Value value = pop();
+        if(IS_OBJ(value)&&AS_OBJ(value)->isFrameLocal){
+            releaseObject(&frame->frameObjects,AS_OBJ(value));
+        }
+        goto JUMP;
+    }
+    //the optimizer already proved both operands are numbers
+    ADD_NUM:
+        NUMBER_OP(NUMBER_VAL,+);goto JUMP;
+    SUBTRACT_NUM:
+        NUMBER_OP(NUMBER_VAL,-);goto JUMP;
+    MULTIPLY_NUM:
+        NUMBER_OP(NUMBER_VAL,*);goto JUMP;
+    DIVIDE_NUM:
+        NUMBER_OP(NUMBER_VAL,/);goto JUMP;
+    LESS_NUM:
+        NUMBER_OP(BOOL_VAL,<);goto JUMP;
+    GREATER_NUM:
+        NUMBER_OP(BOOL_VAL,>);goto JUMP;
+    TAIL_CALL:{//always followed by OP_RETURN , which handles callees that can't take the frame over
+        uint8_t argCount = READ_BYTE();
+        frame->ip = ip;
+        if(!tailCallValue(peek(argCount),argCount)){
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        ip = frame->ip;
+        goto JUMP;
+    }
+    TAIL_INVOKE:{//always followed by OP_RETURN , like TAIL_CALL
+        ip += 3;
+        ObjString* method = AS_STRING(frame->closure->function->chunk.constants.values[(ip[-3] << 8) | ip[-2]]);
+        int argCount = ip[-1];
+        frame->ip = ip;
+        if(!tailInvoke(method,argCount)){
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        ip = frame->ip;
+        goto JUMP;
+    }
+    FOR_PREP:{//operands are read one at a time , READ_SHORT() leaves the order of its two reads unsequenced
+        ip += 2;
+        uint16_t slot = (uint16_t)((ip[-2] << 8) | ip[-1]);
+        uint8_t limitIsConstant = READ_BYTE();
+        ip += 2;
+        uint16_t limitIndex = (uint16_t)((ip[-2] << 8) | ip[-1]);
+        uint8_t comparison = READ_BYTE();
+        ip += 2;
+        uint16_t offset = (uint16_t)((ip[-2] << 8) | ip[-1]);
+        Value counter = frame->slots[slot];
+        Value limit = limitIsConstant ? frame->closure->function->chunk.constants.values[limitIndex] : frame->slots[limitIndex];
+        if(!IS_NUMBER(counter) || !IS_NUMBER(limit)){
+            frame->ip = ip;
+            runtimeError("Operands must be numbers.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        if(!loopContinues(AS_NUMBER(counter),AS_NUMBER(limit),comparison)) ip += offset;
+        goto JUMP;
+    }
+    FOR_LOOP:{//counter = counter + step , then the test , then back to the top of the body
+        ip += 2;
+        uint16_t slot = (uint16_t)((ip[-2] << 8) | ip[-1]);
+        uint8_t limitIsConstant = READ_BYTE();
+        ip += 2;
+        uint16_t limitIndex = (uint16_t)((ip[-2] << 8) | ip[-1]);
+        uint8_t comparison = READ_BYTE();
+        ip += 2;
+        Value step = frame->closure->function->chunk.constants.values[(ip[-2] << 8) | ip[-1]];
+        ip += 2;
+        uint16_t offset = (uint16_t)((ip[-2] << 8) | ip[-1]);
+        Value counter = frame->slots[slot];
+        Value limit = limitIsConstant ? frame->closure->function->chunk.constants.values[limitIndex] : frame->slots[limitIndex];
+        if(!IS_NUMBER(counter) || !IS_NUMBER(limit)){
+            frame->ip = ip;
+            //a string counter would have been concatenated and only failed the comparison
+            runtimeError(IS_NUMBER(counter) || IS_STRING(counter) ? "Operands must be numbers." : "Operands must be two numbers or two strings.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        double next = AS_NUMBER(counter) + AS_NUMBER(step);
+        frame->slots[slot] = NUMBER_VAL(next);
+        if(loopContinues(next,AS_NUMBER(limit),comparison)){
+            ip -= offset;
+            if(compilerOptions.jit) goto HOT_LOOP;
+        }
+        goto JUMP;
+    }
+    HOT_LOOP:{//every backward jump with --jit , ip is the loop header
+        uint8_t* header = ip;
+        ip = hotLoop(frame,header);
+        if(ip != NULL) goto JUMP;
+        ip = header;
+        if(!enterLoop(frame,header)) goto JUMP;
+        //the machine code runs the frame until it returns , after that it is the same as RETURN
+        if(!runFrame(vm.frameCount - 1)) return INTERPRET_RUNTIME_ERROR;
+        if(vm.frameCount == base) return INTERPRET_OK;
+        frame = &vm.frames[vm.frameCount - 1];
+        ip = frame->ip;
+        goto JUMP;
+    }
+    //the profiled_table handlers , ip is just past the opcode
+#define PROFILE_OPERANDS(op) PROFILED_##op: \
+        feedbackOperands(frame->closure->function,ip - 1,peek(1),peek(0)); \
+        goto op;
+    PROFILE_OPERANDS(EQUAL)
+    PROFILE_OPERANDS(GREATER)
+    PROFILE_OPERANDS(LESS)
+    PROFILE_OPERANDS(ADD)
+    PROFILE_OPERANDS(SUBTRACT)
+    PROFILE_OPERANDS(MULTIPLY)
+    PROFILE_OPERANDS(DIVIDE)
+    PROFILE_OPERANDS(POWER)
+#undef PROFILE_OPERANDS
+    PROFILED_NEGATE:
+        feedbackOperands(frame->closure->function,ip - 1,peek(0),peek(0));
+        goto NEGATE;
+    PROFILED_LOOP:
+        feedbackLoop(frame->closure->function,ip - 1);
+        goto LOOP;
+    PROFILED_FOR_LOOP:
+        if(forLoopRepeats(frame,ip - 1)) feedbackLoop(frame->closure->function,ip - 1);
+        goto FOR_LOOP;
+#define PROFILE_CALL(op) PROFILED_##op: \
+        feedbackCall(frame->closure->function,ip - 1,peek(ip[0])); \
+        feedbackInvocation(calledFunction(peek(ip[0]))); \
+        goto op;
+    PROFILE_CALL(CALL)
+    PROFILE_CALL(CALL_LOCAL)
+    PROFILE_CALL(TAIL_CALL)
+#undef PROFILE_CALL
+#define PROFILE_INVOKE(op) PROFILED_##op: \
+        feedbackReceiver(frame->closure->function,ip - 1,peek(ip[2])); \
+        feedbackInvocation(invokedFunction(peek(ip[2]),AS_STRING(frame->closure->function->chunk.constants.values[(ip[0] << 8) | ip[1]]))); \
+        goto op;
+    PROFILE_INVOKE(INVOKE)
+    PROFILE_INVOKE(TAIL_INVOKE)
+#undef PROFILE_INVOKE
+    PROFILED_SUPER_INVOKE:{
+        ObjString* name = AS_STRING(frame->closure->function->chunk.constants.values[(ip[0] << 8) | ip[1]]);
+        Value* method = tableValueAddress(&AS_CLASS(peek(0))->methods,name);
+        if(method != NULL) feedbackInvocation(AS_CLOSURE(*method)->function);
+        goto SUPER_INVOKE;
+    }
+    PROFILED_GET_MEM:{
+        Value receiver = peek(0);
+        ObjString* name = AS_STRING(frame->closure->function->chunk.constants.values[(ip[0] << 8) | ip[1]]);
+        feedbackReceiver(frame->closure->function,ip - 1,receiver);
+        feedbackInvocation(getterFunction(IS_INSTANCE(receiver) ? AS_INSTANCE(receiver)->klass : NULL,receiver,name));
+        goto GET_MEM;
+    }
+    PROFILED_SUPER_GET:{
+        ObjString* name = AS_STRING(frame->closure->function->chunk.constants.values[(ip[0] << 8) | ip[1]]);
+        feedbackInvocation(getterFunction(AS_CLASS(peek(0)),NIL_VAL,name));
+        goto SUPER_GET;
+    }
+    PROFILED_SET_MEM:
+        feedbackReceiver(frame->closure->function,ip - 1,peek(1));
+        goto SET_MEM;
 #undef BINARY_OP        
+#undef NUMBER_OP
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_CONSTANT_LONG
@@ -808,13 +1482,503 @@ static void* dispatch_table[] =
 #undef READ_BYTE
 }
 
+//runs the frame at index until it returns , as machine code for as long as its function has some
+static bool runFrame(int index){
+    for(;;){
+        CallFrame* frame = &vm.frames[index];
+        NativeCode native = (NativeCode)frame->closure->function->native;
+        if(native == NULL || vm.nativeDepth >= JIT_DEPTH_MAX) return run(index) == INTERPRET_OK;
+        vm.nativeDepth++;
+        JitStatus status = native(frame,&vm);
+        vm.nativeDepth--;
+        if(status != JIT_TAIL_CALLED) return status == JIT_RETURNED;
+    }
+}
+
+//a fiber runs on this C stack , in a run() of its own that resume() starts. yield() and transfer() fail the
+//call they were made by (see callValue) , which unwinds that run() back to resume() with the fiber's stacks
+//left exactly as they were. machine code never runs in a fiber , so there is nothing else on the C stack
+//to get past. the switch itself swaps the vm's stack fields , nothing is copied
+
+static THREAD_LOCAL ObjFiber* transferTarget = NULL;
+static THREAD_LOCAL Value switchValue;//what yield() or transfer() was given
+
+static void saveStacks(FiberStacks* stacks){
+    stacks->frames = vm.frames;
+    stacks->frameCount = vm.frameCount;
+    stacks->frameCapacity = vm.frameCapacity;
+    stacks->stack = vm.stack;
+    stacks->stackTop = vm.stackTop;
+    stacks->stackCapacity = vm.stackCapacity;
+    stacks->openUpvalues = vm.openUpvalues;
+}
+
+static void loadStacks(FiberStacks* stacks){
+    vm.frames = stacks->frames;
+    vm.frameCount = stacks->frameCount;
+    vm.frameCapacity = stacks->frameCapacity;
+    vm.stack = stacks->stack;
+    vm.stackTop = stacks->stackTop;
+    vm.stackCapacity = stacks->stackCapacity;
+    vm.openUpvalues = stacks->openUpvalues;
+}
+
+static FiberStacks* stacksOf(ObjFiber* fiber){
+    return fiber != NULL ? &fiber->saved : &vm.script;
+}
+
+static bool resumable(ObjFiber* fiber){
+    if(fiber->state == FIBER_RUNNING){
+        nativeError("Can't resume a fiber that is running.");
+        return false;
+    }
+    if(fiber->state == FIBER_DONE){
+        nativeError("Can't resume a fiber that is done.");
+        return false;
+    }
+    return true;
+}
+
+//the fiber starts with value as its argument , if its function takes one
+static InterpretResult startFiber(ObjFiber* fiber,Value value){
+    ObjFunction* function = fiber->function->function;
+    if(function->lazy != NULL && !compileBody(function)) return INTERPRET_RUNTIME_ERROR;
+    int argCount = function->arity > 0 ? 1 : 0;//more than one fails in call()
+    push(OBJ_VAL(fiber->function));
+    if(argCount == 1) push(value);
+    if(compilerOptions.feedback) feedbackInvocation(function);
+    if(!call(fiber->function,argCount)) return INTERPRET_RUNTIME_ERROR;
+    return vm.frameCount == 0 ? INTERPRET_OK : run(0);//an inline body answers without a frame
+}
+
+//runs fiber , and whatever it transfers to , until one of them yields , returns or fails
+static Value runFiber(ObjFiber* fiber,Value value){
+    ObjFiber* resumer = vm.fiber;
+    saveStacks(stacksOf(resumer));
+    for(;;){
+        uint8_t state = fiber->state;
+        fiber->state = FIBER_RUNNING;
+        fiber->caller = resumer;
+        vm.fiber = fiber;
+        loadStacks(&fiber->saved);
+        InterpretResult result;
+        if(state == FIBER_NEW) result = startFiber(fiber,value);
+        else{
+            vm.stackTop -= fiber->pending;//the call to yield() or transfer() , which returns value
+            push(value);
+            result = run(0);
+        }
+        if(result == INTERPRET_OK){
+            value = pop();
+            fiber->state = FIBER_DONE;
+        }
+        else if(fiber->state == FIBER_SUSPENDED) value = switchValue;
+        else{
+            fiber->state = FIBER_DONE;
+            nativeExit = NATIVE_FIBER_FAILED;
+        }
+        saveStacks(&fiber->saved);
+        fiber->caller = NULL;
+        if(fiber->state != FIBER_SUSPENDED || transferTarget == NULL) break;
+        fiber = transferTarget;
+        transferTarget = NULL;
+    }
+    vm.fiber = resumer;
+    loadStacks(stacksOf(resumer));
+    return value;
+}
+
+//fiber(function) , the function takes the first value it is resumed with if it has a parameter
+static Value fiberNative(int argCount,Value* args){
+    if(argCount != 1 || !IS_CLOSURE(args[0])){
+        nativeError("fiber() takes a function.");
+        return NIL_VAL;
+    }
+    return OBJ_VAL(newFiber(AS_CLOSURE(args[0])));
+}
+
+//resume(fiber) or resume(fiber,value) , returns what the fiber yields or returns
+static Value resumeNative(int argCount,Value* args){
+    if(argCount < 1 || argCount > 2 || !IS_FIBER(args[0])){
+        nativeError("resume() takes a fiber and an optional value.");
+        return NIL_VAL;
+    }
+    if(!resumable(AS_FIBER(args[0]))) return NIL_VAL;
+    return runFiber(AS_FIBER(args[0]),argCount == 2 ? args[1] : NIL_VAL);
+}
+
+//gives value to whoever resumed the running fiber , and returns what it is resumed with next
+static Value yieldNative(int argCount,Value* args){
+    if(vm.fiber == NULL){
+        nativeError("Can't yield from the script.");
+        return NIL_VAL;
+    }
+    vm.fiber->state = FIBER_SUSPENDED;
+    vm.fiber->pending = argCount + 1;
+    switchValue = argCount > 0 ? args[0] : NIL_VAL;
+    nativeExit = NATIVE_SWITCHED;
+    return NIL_VAL;
+}
+
+//transfer(fiber) or transfer(fiber,value) , the running fiber stops and the other one takes its place ,
+//so when that one yields or returns it is to whoever was waiting on this one. from the script it is resume()
+static Value transferNative(int argCount,Value* args){
+    if(argCount < 1 || argCount > 2 || !IS_FIBER(args[0])){
+        nativeError("transfer() takes a fiber and an optional value.");
+        return NIL_VAL;
+    }
+    ObjFiber* target = AS_FIBER(args[0]);
+    if(!resumable(target)) return NIL_VAL;
+    Value value = argCount == 2 ? args[1] : NIL_VAL;
+    if(vm.fiber == NULL) return runFiber(target,value);
+    vm.fiber->state = FIBER_SUSPENDED;
+    vm.fiber->pending = argCount + 1;
+    transferTarget = target;
+    switchValue = value;
+    nativeExit = NATIVE_SWITCHED;
+    return NIL_VAL;
+}
+
+static Value isDoneNative(int argCount,Value* args){
+    if(argCount != 1 || !IS_FIBER(args[0])){
+        nativeError("isDone() takes a fiber.");
+        return NIL_VAL;
+    }
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+//one instruction for the machine code , same as in run()
+CallFrame* jitStep(CallFrame* frame,uint8_t* at){
+    int index = (int)(frame - vm.frames);
+    Chunk* chunk = &frame->closure->function->chunk;
+    uint8_t* ip = at + 1;
+    frame->ip = ip;//only runtimeError() reads it , a machine code frame never goes back to run()
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2,(uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (chunk->constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() (chunk->constants.values[READ_SHORT()])
+#define BINARY_OP(valueType,op)\
+    do{\
+    if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))){\
+        runtimeError("Operands must be numbers.");\
+        return NULL;\
+    }\
+    double b = AS_NUMBER(pop());\
+    double a = AS_NUMBER(pop());\
+    push(valueType(a op b));\
+    }\
+    while(0)
+    switch(*at){
+        case OP_ADD:
+            if ((IS_STRING(peek(0)) && IS_NUMBER(peek(1)))
+            || (IS_NUMBER(peek(0)) && IS_STRING(peek(1)))
+            || (IS_STRING(peek(0)) && IS_STRING(peek(1)))) {
+                concatenate();
+            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                BINARY_OP(NUMBER_VAL,+);
+            } else {
+                runtimeError("Operands must be two numbers or two strings.");
+                return NULL;
+            }
+            break;
+        case OP_SUBTRACT: BINARY_OP(NUMBER_VAL,-); break;
+        case OP_MULTIPLY: BINARY_OP(NUMBER_VAL,*); break;
+        case OP_DIVIDE: BINARY_OP(NUMBER_VAL,/); break;
+        case OP_LESS: BINARY_OP(BOOL_VAL,<); break;
+        case OP_GREATER: BINARY_OP(BOOL_VAL,>); break;
+        case OP_NEGATE:
+            if(!IS_NUMBER(peek(0))){
+                runtimeError("Operand must be a number.");
+                return NULL;
+            }
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            break;
+        case OP_POWER:{
+            if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))){
+                runtimeError("Operands must be numbers.");
+                return NULL;
+            }
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(NUMBER_VAL(pow(a,b)));
+            break;
+        }
+        case OP_PRINT:
+            printValue(pop());
+            printf("\n");
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:{
+            ObjString* name = AS_STRING(*at == OP_DEFINE_GLOBAL ? READ_CONSTANT() : READ_CONSTANT_LONG());
+            tableSet(&vm.globals,name,peek(0));
+            pop();
+            break;
+        }
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:{
+            ObjString* name = AS_STRING(*at == OP_GET_GLOBAL ? READ_CONSTANT() : READ_CONSTANT_LONG());
+            Value value;
+            if(!tableGet(&vm.globals,name,&value)){
+                runtimeError("Undefined variable '%s'.",name->chars);
+                return NULL;
+            }
+            push(value);
+            break;
+        }
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:{
+            ObjString* name = AS_STRING(*at == OP_SET_GLOBAL ? READ_CONSTANT() : READ_CONSTANT_LONG());
+            if(tableSet(&vm.globals,name,peek(0))){
+                tableDelete(&vm.globals,name);
+                runtimeError("Undefined variable '%s'.",name->chars);
+                return NULL;
+            }
+            break;
+        }
+        case OP_CALL:{
+            uint8_t argCount = READ_BYTE();
+            if(!callValue(peek(argCount),argCount)) return NULL;
+            break;
+        }
+        case OP_CLOSURE:{
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT_LONG());
+            ObjClosure* closure = newClosure(function);
+            push(OBJ_VAL(closure));
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint16_t slot = READ_SHORT();
+                if (isLocal == 2) {
+                    closure->upvalues[i] = frame->slots[slot];
+                } else if (isLocal) {
+                    closure->upvalues[i] = OBJ_VAL(captureUpvalue(frame->slots + slot));
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[slot];
+                }
+            }
+            break;
+        }
+        case OP_GET_UPVALUE:{
+            Value upvalue = frame->closure->upvalues[READ_SHORT()];
+            push(IS_UPVALUE(upvalue) ? *AS_UPVALUE(upvalue)->location : upvalue);
+            break;
+        }
+        case OP_SET_UPVALUE:
+            *AS_UPVALUE(frame->closure->upvalues[READ_SHORT()])->location = peek(0);
+            break;
+        case OP_CLOSE_UPVALUE:
+            closeUpvalues(vm.stackTop - 1);
+            pop();
+            break;
+        case OP_CLASS:
+            push(OBJ_VAL(newClass(AS_STRING(READ_CONSTANT_LONG()))));
+            break;
+        case OP_GET_PROPERTY:{
+            ObjString* name = AS_STRING(READ_CONSTANT_LONG());
+            if(!IS_INSTANCE(peek(0))){
+                runtimeError("Only instances have properties.");
+                return NULL;
+            }
+            ObjInstance* instance = AS_INSTANCE(peek(0));
+            Value value;
+            if(tableGet(&instance->fields,name,&value)){
+                pop();
+                push(value);
+                break;
+            }
+            if(instance->obj.isFrameLocal){
+                promoteObject(&frame->frameObjects,(Obj*)instance);
+            }
+            if(!bindMethod(instance->klass,name)) return NULL;
+            break;
+        }
+        case OP_SET_PROPERTY:{
+            ObjString* name = AS_STRING(READ_CONSTANT_LONG());
+            Value value = peek(0);
+            if(!IS_INSTANCE(peek(1))){
+                runtimeError("Only instances have fields.");
+                return NULL;
+            }
+            tableSet(&AS_INSTANCE(peek(1))->fields,name,value);
+            pop();
+            pop();
+            push(value);
+            break;
+        }
+        case OP_METHOD:
+            defineMethod(AS_STRING(READ_CONSTANT_LONG()));
+            break;
+        case OP_INVOKE:{
+            ObjString* method = AS_STRING(READ_CONSTANT_LONG());
+            int argCount = READ_BYTE();
+            if(!invoke(method,argCount)) return NULL;
+            break;
+        }
+        case OP_INHERIT:{
+            Value superclass = peek(1);
+            if(!IS_CLASS(superclass)){
+                runtimeError("Superclass must be a class.");
+                return NULL;
+            }
+            tableAddAll(&AS_CLASS(superclass)->methods,&AS_CLASS(peek(0))->methods);
+            pop();
+            break;
+        }
+        case OP_GET_SUPER:{
+            ObjString* name = AS_STRING(READ_CONSTANT_LONG());
+            if(!bindMethod(AS_CLASS(pop()),name)) return NULL;
+            break;
+        }
+        case OP_INVOKE_SUPER:{
+            ObjString* method = AS_STRING(READ_CONSTANT_LONG());
+            int argCount = READ_BYTE();
+            if(!invokeFromClass(AS_CLASS(pop()),method,argCount)) return NULL;
+            break;
+        }
+        case OP_MAKE_LIST:{
+            int length = READ_SHORT();
+            ObjList* list = newList();
+            push(OBJ_VAL(list));
+            for(int i = 0; i < length; i++){
+                writeValueArray(&list->objects,peek(length - i));
+            }
+            vm.stackTop -= length + 1;
+            push(OBJ_VAL(list));
+            break;
+        }
+        case OP_GET_ELEMENT:{
+            if(!IS_NUMBER(peek(0))){
+                runtimeError("Index must be a number.");
+                return NULL;
+            }
+            int element = AS_NUMBER(pop());
+            if(!IS_LIST(peek(0))){
+                runtimeError("Only lists have elements.");
+                return NULL;
+            }
+            ObjList* list = AS_LIST(pop());
+            if(element < 0 || element >= list->objects.count){
+                runtimeError("Index out of bounds.");
+                return NULL;
+            }
+            push(list->objects.values[element]);
+            break;
+        }
+        case OP_SET_ELEMENT:{
+            if(!IS_NUMBER(peek(1))){
+                runtimeError("Index must be a number.");
+                return NULL;
+            }
+            int element = AS_NUMBER(peek(1));
+            if(!IS_LIST(peek(2))){
+                runtimeError("Only lists have elements.");
+                return NULL;
+            }
+            ObjList* list = AS_LIST(peek(2));
+            if(element < 0 || element >= list->objects.count){
+                runtimeError("Index out of bounds.");
+                return NULL;
+            }
+            list->objects.values[element] = peek(0);
+            pop();
+            pop();
+            break;
+        }
+        case OP_CALL_LOCAL:{
+            uint8_t argCount = READ_BYTE();
+            Value callee = peek(argCount);
+            Value initializer;
+            if(IS_CLASS(callee)&&argCount==0&&!tableGet(&AS_CLASS(callee)->methods,vm.initString,&initializer)){
+                vm.stackTop[-1] = OBJ_VAL(newFrameInstance(AS_CLASS(callee),&frame->frameObjects));
+                break;
+            }
+            if(!callValue(callee,argCount)) return NULL;
+            break;
+        }
+        case OP_RELEASE:{
+            Value value = pop();
+            if(IS_OBJ(value)&&AS_OBJ(value)->isFrameLocal){
+                releaseObject(&frame->frameObjects,AS_OBJ(value));
+            }
+            break;
+        }
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:{//the machine code runs the loop itself and only comes here when something isn't a number
+            Value counter = frame->slots[READ_SHORT()];
+            runtimeError(*at == OP_FOR_LOOP && !IS_NUMBER(counter) && !IS_STRING(counter) ?
+                "Operands must be two numbers or two strings." : "Operands must be numbers.");
+            return NULL;
+        }
+        default:
+            runtimeError("Unknown opcode %d.",*at);
+            return NULL;
+    }
+#undef BINARY_OP
+#undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef READ_SHORT
+#undef READ_BYTE
+    //a callee that got a frame rather than an inline answer runs to completion before the caller goes on
+    if(vm.frameCount > index + 1 && !runFrame(index + 1)) return NULL;
+    return &vm.frames[index];
+}
+
+//OP_CALL is common enough to skip jitStep's decoding
+CallFrame* jitCall(CallFrame* frame,uint8_t* at){
+    int index = (int)(frame - vm.frames);
+    uint8_t argCount = at[1];
+    frame->ip = at + 2;
+    if(!callValue(peek(argCount),argCount)) return NULL;
+    if(vm.frameCount > index + 1 && !runFrame(index + 1)) return NULL;
+    return &vm.frames[index];
+}
+
+//at isn't needed , it is there because callVm() in jit.c calls every helper through the same pointer type
+CallFrame* jitReturn(CallFrame* frame,uint8_t* at){
+    (void)at;
+    Value result = pop();
+    closeUpvalues(frame->slots);
+    if(frame->frameObjects != NULL){
+        freeObjectList(frame->frameObjects);
+    }
+    vm.frameCount--;
+    vm.stackTop = frame->slots;
+    push(result);
+    return frame;
+}
+
+//OP_TAIL_CALL and OP_TAIL_INVOKE
+CallFrame* jitTailCall(CallFrame* frame,uint8_t* at){
+    int index = (int)(frame - vm.frames);
+    uint8_t* next = at + (at[0] == OP_TAIL_CALL ? 2 : 4);
+    frame->ip = next;
+    bool called = at[0] == OP_TAIL_CALL ? tailCallValue(peek(at[1]),at[1]) :
+        tailInvoke(AS_STRING(frame->closure->function->chunk.constants.values[(at[1] << 8) | at[2]]),at[3]);
+    if(!called) return NULL;
+    if(vm.frameCount > index + 1) return runFrame(index + 1) ? &vm.frames[index] : NULL;
+    //an inline answer leaves the frame alone , otherwise tailCall() pointed ip at the callee's code
+    return frame->ip != next ? JIT_FRAME_REPLACED : frame;
+}
+
 InterpretResult interpret(const char* source){
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(function);
+}
+
+//runs a script that was already compiled , or loaded from a .loxc
+InterpretResult interpretFunction(ObjFunction* function){
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
+    if(compilerOptions.feedback) feedbackInvocation(function);
     call(closure, 0);
-    return run();
+    if(function->native != NULL){//compiled ahead of time , see aot.h
+        if(!runFrame(0)) return INTERPRET_RUNTIME_ERROR;
+        pop();
+        return INTERPRET_OK;
+    }
+    InterpretResult result = run(0);
+    if(result == INTERPRET_OK) pop();//what the script returned
+    return result;
 }
\ No newline at end of file
@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+#include "jit.h"
+#include "x64.h"
+
+#ifdef JIT_ENABLED
+#include <sys/mman.h>
+#include <unistd.h>
+
+void x64Byte(Assembler* as,uint8_t byte){
+    if(as->count == as->capacity){
+        as->capacity = as->capacity < 256 ? 256 : as->capacity*2;
+        as->code = (uint8_t*)realloc(as->code,as->capacity);
+        if(as->code == NULL) exit(1);
+    }
+    as->code[as->count++] = byte;
+}
+
+void x64Int32(Assembler* as,uint32_t value){
+    for(int i = 0; i < 4; i++) x64Byte(as,(value >> (8*i)) & 0xff);
+}
+
+void x64Int64(Assembler* as,uint64_t value){
+    for(int i = 0; i < 8; i++) x64Byte(as,(value >> (8*i)) & 0xff);
+}
+
+void x64Patch(Assembler* as,int at,int32_t value){
+    for(int i = 0; i < 4; i++) as->code[at + i] = ((uint32_t)value >> (8*i)) & 0xff;
+}
+
+void x64Rex(Assembler* as,int reg,int rm){
+    x64Byte(as,0x48 | (reg >= R8 ? 4 : 0) | (rm >= R8 ? 1 : 0));
+}
+
+void x64Alu(Assembler* as,uint8_t op,int rm,int reg){
+    x64Rex(as,reg,rm);
+    x64Byte(as,op);
+    x64Byte(as,0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+//always [base+disp32] , rsp and r12 need the sib byte
+void x64Memory(Assembler* as,int reg,int base,int32_t disp){
+    x64Byte(as,0x80 | (reg & 7) << 3 | (base & 7));
+    if((base & 7) == RSP) x64Byte(as,0x24);
+    x64Int32(as,(uint32_t)disp);
+}
+
+void x64Load(Assembler* as,int reg,int base,int32_t disp){
+    x64Rex(as,reg,base);
+    x64Byte(as,0x8b);
+    x64Memory(as,reg,base,disp);
+}
+
+void x64Store(Assembler* as,int base,int32_t disp,int reg){
+    x64Rex(as,reg,base);
+    x64Byte(as,0x89);
+    x64Memory(as,reg,base,disp);
+}
+
+void x64LoadImmediate(Assembler* as,int reg,uint64_t value){
+    x64Byte(as,0x48 | (reg >= R8 ? 1 : 0));
+    x64Byte(as,0xb8 + (reg & 7));
+    x64Int64(as,value);
+}
+
+void x64AddImmediate(Assembler* as,int reg,int32_t value){
+    x64Rex(as,0,reg);
+    x64Byte(as,0x81);
+    x64Byte(as,0xc0 | (reg & 7));
+    x64Int32(as,(uint32_t)value);
+}
+
+void x64Push(Assembler* as,int reg){
+    if(reg >= R8) x64Byte(as,0x41);
+    x64Byte(as,0x50 + (reg & 7));
+}
+
+void x64Pop(Assembler* as,int reg){
+    if(reg >= R8) x64Byte(as,0x41);
+    x64Byte(as,0x58 + (reg & 7));
+}
+
+//through rax , which it clobbers
+void x64Call(Assembler* as,void* function){
+    x64LoadImmediate(as,RAX,(uint64_t)(uintptr_t)function);
+    x64Byte(as,0xff);
+    x64Byte(as,0xd0);
+}
+
+void x64ToXmm(Assembler* as,int xmm,int reg){
+    x64Byte(as,0x66);
+    x64Rex(as,xmm,reg);
+    x64Byte(as,0x0f);
+    x64Byte(as,0x6e);
+    x64Byte(as,0xc0 | xmm << 3 | (reg & 7));
+}
+
+void x64FromXmm(Assembler* as,int reg,int xmm){
+    x64Byte(as,0x66);
+    x64Rex(as,xmm,reg);
+    x64Byte(as,0x0f);
+    x64Byte(as,0x7e);
+    x64Byte(as,0xc0 | xmm << 3 | (reg & 7));
+}
+
+void x64ScalarDouble(Assembler* as,uint8_t op,int dst,int src){
+    x64Byte(as,0xf2);
+    x64Byte(as,0x0f);
+    x64Byte(as,op);
+    x64Byte(as,0xc0 | dst << 3 | src);
+}
+
+//sets the flags like an unsigned compare of a with b , unordered sets zf , pf and cf
+void x64CompareDoubles(Assembler* as,int a,int b){
+    x64Byte(as,0x66);
+    x64Byte(as,0x0f);
+    x64Byte(as,0x2e);
+    x64Byte(as,0xc0 | a << 3 | b);
+}
+
+//al , cl , dl or bl
+void x64SetCondition(Assembler* as,int cc,int reg){
+    x64Byte(as,0x0f);
+    x64Byte(as,0x90 + cc);
+    x64Byte(as,0xc0 | reg);
+}
+
+//rax = BOOL_VAL(al) , clobbers rcx
+void x64BoxBool(Assembler* as){
+    x64Byte(as,0x0f);//movzx eax,al
+    x64Byte(as,0xb6);
+    x64Byte(as,0xc0);
+    x64LoadImmediate(as,RCX,FALSE_VAL);
+    x64Alu(as,ALU_OR,RAX,RCX);
+}
+
+//al = isFalsey(rax) , clobbers rcx and rdx
+void x64Falsey(Assembler* as){
+    x64LoadImmediate(as,RCX,FALSE_VAL);
+    x64Alu(as,ALU_CMP,RAX,RCX);
+    x64SetCondition(as,CC_E,RDX);
+    x64LoadImmediate(as,RCX,NIL_VAL);
+    x64Alu(as,ALU_CMP,RAX,RCX);
+    x64SetCondition(as,CC_E,RAX);
+    x64Byte(as,0x08);//or al,dl
+    x64Byte(as,0xd0);
+}
+
+//cc < 0 jumps always , the target gets resolved by whoever owns the patches
+void x64JumpTo(Assembler* as,int cc,int target){
+    if(cc < 0) x64Byte(as,0xe9);
+    else{
+        x64Byte(as,0x0f);
+        x64Byte(as,0x80 + cc);
+    }
+    if(as->patchCount == as->patchCapacity){
+        as->patchCapacity = as->patchCapacity < 16 ? 16 : as->patchCapacity*2;
+        as->patches = (Patch*)realloc(as->patches,sizeof(Patch)*as->patchCapacity);
+        if(as->patches == NULL) exit(1);
+    }
+    as->patches[as->patchCount].at = as->count;
+    as->patches[as->patchCount].target = target;
+    as->patchCount++;
+    x64Int32(as,0);
+}
+
+//a jump inside one template , x64Land() points it at whatever gets emitted next
+int x64JumpForward(Assembler* as,int cc){
+    if(cc < 0) x64Byte(as,0xe9);
+    else{
+        x64Byte(as,0x0f);
+        x64Byte(as,0x80 + cc);
+    }
+    x64Int32(as,0);
+    return as->count - 4;
+}
+
+void x64Land(Assembler* as,int at){
+    x64Patch(as,at,as->count - (at + 4));
+}
+
+//jumps to the returned label when reg isn't a number , needs QNAN in r15 and clobbers rcx
+int x64UnlessNumber(Assembler* as,int reg){
+    x64Alu(as,ALU_MOV,RCX,reg);
+    x64Alu(as,ALU_AND,RCX,R15);
+    x64Alu(as,ALU_CMP,RCX,R15);
+    return x64JumpForward(as,CC_E);
+}
+
+void* x64Finish(Assembler* as,size_t* size){
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    *size = ((size_t)as->count + page - 1) / page * page;
+    void* code = mmap(NULL,*size,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+    if(code == MAP_FAILED) return NULL;
+    memcpy(code,as->code,as->count);
+    if(mprotect(code,*size,PROT_READ | PROT_EXEC) != 0){
+        munmap(code,*size);
+        return NULL;
+    }
+    return code;
+}
+
+void x64Release(void* code,size_t size){
+    munmap(code,size);
+}
+
+void freeAssembler(Assembler* as){
+    free(as->code);
+    free(as->patches);
+    as->code = NULL;
+    as->patches = NULL;
+    as->count = as->capacity = as->patchCount = as->patchCapacity = 0;
+}
+
+#endif